@@ -0,0 +1,222 @@
+// Copyright (c) 2014-2015 The Dash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cachejournal.h"
+
+#include "hash.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+/** Read one record at the current position of filein, false at the end or on a torn/corrupt record */
+static bool ReadJournalRecord(FILE* filein, std::vector<char>& vchPayload)
+{
+    uint32_t nPayloadSize;
+    if (fread(&nPayloadSize, sizeof(nPayloadSize), 1, filein) != 1)
+        return false;
+    if (nPayloadSize == 0 || nPayloadSize > MAX_CACHE_JOURNAL_RECORD_SIZE)
+        return false;
+
+    vchPayload.resize(nPayloadSize);
+    if (fread(&vchPayload[0], 1, nPayloadSize, filein) != nPayloadSize)
+        return false;
+
+    unsigned int nChecksum;
+    if (fread(&nChecksum, sizeof(nChecksum), 1, filein) != 1)
+        return false;
+
+    uint256 hash = Hash(vchPayload.begin(), vchPayload.end());
+    unsigned int nChecksumTmp = 0;
+    memcpy(&nChecksumTmp, &hash, sizeof(nChecksumTmp));
+    return nChecksum == nChecksumTmp;
+}
+
+CCacheJournal::CCacheJournal(const std::string& strFilenameIn)
+{
+    strFilename = strFilenameIn;
+    file = NULL;
+    nSize = 0;
+    nReplayEnd = 0;
+    fReplaying = false;
+}
+
+CCacheJournal::~CCacheJournal()
+{
+    Close();
+}
+
+bool CCacheJournal::Open()
+{
+    LOCK(cs);
+
+    if (file != NULL)
+        return true;
+
+    pathJournal = GetDataDir() / strFilename;
+    nSize = 0;
+
+    FILE* filein = fopen(pathJournal.string().c_str(), "rb");
+    if (filein != NULL) {
+        std::vector<char> vchPayload;
+        while (ReadJournalRecord(filein, vchPayload))
+            nSize += sizeof(uint32_t) + vchPayload.size() + sizeof(unsigned int);
+        fclose(filein);
+
+        try {
+            if (boost::filesystem::file_size(pathJournal) != nSize) {
+                LogPrintf("CCacheJournal::Open() : dropping incomplete records at the end of %s\n", strFilename);
+                boost::filesystem::resize_file(pathJournal, nSize);
+            }
+        } catch (const boost::filesystem::filesystem_error& e) {
+            return error("CCacheJournal::Open() : %s", e.what());
+        }
+    }
+    nReplayEnd = nSize;
+
+    file = fopen(pathJournal.string().c_str(), "ab");
+    if (file == NULL)
+        return error("CCacheJournal::Open() : failed to open %s", pathJournal.string());
+
+    LogPrintf("Opened %s, %u bytes to replay\n", strFilename, nReplayEnd);
+    return true;
+}
+
+void CCacheJournal::Close()
+{
+    LOCK(cs);
+
+    if (file == NULL)
+        return;
+    fclose(file);
+    file = NULL;
+}
+
+bool CCacheJournal::IsOpen() const
+{
+    LOCK(cs);
+    return file != NULL;
+}
+
+uint64_t CCacheJournal::GetSize() const
+{
+    LOCK(cs);
+    return nSize;
+}
+
+void CCacheJournal::AppendRecord(const CDataStream& ssPayload)
+{
+    LOCK(cs);
+
+    if (file == NULL || fReplaying)
+        return;
+
+    uint32_t nPayloadSize = ssPayload.size();
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+
+    if (fwrite(&nPayloadSize, sizeof(nPayloadSize), 1, file) != 1 ||
+        fwrite(&ssPayload[0], 1, nPayloadSize, file) != nPayloadSize ||
+        fwrite(&nChecksum, sizeof(nChecksum), 1, file) != 1 ||
+        fflush(file) != 0) {
+        // a torn record is dropped by the next Open(), stop appending after it
+        error("CCacheJournal::AppendRecord() : failed to write to %s", strFilename);
+        fclose(file);
+        file = NULL;
+        return;
+    }
+    nSize += sizeof(nPayloadSize) + nPayloadSize + sizeof(nChecksum);
+}
+
+int CCacheJournal::Replay(RecordHandler handler)
+{
+    boost::filesystem::path pathIn;
+    uint64_t nEnd;
+    {
+        LOCK(cs);
+        pathIn = pathJournal;
+        nEnd = nReplayEnd;
+    }
+    if (nEnd == 0)
+        return 0;
+
+    FILE* filein = fopen(pathIn.string().c_str(), "rb");
+    if (filein == NULL) {
+        error("CCacheJournal::Replay() : failed to open %s", pathIn.string());
+        return 0;
+    }
+
+    {
+        LOCK(cs);
+        fReplaying = true;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    int nRecords = 0;
+    uint64_t nPos = 0;
+    std::vector<char> vchPayload;
+    while (nPos < nEnd && ReadJournalRecord(filein, vchPayload)) {
+        nPos += sizeof(uint32_t) + vchPayload.size() + sizeof(unsigned int);
+        nRecords++;
+
+        try {
+            CDataStream ssRecord(vchPayload, SER_DISK, CLIENT_VERSION);
+            std::string strType;
+            ssRecord >> strType;
+            handler(strType, ssRecord);
+        } catch (const std::exception& e) {
+            LogPrintf("CCacheJournal::Replay() : skipping bad record in %s: %s\n", strFilename, e.what());
+        }
+    }
+    fclose(filein);
+
+    {
+        LOCK(cs);
+        fReplaying = false;
+    }
+
+    LogPrintf("Replayed %d records from %s  %dms\n", nRecords, strFilename, GetTimeMillis() - nStart);
+    return nRecords;
+}
+
+bool CCacheJournal::Compact(uint64_t nOffset)
+{
+    LOCK(cs);
+
+    if (file == NULL || nOffset == 0)
+        return false;
+    if (nOffset > nSize || nOffset < nReplayEnd)
+        return error("CCacheJournal::Compact() : offset %u outside of %s", nOffset, strFilename);
+
+    // carry over the records appended while the snapshot was taken
+    std::vector<char> vchTail(nSize - nOffset);
+    fflush(file);
+    FILE* filein = fopen(pathJournal.string().c_str(), "rb");
+    if (filein == NULL)
+        return error("CCacheJournal::Compact() : failed to open %s", pathJournal.string());
+    bool fRead = fseek(filein, nOffset, SEEK_SET) == 0 &&
+        (vchTail.empty() || fread(&vchTail[0], 1, vchTail.size(), filein) == vchTail.size());
+    fclose(filein);
+    if (!fRead)
+        return error("CCacheJournal::Compact() : failed to read %s", pathJournal.string());
+
+    boost::filesystem::path pathTmp(pathJournal.string() + ".new");
+    FILE* fileout = fopen(pathTmp.string().c_str(), "wb");
+    if (fileout == NULL)
+        return error("CCacheJournal::Compact() : failed to open %s", pathTmp.string());
+    bool fWritten = vchTail.empty() || fwrite(&vchTail[0], 1, vchTail.size(), fileout) == vchTail.size();
+    FileCommit(fileout);
+    fclose(fileout);
+    if (!fWritten || !RenameOver(pathTmp, pathJournal))
+        return error("CCacheJournal::Compact() : failed to replace %s", pathJournal.string());
+
+    fclose(file);
+    file = fopen(pathJournal.string().c_str(), "ab");
+    nSize = vchTail.size();
+    nReplayEnd = 0;
+    if (file == NULL)
+        return error("CCacheJournal::Compact() : failed to reopen %s", pathJournal.string());
+
+    return true;
+}
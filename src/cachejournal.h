@@ -0,0 +1,100 @@
+// Copyright (c) 2014-2015 The Dash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef CACHEJOURNAL_H
+#define CACHEJOURNAL_H
+
+#include "clientversion.h"
+#include "serialize.h"
+#include "streams.h"
+#include "sync.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/function.hpp>
+
+/** Format version written after the magic numbers of mncache.dat, mnpayments.dat and budget.dat */
+static const int CACHE_FILE_VERSION = 1;
+
+/** Largest record accepted when reading a journal back */
+static const unsigned int MAX_CACHE_JOURNAL_RECORD_SIZE = 4 * 1024 * 1024;
+
+/**
+ * Append-only log of the objects accepted since the last snapshot of a cache file.
+ *
+ * Each record is the payload size (uint32), the payload (a type string followed by the
+ * serialized object) and the first 4 bytes of Hash(payload). Snapshots are taken in the
+ * background; once one is written, only the records appended after GetSize() was sampled
+ * for it are kept. Replaying a record the snapshot already covers must be harmless.
+ */
+class CCacheJournal
+{
+private:
+    mutable CCriticalSection cs;
+    std::string strFilename;
+    boost::filesystem::path pathJournal;
+    FILE* file;
+    // end of the last complete record
+    uint64_t nSize;
+    // records before this offset were written by a previous run and still need to be replayed
+    uint64_t nReplayEnd;
+    // while replaying, the changes the records cause are not journaled again
+    bool fReplaying;
+
+    void AppendRecord(const CDataStream& ssPayload);
+
+public:
+    typedef boost::function<void (const std::string&, CDataStream&)> RecordHandler;
+
+    CCacheJournal(const std::string& strFilenameIn);
+    ~CCacheJournal();
+
+    /// Open for appending, dropping a torn record a crash may have left at the end
+    bool Open();
+    void Close();
+    bool IsOpen() const;
+
+    template<typename T>
+    void Append(const std::string& strType, const T& obj)
+    {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << strType << obj;
+        AppendRecord(ss);
+    }
+
+    /// Feed the records left by the previous run to handler, returns how many were read
+    int Replay(RecordHandler handler);
+
+    uint64_t GetSize() const;
+
+    /// Drop the records before nOffset, a snapshot covering them has been written
+    bool Compact(uint64_t nOffset);
+};
+
+/**
+ * Deserialize obj from a cache file stream positioned after its magic numbers. Files written
+ * before CACHE_FILE_VERSION have the same data right there, without a version in front.
+ */
+template<typename T>
+void ReadCacheFileData(CDataStream& ss, T& obj, const std::string& strFilename)
+{
+    CDataStream ssUnversioned(ss);
+    int nVersion = 0;
+    ss >> nVersion;
+    if (nVersion == CACHE_FILE_VERSION) {
+        try {
+            ss >> obj;
+            return;
+        } catch (const std::exception&) {
+            // an unversioned file starting with the same four bytes
+        }
+    }
+    LogPrintf("Reading %s without a file version, written by an older version\n", strFilename);
+    ssUnversioned >> obj;
+}
+
+#endif
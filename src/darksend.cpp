@@ -7,6 +7,7 @@
 #include "init.h"
 #include "util.h"
 #include "masternodeman.h"
+#include "masternode-budget.h"
 #include "script/sign.h"
 #include "instantx.h"
 #include "ui_interface.h"
@@ -27,7 +28,7 @@ CDarksendPool darkSendPool;
 // A helper object for signing messages from Masternodes
 CDarkSendSigner darkSendSigner;
 // The current Darksends in progress on the network
-std::vector<CDarksendQueue> vecDarksendQueue;
+CDarksendQueueList darkSendQueues;
 // Keep track of the used Masternodes
 std::vector<CTxIn> vecMasternodesUsed;
 // Keep track of the scanning errors I've seen
@@ -110,14 +111,12 @@ void CDarksendPool::ProcessMessageDarksend(CNode* pfrom, std::string& strCommand
         CDarksendQueue dsq;
         vRecv >> dsq;
 
-        CService addr;
-        if(!dsq.GetAddress(addr)) return;
-        if(!dsq.CheckSignature()) return;
-
+        // cheap checks first, the signature is verified once per queue
         if(dsq.IsExpired()) return;
 
         CMasternode* pmn = mnodeman.Find(dsq.vin);
         if(pmn == NULL) return;
+        CService addr = pmn->addr;
 
         // if the queue is ready, submit if we can
         if(dsq.ready) {
@@ -126,15 +125,15 @@ void CDarksendPool::ProcessMessageDarksend(CNode* pfrom, std::string& strCommand
                 LogPrintf("dsq - message doesn't match current Masternode - %s != %s\n", pSubmittedToMasternode->addr.ToString(), addr.ToString());
                 return;
             }
+            if(!dsq.CheckSignature()) return;
 
             if(state == POOL_STATUS_QUEUE){
                 LogPrint("darksend", "Darksend queue is ready - %s\n", addr.ToString());
                 PrepareDarksendDenominate();
             }
         } else {
-            BOOST_FOREACH(CDarksendQueue q, vecDarksendQueue){
-                if(q.vin == dsq.vin) return;
-            }
+            if(darkSendQueues.Has(dsq.vin)) return;
+            if(!dsq.CheckSignature()) return;
 
             LogPrint("darksend", "dsq last %d last2 %d count %d\n", pmn->nLastDsq, pmn->nLastDsq + mnodeman.size()/5, mnodeman.nDsqCount);
             //don't allow a few nodes to dominate the queuing process
@@ -148,9 +147,8 @@ void CDarksendPool::ProcessMessageDarksend(CNode* pfrom, std::string& strCommand
             pmn->allowFreeTx = true;
 
             LogPrint("darksend", "dsq - new Darksend queue object - %s\n", addr.ToString());
-            vecDarksendQueue.push_back(dsq);
+            darkSendQueues.Add(dsq);
             dsq.Relay();
-            dsq.time = GetTime();
         }
 
     } else if (strCommand == "dsi") { //DarkSend vIn
@@ -813,21 +811,13 @@ void CDarksendPool::CheckTimeout(){
     }
 
     // check Darksend queue objects for timeouts
-    int c = 0;
-    vector<CDarksendQueue>::iterator it = vecDarksendQueue.begin();
-    while(it != vecDarksendQueue.end()){
-        if((*it).IsExpired()){
-            LogPrint("darksend", "CDarksendPool::CheckTimeout() : Removing expired queue entry - %d\n", c);
-            it = vecDarksendQueue.erase(it);
-        } else ++it;
-        c++;
-    }
+    darkSendQueues.CheckAndRemove();
 
     int addLagTime = 0;
     if(!fMasterNode) addLagTime = 10000; //if we're the client, give the server a few extra seconds before resetting.
 
     if(state == POOL_STATUS_ACCEPTING_ENTRIES || state == POOL_STATUS_QUEUE){
-        c = 0;
+        int c = 0;
 
         // check for a timeout and reset if needed
         vector<CDarkSendEntry>::iterator it2 = entries.begin();
@@ -1511,12 +1501,15 @@ bool CDarksendPool::DoAutomaticDenominating(bool fDryRun)
         if(nUseQueue > 33){
 
             // Look through the queues and see if anything matches
-            BOOST_FOREACH(CDarksendQueue& dsq, vecDarksendQueue){
+            std::vector<CDarksendQueue> vecQueues;
+            darkSendQueues.GetQueues(vecQueues);
+            // denominations our coins couldn't match, every queue with one of these fails the same way
+            std::set<int> setDenomsUnmatched;
+            BOOST_FOREACH(CDarksendQueue& dsq, vecQueues){
                 CService addr;
-                if(dsq.time == 0) continue;
+                if(setDenomsUnmatched.count(dsq.nDenom)) continue;
 
                 if(!dsq.GetAddress(addr)) continue;
-                if(dsq.IsExpired()) continue;
 
                 int protocolVersion;
                 if(!dsq.GetProtocolVersion(protocolVersion)) continue;
@@ -1540,6 +1533,7 @@ bool CDarksendPool::DoAutomaticDenominating(bool fDryRun)
                 // Try to match their denominations if possible
                 if (!pwalletMain->SelectCoinsByDenominations(dsq.nDenom, nValueMin, nBalanceNeedsAnonymized, vTempCoins, vTempCoins2, nValueIn, 0, nDarksendRounds)){
                     LogPrintf("DoAutomaticDenominating - Couldn't match denominations %d\n", dsq.nDenom);
+                    setDenomsUnmatched.insert(dsq.nDenom);
                     continue;
                 }
 
@@ -1560,12 +1554,12 @@ bool CDarksendPool::DoAutomaticDenominating(bool fDryRun)
                     pnode->PushMessage("dsa", sessionDenom, txCollateral);
                     LogPrintf("DoAutomaticDenominating --- connected (from queue), sending dsa for %d - %s\n", sessionDenom, pnode->addr.ToString());
                     strAutoDenomResult = _("Mixing in progress...");
-                    dsq.time = 0; //remove node
+                    darkSendQueues.Remove(dsq.vin, dsq.nDenom); //remove node
                     return true;
                 } else {
                     LogPrintf("DoAutomaticDenominating --- error connecting \n");
                     strAutoDenomResult = _("Error connecting to Masternode.");
-                    dsq.time = 0; //remove node
+                    darkSendQueues.Remove(dsq.vin, dsq.nDenom); //remove node
                     continue;
                 }
             }
@@ -2144,11 +2138,12 @@ bool CDarksendQueue::Sign()
 
 bool CDarksendQueue::Relay()
 {
+    CSharedMessage<CDarksendQueue> msg("dsq", *this);
 
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes){
         // always relay to everyone
-        pnode->PushMessage("dsq", (*this));
+        pnode->PushSharedMessage(msg);
     }
 
     return true;
@@ -2174,6 +2169,68 @@ bool CDarksendQueue::CheckSignature()
 }
 
 
+bool CDarksendQueueList::Add(const CDarksendQueue& dsq)
+{
+    LOCK(cs);
+
+    if(Has(dsq.vin)) return false;
+
+    std::pair<COutPoint, int> key = make_pair(dsq.vin.prevout, dsq.nDenom);
+    mapQueues[key] = dsq;
+    setExpiry.insert(make_pair(dsq.time + DARKSEND_QUEUE_TIMEOUT, key));
+    return true;
+}
+
+bool CDarksendQueueList::Has(const CTxIn& vin) const
+{
+    LOCK(cs);
+
+    // denominations are bit masks, the queues of one Masternode start at denomination 0
+    std::map<std::pair<COutPoint, int>, CDarksendQueue>::const_iterator it = mapQueues.lower_bound(make_pair(vin.prevout, 0));
+    return it != mapQueues.end() && it->first.first == vin.prevout;
+}
+
+void CDarksendQueueList::Remove(const CTxIn& vin, int nDenom)
+{
+    LOCK(cs);
+
+    // the expiry entry is dropped when it comes up
+    mapQueues.erase(make_pair(vin.prevout, nDenom));
+}
+
+void CDarksendQueueList::GetQueues(std::vector<CDarksendQueue>& vecQueuesRet) const
+{
+    LOCK(cs);
+
+    vecQueuesRet.clear();
+    int64_t nNow = GetTime();
+    std::set<std::pair<int64_t, std::pair<COutPoint, int> > >::const_iterator it = setExpiry.lower_bound(make_pair(nNow, make_pair(COutPoint(), 0)));
+    for(; it != setExpiry.end(); ++it) {
+        std::map<std::pair<COutPoint, int>, CDarksendQueue>::const_iterator itQueue = mapQueues.find(it->second);
+        if(itQueue != mapQueues.end() && !itQueue->second.IsExpired())
+            vecQueuesRet.push_back(itQueue->second);
+    }
+}
+
+void CDarksendQueueList::CheckAndRemove()
+{
+    LOCK(cs);
+
+    int64_t nNow = GetTime();
+    while(!setExpiry.empty() && setExpiry.begin()->first < nNow) {
+        std::pair<COutPoint, int> key = setExpiry.begin()->second;
+        int64_t nExpiry = setExpiry.begin()->first;
+        setExpiry.erase(setExpiry.begin());
+
+        // the queue may have been removed and announced again since
+        std::map<std::pair<COutPoint, int>, CDarksendQueue>::iterator it = mapQueues.find(key);
+        if(it != mapQueues.end() && it->second.time + DARKSEND_QUEUE_TIMEOUT == nExpiry) {
+            LogPrint("darksend", "CDarksendQueueList::CheckAndRemove() : Removing expired queue entry - %s\n", it->second.vin.ToString());
+            mapQueues.erase(it);
+        }
+    }
+}
+
 void CDarksendPool::RelayFinalTransaction(const int sessionID, const CTransaction& txNew)
 {
     LOCK(cs_vNodes);
@@ -2248,11 +2305,10 @@ void ThreadCheckDarkSendPool()
                 mnodeman.CheckAndRemove();
                 mnodeman.ProcessMasternodeConnections();
                 masternodePayments.CleanPaymentList();
-                CleanTransactionLocksList();
+                txLockManager.CheckAndRemove();
+                instantXMetrics.CheckAndRemove();
             }
 
-            //if(c % MASTERNODES_DUMP_SECONDS == 0) DumpMasternodes();
-
             darkSendPool.CheckTimeout();
             darkSendPool.CheckForCompleteQueue();
 
@@ -2262,3 +2318,21 @@ void ThreadCheckDarkSendPool()
         }
     }
 }
+
+void ThreadFlushMasternodeCaches()
+{
+    if(fLiteMode) return;
+
+    RenameThread("dash-mncache");
+
+    // snapshots are written here, in between everything accepted is appended to the journals
+    while (true)
+    {
+        MilliSleep(MASTERNODES_DUMP_SECONDS * 1000);
+
+        DumpMasternodes();
+        DumpBudgets();
+        DumpMasternodePayments();
+        DumpTransactionLocks();
+    }
+}
@@ -19,6 +19,7 @@ class CDarkSendSigner;
 class CMasterNodeVote;
 class CBitcoinAddress;
 class CDarksendQueue;
+class CDarksendQueueList;
 class CDarksendBroadcastTx;
 class CActiveMasternode;
 
@@ -51,7 +52,7 @@ static const int64_t DARKSEND_POOL_MAX = (999.99*COIN);
 
 extern CDarksendPool darkSendPool;
 extern CDarkSendSigner darkSendSigner;
-extern std::vector<CDarksendQueue> vecDarksendQueue;
+extern CDarksendQueueList darkSendQueues;
 extern std::string strMasterNodePrivKey;
 extern map<uint256, CDarksendBroadcastTx> mapDarksendBroadcastTxes;
 extern CActiveMasternode activeMasternode;
@@ -219,7 +220,7 @@ public:
     bool Relay();
 
     /// Is this Darksend expired?
-    bool IsExpired()
+    bool IsExpired() const
     {
         return (GetTime() - time) > DARKSEND_QUEUE_TIMEOUT;// 120 seconds
     }
@@ -229,6 +230,30 @@ public:
 
 };
 
+/** Darksend queues announced by Masternodes, one per Masternode, signatures are checked before they're added
+ */
+class CDarksendQueueList
+{
+private:
+    mutable CCriticalSection cs;
+
+    // by (Masternode outpoint, denomination)
+    std::map<std::pair<COutPoint, int>, CDarksendQueue> mapQueues;
+    // queue keys by the time they expire at
+    std::set<std::pair<int64_t, std::pair<COutPoint, int> > > setExpiry;
+
+public:
+    /// Add a verified queue, false if its Masternode already has one
+    bool Add(const CDarksendQueue& dsq);
+    /// Does this Masternode have a queue, whatever the denomination
+    bool Has(const CTxIn& vin) const;
+    void Remove(const CTxIn& vin, int nDenom);
+    /// Queues that haven't expired yet, oldest first
+    void GetQueues(std::vector<CDarksendQueue>& vecQueuesRet) const;
+    void CheckAndRemove();
+    int size() const { LOCK(cs); return mapQueues.size(); }
+};
+
 /** Helper class to store Darksend transaction (tx) information.
  */
 class CDarksendBroadcastTx
@@ -505,5 +530,6 @@ public:
 };
 
 void ThreadCheckDarkSendPool();
+void ThreadFlushMasternodeCaches();
 
 #endif
@@ -24,6 +24,7 @@
 #include "ui_interface.h"
 #include "util.h"
 #include "activemasternode.h"
+#include "instantx.h"
 #include "masternode-budget.h"
 #include "masternode-payments.h"
 #include "masternodeman.h"
@@ -59,6 +60,8 @@ CWallet* pwalletMain = NULL;
 int nWalletBackups = 10;
 #endif
 bool fFeeEstimatesInitialized = false;
+static CCriticalSection cs_dumpMempool;
+static bool fDumpMempoolLater = false; // protected by cs_dumpMempool
 bool fRestartRequested = false;  // true: restart false: shutdown
 
 #ifdef WIN32
@@ -169,9 +172,24 @@ void PrepareShutdown()
     GenerateBitcoins(false, NULL, 0);
 #endif
     StopNode();
-    DumpMasternodes();
-    DumpBudgets();
-    DumpMasternodePayments();
+    {
+        LOCK(cs_dumpMempool);
+        if (fDumpMempoolLater)
+            DumpMempool();
+    }
+    // write compacted snapshots, the journals only need replaying after a crash. A journal
+    // that isn't open means the cache wasn't loaded and the file on disk must be kept
+    if (mncacheJournal.IsOpen())
+        DumpMasternodes();
+    if (budgetJournal.IsOpen())
+        DumpBudgets();
+    if (mnpaymentsJournal.IsOpen())
+        DumpMasternodePayments();
+    mncacheJournal.Close();
+    budgetJournal.Close();
+    mnpaymentsJournal.Close();
+    // locks aren't journaled, they only live for an hour
+    DumpTransactionLocks();
     UnregisterNodeSignals(GetNodeSignals());
 
     if (fFeeEstimatesInitialized)
@@ -291,6 +309,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
+    strUsage += "  -persistmempool        " + strprintf(_("Whether to save the mempool on shutdown and load on restart (default: %u)"), DEFAULT_PERSIST_MEMPOOL) + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
 #ifndef WIN32
     strUsage += "  -pid=<file>            " + strprintf(_("Specify pid file (default: %s)"), "dashd.pid") + "\n";
@@ -321,6 +340,11 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -permitbaremultisig    " + strprintf(_("Relay non-P2SH multisig (default: %u)"), 1) + "\n";
     strUsage += "  -port=<port>           " + strprintf(_("Listen for connections on <port> (default: %u or testnet: %u)"), 9999, 19999) + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
+#ifdef HAVE_SYS_EPOLL_H
+    strUsage += "  -socketevents=<mode>   " + _("Socket events mode, which must be one of: select, epoll (default: epoll)") + "\n";
+#else
+    strUsage += "  -socketevents=<mode>   " + _("Socket events mode, which must be one of: select (default: select)") + "\n";
+#endif
     strUsage += "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n";
     strUsage += "  -timeout=<n>           " + strprintf(_("Specify connection timeout in milliseconds (minimum: 1, default: %d)"), DEFAULT_CONNECT_TIMEOUT) + "\n";
 #ifdef USE_UPNP
@@ -548,6 +572,13 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         LogPrintf("Stopping after block import\n");
         StartShutdown();
     }
+
+    if (GetBoolArg("-persistmempool", DEFAULT_PERSIST_MEMPOOL)) {
+        LoadMempool();
+        // Only overwrite mempool.dat once it has been fully reloaded
+        LOCK(cs_dumpMempool);
+        fDumpMempoolLater = !ShutdownRequested();
+    }
 }
 
 /** Sanity checks
@@ -703,10 +734,18 @@ bool AppInit2(boost::thread_group& threadGroup)
             LogPrintf("AppInit2 : parameter interaction: -enableinstantx=false -> setting -nInstantXDepth=0\n");
     }
 
+    if (mapArgs.count("-socketevents") && !SetSocketEventsMode(mapArgs["-socketevents"]))
+        return InitError(strprintf(_("Unknown or unsupported -socketevents mode: '%s'"), mapArgs["-socketevents"]));
+    // before the connection limit below, which depends on the backend actually used
+    SetupSocketEvents();
+
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+    // select() cannot watch descriptors beyond FD_SETSIZE, epoll has no such limit
+    if (nSocketEventsMode == SOCKETEVENTS_SELECT)
+        nMaxConnections = std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS));
+    nMaxConnections = std::max(nMaxConnections, 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -1428,6 +1467,9 @@ bool AppInit2(boost::thread_group& threadGroup)
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
+    if (mncacheJournal.Open())
+        mncacheJournal.Replay(boost::bind(&CMasternodeMan::ReplayJournalRecord, &mnodeman, _1, _2));
+    RegisterValidationInterface(&mnodeman);
 
     uiInterface.InitMessage(_("Loading budget cache..."));
 
@@ -1444,6 +1486,8 @@ bool AppInit2(boost::thread_group& threadGroup)
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
+    if (budgetJournal.Open())
+        budgetJournal.Replay(boost::bind(&CBudgetManager::ReplayJournalRecord, &budget, _1, _2));
 
     //flag our cached items so we send them to our peers
     budget.ResetSync();
@@ -1465,6 +1509,25 @@ bool AppInit2(boost::thread_group& threadGroup)
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
+    if (mnpaymentsJournal.Open())
+        mnpaymentsJournal.Replay(boost::bind(&CMasternodePayments::ReplayJournalRecord, &masternodePayments, _1, _2));
+
+    uiInterface.InitMessage(_("Loading transaction lock cache..."));
+
+    CTransactionLockDB txlockdb;
+    CTransactionLockDB::ReadResult readResult4 = txlockdb.Read(txLockManager);
+
+    if (readResult4 == CTransactionLockDB::FileError)
+        LogPrintf("Missing transaction lock cache - instantx.dat, will try to recreate\n");
+    else if (readResult4 != CTransactionLockDB::Ok)
+    {
+        LogPrintf("Error reading instantx.dat: ");
+        if(readResult4 == CTransactionLockDB::IncorrectFormat)
+            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
+        else
+            LogPrintf("file format is unknown or invalid, please fix it manually\n");
+    }
+    RegisterValidationInterface(&txLockManager);
 
     fMasterNode = GetBoolArg("-masternode", false);
 
@@ -1574,6 +1637,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     darkSendPool.InitCollateralAddress();
 
     threadGroup.create_thread(boost::bind(&ThreadCheckDarkSendPool));
+    threadGroup.create_thread(boost::bind(&ThreadFlushMasternodeCaches));
 
     // ********************************************************* Step 11: start node
 
@@ -1596,6 +1660,10 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     StartNode(threadGroup);
 
+    // Keep a block template ready for getblocktemplate
+    if (fServer)
+        StartBlockTemplateBuilder(threadGroup);
+
 #ifdef ENABLE_WALLET
     // Generate coins in the background
     if (pwalletMain)
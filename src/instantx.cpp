@@ -13,18 +13,24 @@
 #include "darksend.h"
 #include "spork.h"
 #include <boost/lexical_cast.hpp>
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
 
 using namespace std;
 using namespace boost;
 
-std::map<uint256, CTransaction> mapTxLockReq;
-std::map<uint256, CTransaction> mapTxLockReqRejected;
-std::map<uint256, CConsensusVote> mapTxLockVote;
-std::map<uint256, CTransactionLock> mapTxLocks;
-std::map<COutPoint, uint256> mapLockedInputs;
+/** Lock requests, votes and locks */
+CTransactionLockManager txLockManager;
+/** Lock latency and vote timings */
+CInstantXMetrics instantXMetrics;
 std::map<uint256, int64_t> mapUnknownVotes; //track votes with no tx for DOS
 int nCompleteTXLocks;
 
+// quorums by block height, see GetInstantXQuorum
+CCriticalSection cs_mapInstantXQuorums;
+std::map<int64_t, CInstantXQuorum> mapInstantXQuorums;
+
 //txlock - Locks transaction
 //
 //step 1.) Broadcast intention to lock transaction inputs, "txlreg", CTransaction
@@ -48,7 +54,7 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
         CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if(mapTxLockReq.count(tx.GetHash()) || mapTxLockReqRejected.count(tx.GetHash())){
+        if(txLockManager.HasTxLockRequest(tx.GetHash(), true)){
             return;
         }
 
@@ -65,6 +71,7 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
             }
         }
 
+        int64_t nTimeRequest = GetTimeMillis();
         int nBlockHeight = CreateNewLock(tx);
 
         bool fMissingInputs = false;
@@ -77,11 +84,14 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
         }
         if (fAccepted)
         {
-            RelayInv(inv);
+            RelayInv(inv, MakeSerializedMessage("ix", tx));
 
             DoConsensusVote(tx, nBlockHeight);
 
-            mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
+            txLockManager.AddTxLockRequest(tx);
+            // requests with too new inputs never get a quorum, don't keep them pending
+            if(nBlockHeight != 0)
+                instantXMetrics.RequestReceived(tx.GetHash(), nTimeRequest);
 
             LogPrintf("ProcessMessageInstantX::ix - Transaction Lock Request: %s %s : accepted %s\n",
                 pfrom->addr.ToString().c_str(), pfrom->cleanSubVer.c_str(),
@@ -91,7 +101,7 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
             return;
 
         } else {
-            mapTxLockReqRejected.insert(make_pair(tx.GetHash(), tx));
+            txLockManager.AddTxLockRequest(tx, true);
 
             // can we get the conflicting transaction as proof?
 
@@ -100,24 +110,16 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
                 tx.GetHash().ToString().c_str()
             );
 
-            BOOST_FOREACH(const CTxIn& in, tx.vin){
-                if(!mapLockedInputs.count(in.prevout)){
-                    mapLockedInputs.insert(make_pair(in.prevout, tx.GetHash()));
-                }
-            }
+            txLockManager.LockInputs(tx);
 
             // resolve conflicts
-            std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(tx.GetHash());
-            if (i != mapTxLocks.end()){
-                //we only care if we have a complete tx lock
-                if((*i).second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED){
-                    if(!CheckForConflictingLocks(tx)){
-                        LogPrintf("ProcessMessageInstantX::ix - Found Existing Complete IX Lock\n");
-
-                        //reprocess the last 15 blocks
-                        ReprocessBlocks(15);
-                        mapTxLockReq.insert(make_pair(tx.GetHash(), tx));
-                    }
+            //we only care if we have a complete tx lock
+            if(txLockManager.CountSignatures(tx.GetHash()) >= INSTANTX_SIGNATURES_REQUIRED){
+                if(!CheckForConflictingLocks(tx)){
+                    LogPrintf("ProcessMessageInstantX::ix - Found Existing Complete IX Lock\n");
+
+                    ResolveConflictingBlocks(tx);
+                    txLockManager.AddTxLockRequest(tx);
                 }
             }
 
@@ -132,20 +134,22 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
         CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if(mapTxLockVote.count(ctx.GetHash())){
+        if(!txLockManager.AddVote(ctx)){
             return;
         }
 
-        mapTxLockVote.insert(make_pair(ctx.GetHash(), ctx));
+        int64_t nStart = GetTimeMicros();
+        bool fAccepted = ProcessConsensusVote(pfrom, ctx);
+        instantXMetrics.VoteProcessed(GetTimeMicros() - nStart);
 
-        if(ProcessConsensusVote(pfrom, ctx)){
+        if(fAccepted){
             //Spam/Dos protection
             /*
                 Masternodes will sometimes propagate votes before the transaction is known to the client.
                 This tracks those messages and allows it at the same rate of the rest of the network, if
                 a peer violates it, it will simply be ignored
             */
-            if(!mapTxLockReq.count(ctx.txHash) && !mapTxLockReqRejected.count(ctx.txHash)){
+            if(!txLockManager.HasTxLockRequest(ctx.txHash, true)){
                 if(!mapUnknownVotes.count(ctx.vinMasternode.prevout.hash)){
                     mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime()+(60*10);
                 }
@@ -161,7 +165,7 @@ void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream&
                     mapUnknownVotes[ctx.vinMasternode.prevout.hash] = GetTime()+(60*10);
                 }
             }
-            RelayInv(inv);
+            RelayInv(inv, MakeSerializedMessage("txlvote", ctx));
         }
 
         return;
@@ -234,19 +238,7 @@ int64_t CreateNewLock(CTransaction tx)
     */
     int nBlockHeight = (chainActive.Tip()->nHeight - nTxAge)+4;
 
-    if (!mapTxLocks.count(tx.GetHash())){
-        LogPrintf("CreateNewLock - New Transaction Lock %s !\n", tx.GetHash().ToString().c_str());
-
-        CTransactionLock newLock;
-        newLock.nBlockHeight = nBlockHeight;
-        newLock.nExpiration = GetTime()+(60*60); //locks expire after 60 minutes (24 confirmations)
-        newLock.nTimeout = GetTime()+(60*5);
-        newLock.txHash = tx.GetHash();
-        mapTxLocks.insert(make_pair(tx.GetHash(), newLock));
-    } else {
-        mapTxLocks[tx.GetHash()].nBlockHeight = nBlockHeight;
-        LogPrint("instantx", "CreateNewLock - Transaction Lock Exists %s !\n", tx.GetHash().ToString().c_str());
-    }
+    txLockManager.CreateLock(tx.GetHash(), nBlockHeight);
 
 
 
@@ -258,7 +250,7 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
 {
     if(!fMasterNode) return;
 
-    int n = mnodeman.GetMasternodeRank(activeMasternode.vin, nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
+    int n = GetInstantXQuorumRank(activeMasternode.vin, nBlockHeight);
 
     if(n == -1)
     {
@@ -290,16 +282,16 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight)
         return;
     }
 
-    mapTxLockVote[ctx.GetHash()] = ctx;
+    txLockManager.AddVote(ctx);
 
     CInv inv(MSG_TXLOCK_VOTE, ctx.GetHash());
-    RelayInv(inv);
+    RelayInv(inv, MakeSerializedMessage("txlvote", ctx));
 }
 
 //received a consensus vote
 bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
 {
-    int n = mnodeman.GetMasternodeRank(ctx.vinMasternode, ctx.nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
+    int n = GetInstantXQuorumRank(ctx.vinMasternode, ctx.nBlockHeight);
 
     CMasternode* pmn = mnodeman.Find(ctx.vinMasternode);
     if(pmn != NULL)
@@ -326,69 +318,49 @@ bool ProcessConsensusVote(CNode* pnode, CConsensusVote& ctx)
         return false;
     }
 
-    if (!mapTxLocks.count(ctx.txHash)){
-        LogPrintf("InstantX::ProcessConsensusVote - New Transaction Lock %s !\n", ctx.txHash.ToString().c_str());
-
-        CTransactionLock newLock;
-        newLock.nBlockHeight = 0;
-        newLock.nExpiration = GetTime()+(60*60);
-        newLock.nTimeout = GetTime()+(60*5);
-        newLock.txHash = ctx.txHash;
-        mapTxLocks.insert(make_pair(ctx.txHash, newLock));
-    } else
-        LogPrint("instantx", "InstantX::ProcessConsensusVote - Transaction Lock Exists %s !\n", ctx.txHash.ToString().c_str());
-
     //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(ctx.txHash);
-    if (i != mapTxLocks.end()){
-        (*i).second.AddSignature(ctx);
+    int nSignatures = txLockManager.AddSignature(ctx);
+    instantXMetrics.VoteReceived(ctx.txHash, ctx.vinMasternode.prevout);
 
 #ifdef ENABLE_WALLET
-        if(pwalletMain){
-            //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
-            if(pwalletMain->mapRequestCount.count(ctx.txHash))
-                pwalletMain->mapRequestCount[ctx.txHash]++;
-        }
+    if(pwalletMain){
+        //when we get back signatures, we'll count them as requests. Otherwise the client will think it didn't propagate.
+        if(pwalletMain->mapRequestCount.count(ctx.txHash))
+            pwalletMain->mapRequestCount[ctx.txHash]++;
+    }
 #endif
 
-        LogPrint("instantx", "InstantX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", (*i).second.CountSignatures(), ctx.GetHash().ToString().c_str());
+    LogPrint("instantx", "InstantX::ProcessConsensusVote - Transaction Lock Votes %d - %s !\n", nSignatures, ctx.GetHash().ToString().c_str());
 
-        if((*i).second.CountSignatures() >= INSTANTX_SIGNATURES_REQUIRED){
-            LogPrint("instantx", "InstantX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", (*i).second.GetHash().ToString().c_str());
+    if(nSignatures >= INSTANTX_SIGNATURES_REQUIRED){
+        LogPrint("instantx", "InstantX::ProcessConsensusVote - Transaction Lock Is Complete %s !\n", ctx.txHash.ToString().c_str());
+        instantXMetrics.LockCompleted(ctx.txHash);
 
-            CTransaction& tx = mapTxLockReq[ctx.txHash];
-            if(!CheckForConflictingLocks(tx)){
+        CTransaction tx;
+        bool fHaveTx = txLockManager.GetTxLockRequest(ctx.txHash, tx);
+        if(!CheckForConflictingLocks(tx)){
 
 #ifdef ENABLE_WALLET
-                if(pwalletMain){
-                    if(pwalletMain->UpdatedTransaction((*i).second.txHash)){
-                        nCompleteTXLocks++;
-                    }
+            if(pwalletMain){
+                if(pwalletMain->UpdatedTransaction(ctx.txHash)){
+                    nCompleteTXLocks++;
                 }
+            }
 #endif
 
-                if(mapTxLockReq.count(ctx.txHash)){
-                    BOOST_FOREACH(const CTxIn& in, tx.vin){
-                        if(!mapLockedInputs.count(in.prevout)){
-                            mapLockedInputs.insert(make_pair(in.prevout, ctx.txHash));
-                        }
-                    }
-                }
+            if(fHaveTx)
+                txLockManager.LockInputs(tx);
 
-                // resolve conflicts
+            // resolve conflicts
 
-                //if this tx lock was rejected, we need to remove the conflicting blocks
-                if(mapTxLockReqRejected.count((*i).second.txHash)){
-                    //reprocess the last 15 blocks
-                    ReprocessBlocks(15);
-                }
+            //if this tx lock was rejected, we need to remove the conflicting blocks
+            CTransaction txRejected;
+            if(txLockManager.IsTxLockRequestRejected(ctx.txHash) && txLockManager.GetTxLockRequest(ctx.txHash, txRejected, true)){
+                ResolveConflictingBlocks(txRejected);
             }
         }
-        return true;
     }
-
-
-    return false;
+    return true;
 }
 
 bool CheckForConflictingLocks(CTransaction& tx)
@@ -400,18 +372,97 @@ bool CheckForConflictingLocks(CTransaction& tx)
         Blocks could have been rejected during this time, which is OK. After they cancel out, the client will
         rescan the blocks and find they're acceptable and then take the chain with the most work.
     */
-    BOOST_FOREACH(const CTxIn& in, tx.vin){
-        if(mapLockedInputs.count(in.prevout)){
-            if(mapLockedInputs[in.prevout] != tx.GetHash()){
-                LogPrintf("InstantX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), mapLockedInputs[in.prevout].ToString().c_str());
-                if(mapTxLocks.count(tx.GetHash())) mapTxLocks[tx.GetHash()].nExpiration = GetTime();
-                if(mapTxLocks.count(mapLockedInputs[in.prevout])) mapTxLocks[mapLockedInputs[in.prevout]].nExpiration = GetTime();
-                return true;
+    uint256 txHashLock;
+    if(txLockManager.GetConflictingLock(tx, txHashLock)){
+        LogPrintf("InstantX::CheckForConflictingLocks - found two complete conflicting locks - removing both. %s %s", tx.GetHash().ToString().c_str(), txHashLock.ToString().c_str());
+        txLockManager.ExpireLock(tx.GetHash());
+        txLockManager.ExpireLock(txHashLock);
+        return true;
+    }
+
+    return false;
+}
+
+// Active blocks among the last INSTANTX_CONFLICT_BLOCKS spending an input of tx in another transaction
+static void FindConflictingBlocksOnDisk(const CTransaction& tx, std::set<uint256>& setBlockHashes)
+{
+    AssertLockHeld(cs_main);
+
+    std::set<COutPoint> setInputs;
+    BOOST_FOREACH(const CTxIn& in, tx.vin)
+        setInputs.insert(in.prevout);
+
+    uint256 txHash = tx.GetHash();
+    CBlockIndex* pindex = chainActive.Tip();
+    for(int i = 0; i < INSTANTX_CONFLICT_BLOCKS && pindex != NULL; i++, pindex = pindex->pprev) {
+        CBlock block;
+        if(!ReadBlockFromDisk(block, pindex)) {
+            LogPrintf("FindConflictingBlocksOnDisk - can't read block %s\n", pindex->GetBlockHash().ToString());
+            continue;
+        }
+        BOOST_FOREACH(const CTransaction& txBlock, block.vtx) {
+            if(txBlock.IsCoinBase() || txBlock.GetHash() == txHash) continue;
+            BOOST_FOREACH(const CTxIn& in, txBlock.vin) {
+                if(setInputs.count(in.prevout)) {
+                    setBlockHashes.insert(pindex->GetBlockHash());
+                    break;
+                }
             }
         }
     }
+}
 
-    return false;
+bool ResolveConflictingBlocks(const CTransaction& tx)
+{
+    /*
+        Only the oldest active block spending a locked input in another transaction and the blocks
+        built on it are disconnected, ReconsiderBlock (spork 12) can bring them back. Without such a
+        block there is nothing to reprocess. Like CheckBlock, nothing is rejected unless block
+        filtering is switched on, or this node would fork itself off the network.
+    */
+    if(!IsSporkActive(SPORK_3_INSTANTX_BLOCK_FILTERING)) {
+        LogPrint("instantx", "ResolveConflictingBlocks - block filtering is off, not resolving conflicts with %s\n", tx.GetHash().ToString());
+        return false;
+    }
+
+    std::set<uint256> setBlockHashes;
+    bool fIndexComplete = txLockManager.GetConflictingBlocks(tx, setBlockHashes);
+
+    CValidationState state;
+    {
+        LOCK(cs_main);
+
+        // the index only has blocks connected since startup, locks restored from instantx.dat
+        // may conflict with older ones
+        if(!fIndexComplete)
+            FindConflictingBlocksOnDisk(tx, setBlockHashes);
+
+        CBlockIndex* pindexConflict = NULL;
+        BOOST_FOREACH(const uint256& hashBlock, setBlockHashes) {
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            if(mi == mapBlockIndex.end() || !chainActive.Contains(mi->second)) continue;
+            if(pindexConflict == NULL || mi->second->nHeight < pindexConflict->nHeight)
+                pindexConflict = mi->second;
+        }
+
+        if(pindexConflict == NULL) {
+            LogPrint("instantx", "ResolveConflictingBlocks - no active block conflicts with %s\n", tx.GetHash().ToString());
+            return false;
+        }
+
+        LogPrintf("ResolveConflictingBlocks - disconnecting %s at height %d, it conflicts with %s\n",
+            pindexConflict->GetBlockHash().ToString(), pindexConflict->nHeight, tx.GetHash().ToString());
+
+        mapRejectedBlocks.insert(make_pair(pindexConflict->GetBlockHash(), GetTime()));
+        if(!InvalidateBlock(state, pindexConflict))
+            return error("ResolveConflictingBlocks - InvalidateBlock failed: %s", state.GetRejectReason());
+    }
+
+    if (state.IsValid()) {
+        ActivateBestChain(state);
+    }
+
+    return true;
 }
 
 int64_t GetAverageVoteTime()
@@ -429,35 +480,530 @@ int64_t GetAverageVoteTime()
     return total / count;
 }
 
-void CleanTransactionLocksList()
+//
+// CTransactionLockDB
+//
+
+CTransactionLockDB::CTransactionLockDB()
+{
+    pathDB = GetDataDir() / "instantx.dat";
+    strMagicMessage = "TransactionLocks";
+}
+
+bool CTransactionLockDB::Write(const CTransactionLockManager& objToSave)
+{
+    int64_t nStart = GetTimeMillis();
+
+    // serialize, checksum data up to that point, then append checksum
+    CDataStream ssObj(SER_DISK, CLIENT_VERSION);
+    ssObj << strMagicMessage; // transaction lock file specific magic message
+    ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
+    ssObj << CACHE_FILE_VERSION;
+    ssObj << objToSave;
+    uint256 hash = Hash(ssObj.begin(), ssObj.end());
+    ssObj << hash;
+
+    // write to a temporary file and move it into place, a crash must not leave a torn snapshot
+    boost::filesystem::path pathTmp(pathDB.string() + ".new");
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
+
+    // Write and commit header, data
+    try {
+        fileout << ssObj;
+    }
+    catch (std::exception &e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+    if (!RenameOver(pathTmp, pathDB))
+        return error("%s : Failed to rename %s", __func__, pathTmp.string());
+
+    LogPrintf("Written info to instantx.dat  %dms\n", GetTimeMillis() - nStart);
+
+    return true;
+}
+
+CTransactionLockDB::ReadResult CTransactionLockDB::Read(CTransactionLockManager& objToLoad, bool fDryRun)
+{
+    int64_t nStart = GetTimeMillis();
+    // open input file, and associate with CAutoFile
+    FILE *file = fopen(pathDB.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+    {
+        error("%s : Failed to open file %s", __func__, pathDB.string());
+        return FileError;
+    }
+
+    // use file size to size memory buffer
+    int fileSize = boost::filesystem::file_size(pathDB);
+    int dataSize = fileSize - sizeof(uint256);
+    // Don't try to resize to a negative number if file is small
+    if (dataSize < 0)
+        dataSize = 0;
+    vector<unsigned char> vchData;
+    vchData.resize(dataSize);
+    uint256 hashIn;
+
+    // read data and checksum from file
+    try {
+        filein.read((char *)&vchData[0], dataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        return HashReadError;
+    }
+    filein.fclose();
+
+    CDataStream ssObj(vchData, SER_DISK, CLIENT_VERSION);
+
+    // verify stored checksum matches input data
+    uint256 hashTmp = Hash(ssObj.begin(), ssObj.end());
+    if (hashIn != hashTmp)
+    {
+        error("%s : Checksum mismatch, data corrupted", __func__);
+        return IncorrectHash;
+    }
+
+    unsigned char pchMsgTmp[4];
+    std::string strMagicMessageTmp;
+    try {
+        // de-serialize file header (transaction lock file specific magic message) and ..
+        ssObj >> strMagicMessageTmp;
+
+        // ... verify the message matches predefined one
+        if (strMagicMessage != strMagicMessageTmp)
+        {
+            error("%s : Invalid transaction lock cache magic message", __func__);
+            return IncorrectMagicMessage;
+        }
+
+        // de-serialize file header (network specific magic number) and ..
+        ssObj >> FLATDATA(pchMsgTmp);
+
+        // ... verify the network matches ours
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+        {
+            error("%s : Invalid network magic number", __func__);
+            return IncorrectMagicNumber;
+        }
+
+        // snapshots written by other versions are rebuilt from the network
+        int nVersionTmp;
+        ssObj >> nVersionTmp;
+        if (nVersionTmp != CACHE_FILE_VERSION)
+        {
+            error("%s : Unsupported file version %d", __func__, nVersionTmp);
+            return IncorrectFormat;
+        }
+
+        // de-serialize data into CTransactionLockManager object
+        ssObj >> objToLoad;
+    }
+    catch (std::exception &e) {
+        objToLoad.Clear();
+        error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        return IncorrectFormat;
+    }
+
+    LogPrintf("Loaded info from instantx.dat  %dms\n", GetTimeMillis() - nStart);
+    LogPrintf("  %s\n", objToLoad.ToString());
+    if(!fDryRun) {
+        LogPrintf("Transaction lock manager - cleaning....\n");
+        objToLoad.CheckAndRemove();
+        LogPrintf("Transaction lock manager - result:\n");
+        LogPrintf("  %s\n", objToLoad.ToString());
+    }
+
+    return Ok;
+}
+
+void DumpTransactionLocks()
+{
+    int64_t nStart = GetTimeMillis();
+
+    CTransactionLockDB txlockdb;
+
+    LogPrintf("Writting info to instantx.dat...\n");
+    txlockdb.Write(txLockManager);
+
+    LogPrintf("Transaction lock dump finished  %dms\n", GetTimeMillis() - nStart);
+}
+
+//
+// CTransactionLockManager
+//
+
+void CTransactionLockManager::ScheduleExpiry(const uint256& txHash, int64_t nTime)
+{
+    setExpiry.insert(make_pair(nTime, txHash));
+}
+
+void CTransactionLockManager::Remove(const uint256& txHash)
+{
+    // release the inputs this transaction holds, rejected requests lock their inputs too
+    CTransaction tx;
+    std::map<uint256, CTransaction>::iterator itReq = mapTxLockReq.find(txHash);
+    if(itReq != mapTxLockReq.end()) tx = itReq->second;
+    else {
+        itReq = mapTxLockReqRejected.find(txHash);
+        if(itReq != mapTxLockReqRejected.end()) tx = itReq->second;
+    }
+    BOOST_FOREACH(const CTxIn& in, tx.vin){
+        std::map<COutPoint, uint256>::iterator itInput = mapLockedInputs.find(in.prevout);
+        if(itInput != mapLockedInputs.end() && itInput->second == txHash)
+            mapLockedInputs.erase(itInput);
+    }
+
+    mapTxLockReq.erase(txHash);
+    mapTxLockReqRejected.erase(txHash);
+
+    std::map<uint256, std::set<uint256> >::iterator itVotes = mapVotesByTx.find(txHash);
+    if(itVotes != mapVotesByTx.end()) {
+        BOOST_FOREACH(const uint256& voteHash, itVotes->second)
+            mapTxLockVote.erase(voteHash);
+        mapVotesByTx.erase(itVotes);
+    }
+
+    mapTxLocks.erase(txHash);
+}
+
+void CTransactionLockManager::RebuildIndexes()
+{
+    mapVotesByTx.clear();
+    setExpiry.clear();
+
+    int64_t nExpiration = GetTime() + INSTANTX_LOCK_EXPIRY_SECONDS;
+    for(std::map<uint256, CConsensusVote>::iterator it = mapTxLockVote.begin(); it != mapTxLockVote.end(); ++it) {
+        mapVotesByTx[it->second.txHash].insert(it->first);
+        ScheduleExpiry(it->second.txHash, nExpiration);
+    }
+    for(std::map<uint256, CTransaction>::iterator it = mapTxLockReq.begin(); it != mapTxLockReq.end(); ++it)
+        ScheduleExpiry(it->first, nExpiration);
+    for(std::map<uint256, CTransaction>::iterator it = mapTxLockReqRejected.begin(); it != mapTxLockReqRejected.end(); ++it)
+        ScheduleExpiry(it->first, nExpiration);
+    for(std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin(); it != mapTxLocks.end(); ++it)
+        ScheduleExpiry(it->first, it->second.nExpiration);
+}
+
+void CTransactionLockManager::Clear()
+{
+    LOCK(cs);
+    mapTxLockReq.clear();
+    mapTxLockReqRejected.clear();
+    mapTxLockVote.clear();
+    mapTxLocks.clear();
+    mapLockedInputs.clear();
+    mapVotesByTx.clear();
+    setExpiry.clear();
+}
+
+void CTransactionLockManager::AddTxLockRequest(const CTransaction& tx, bool fRejected)
+{
+    LOCK(cs);
+    uint256 txHash = tx.GetHash();
+    if(fRejected) mapTxLockReqRejected.insert(make_pair(txHash, tx));
+    else mapTxLockReq.insert(make_pair(txHash, tx));
+    // requests without a lock (inputs too new) still go away after the usual time
+    ScheduleExpiry(txHash, GetTime() + INSTANTX_LOCK_EXPIRY_SECONDS);
+}
+
+bool CTransactionLockManager::HasTxLockRequest(const uint256& txHash, bool fIncludeRejected)
+{
+    LOCK(cs);
+    return mapTxLockReq.count(txHash) || (fIncludeRejected && mapTxLockReqRejected.count(txHash));
+}
+
+bool CTransactionLockManager::IsTxLockRequestRejected(const uint256& txHash)
+{
+    LOCK(cs);
+    return mapTxLockReqRejected.count(txHash);
+}
+
+bool CTransactionLockManager::GetTxLockRequest(const uint256& txHash, CTransaction& tx, bool fIncludeRejected)
+{
+    LOCK(cs);
+    std::map<uint256, CTransaction>::iterator it = mapTxLockReq.find(txHash);
+    if(it == mapTxLockReq.end()) {
+        if(!fIncludeRejected) return false;
+        it = mapTxLockReqRejected.find(txHash);
+        if(it == mapTxLockReqRejected.end()) return false;
+    }
+    tx = it->second;
+    return true;
+}
+
+bool CTransactionLockManager::AddVote(const CConsensusVote& vote)
+{
+    LOCK(cs);
+    uint256 voteHash = vote.GetHash();
+    if(!mapTxLockVote.insert(make_pair(voteHash, vote)).second) return false;
+
+    mapVotesByTx[vote.txHash].insert(voteHash);
+    // votes that never make it into a lock go away after the usual time
+    ScheduleExpiry(vote.txHash, GetTime() + INSTANTX_LOCK_EXPIRY_SECONDS);
+    return true;
+}
+
+bool CTransactionLockManager::HasVote(const uint256& voteHash)
+{
+    LOCK(cs);
+    return mapTxLockVote.count(voteHash);
+}
+
+bool CTransactionLockManager::GetVote(const uint256& voteHash, CConsensusVote& vote)
+{
+    LOCK(cs);
+    std::map<uint256, CConsensusVote>::iterator it = mapTxLockVote.find(voteHash);
+    if(it == mapTxLockVote.end()) return false;
+    vote = it->second;
+    return true;
+}
+
+void CTransactionLockManager::CreateLock(const uint256& txHash, int nBlockHeight)
 {
-    if(chainActive.Tip() == NULL) return;
+    LOCK(cs);
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if(it != mapTxLocks.end()) {
+        it->second.nBlockHeight = nBlockHeight;
+        LogPrint("instantx", "CreateNewLock - Transaction Lock Exists %s !\n", txHash.ToString().c_str());
+        return;
+    }
+
+    LogPrintf("CreateNewLock - New Transaction Lock %s !\n", txHash.ToString().c_str());
+
+    CTransactionLock newLock;
+    newLock.nBlockHeight = nBlockHeight;
+    newLock.nExpiration = GetTime() + INSTANTX_LOCK_EXPIRY_SECONDS; //locks expire after 60 minutes (24 confirmations)
+    newLock.nTimeout = GetTime() + INSTANTX_LOCK_TIMEOUT_SECONDS;
+    newLock.txHash = txHash;
+    mapTxLocks.insert(make_pair(txHash, newLock));
+    ScheduleExpiry(txHash, newLock.nExpiration);
+}
+
+int CTransactionLockManager::AddSignature(const CConsensusVote& vote)
+{
+    LOCK(cs);
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(vote.txHash);
+    if(it == mapTxLocks.end()) {
+        LogPrintf("InstantX::ProcessConsensusVote - New Transaction Lock %s !\n", vote.txHash.ToString().c_str());
+
+        CTransactionLock newLock;
+        newLock.nBlockHeight = 0;
+        newLock.nExpiration = GetTime() + INSTANTX_LOCK_EXPIRY_SECONDS;
+        newLock.nTimeout = GetTime() + INSTANTX_LOCK_TIMEOUT_SECONDS;
+        newLock.txHash = vote.txHash;
+        it = mapTxLocks.insert(make_pair(vote.txHash, newLock)).first;
+        ScheduleExpiry(vote.txHash, newLock.nExpiration);
+    } else
+        LogPrint("instantx", "InstantX::ProcessConsensusVote - Transaction Lock Exists %s !\n", vote.txHash.ToString().c_str());
 
-    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.begin();
+    CConsensusVote voteCopy(vote);
+    it->second.AddSignature(voteCopy);
+    return it->second.CountSignatures();
+}
+
+int CTransactionLockManager::CountSignatures(const uint256& txHash)
+{
+    LOCK(cs);
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if(it == mapTxLocks.end()) return -1;
+    return it->second.CountSignatures();
+}
+
+bool CTransactionLockManager::IsLockTimedOut(const uint256& txHash)
+{
+    LOCK(cs);
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if(it == mapTxLocks.end()) return false;
+    return GetTime() > it->second.nTimeout;
+}
+
+void CTransactionLockManager::ExpireLock(const uint256& txHash)
+{
+    LOCK(cs);
+    std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+    if(it == mapTxLocks.end()) return;
+    it->second.nExpiration = GetTime();
+    ScheduleExpiry(txHash, it->second.nExpiration);
+}
+
+void CTransactionLockManager::LockInputs(const CTransaction& tx)
+{
+    LOCK(cs);
+    uint256 txHash = tx.GetHash();
+    BOOST_FOREACH(const CTxIn& in, tx.vin)
+        mapLockedInputs.insert(make_pair(in.prevout, txHash));
+}
+
+bool CTransactionLockManager::GetConflictingLock(const CTransaction& tx, uint256& txHashLock)
+{
+    LOCK(cs);
+    if(mapLockedInputs.empty()) return false;
+
+    uint256 txHash = tx.GetHash();
+    BOOST_FOREACH(const CTxIn& in, tx.vin){
+        std::map<COutPoint, uint256>::iterator it = mapLockedInputs.find(in.prevout);
+        if(it != mapLockedInputs.end() && it->second != txHash){
+            txHashLock = it->second;
+            return true;
+        }
+    }
 
-    while(it != mapTxLocks.end()) {
-        if(GetTime() > it->second.nExpiration){ //keep them for an hour
-            LogPrintf("Removing old transaction lock %s\n", it->second.txHash.ToString().c_str());
+    return false;
+}
 
-            if(mapTxLockReq.count(it->second.txHash)){
-                CTransaction& tx = mapTxLockReq[it->second.txHash];
+bool CTransactionLockManager::GetConflictingBlocks(const CTransaction& tx, std::set<uint256>& setBlockHashes)
+{
+    LOCK(cs);
 
-                BOOST_FOREACH(const CTxIn& in, tx.vin)
-                    mapLockedInputs.erase(in.prevout);
+    uint256 txHash = tx.GetHash();
+    BOOST_FOREACH(const CTxIn& in, tx.vin){
+        std::map<COutPoint, std::pair<uint256, uint256> >::iterator it = mapRecentSpends.find(in.prevout);
+        if(it != mapRecentSpends.end() && it->second.first != txHash)
+            setBlockHashes.insert(it->second.second);
+    }
 
-                mapTxLockReq.erase(it->second.txHash);
-                mapTxLockReqRejected.erase(it->second.txHash);
+    return dequeRecentBlocks.size() >= INSTANTX_CONFLICT_BLOCKS;
+}
 
-                BOOST_FOREACH(CConsensusVote& v, it->second.vecConsensusVotes)
-                    mapTxLockVote.erase(v.GetHash());
+void CTransactionLockManager::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    // only connected blocks are indexed, disconnected ones are filtered out when they're looked up
+    if(pblock == NULL || tx.IsCoinBase()) return;
+
+    LOCK(cs);
+
+    // called for every transaction of a block in a row, hash the header once per block
+    if(pblock != pblockLast || pblock->hashMerkleRoot != hashMerkleRootLast) {
+        pblockLast = pblock;
+        hashMerkleRootLast = pblock->hashMerkleRoot;
+        dequeRecentBlocks.push_back(make_pair(pblock->GetHash(), std::vector<COutPoint>()));
+
+        while(dequeRecentBlocks.size() > INSTANTX_CONFLICT_BLOCKS) {
+            const std::pair<uint256, std::vector<COutPoint> >& oldest = dequeRecentBlocks.front();
+            BOOST_FOREACH(const COutPoint& outpoint, oldest.second) {
+                std::map<COutPoint, std::pair<uint256, uint256> >::iterator it = mapRecentSpends.find(outpoint);
+                if(it != mapRecentSpends.end() && it->second.second == oldest.first)
+                    mapRecentSpends.erase(it);
             }
+            dequeRecentBlocks.pop_front();
+        }
+    }
 
-            mapTxLocks.erase(it++);
-        } else {
-            it++;
+    uint256 txHash = tx.GetHash();
+    std::pair<uint256, std::vector<COutPoint> >& current = dequeRecentBlocks.back();
+    BOOST_FOREACH(const CTxIn& in, tx.vin) {
+        mapRecentSpends[in.prevout] = make_pair(txHash, current.first);
+        current.second.push_back(in.prevout);
+    }
+}
+
+void CTransactionLockManager::CheckAndRemove()
+{
+    LOCK(cs);
+
+    int64_t nNow = GetTime();
+    while(!setExpiry.empty() && setExpiry.begin()->first < nNow) {
+        uint256 txHash = setExpiry.begin()->second;
+        setExpiry.erase(setExpiry.begin());
+
+        // the lock decides when everything about the transaction goes, it may have been moved
+        std::map<uint256, CTransactionLock>::iterator it = mapTxLocks.find(txHash);
+        if(it != mapTxLocks.end() && it->second.nExpiration >= nNow) {
+            ScheduleExpiry(txHash, it->second.nExpiration);
+            continue;
         }
+
+        if(it != mapTxLocks.end())
+            LogPrintf("Removing old transaction lock %s\n", txHash.ToString().c_str());
+        Remove(txHash);
     }
+}
+
+std::string CTransactionLockManager::ToString() const
+{
+    LOCK(cs);
+    std::ostringstream info;
 
+    info << "Transaction lock requests: " << (int)mapTxLockReq.size() <<
+            ", rejected: " << (int)mapTxLockReqRejected.size() <<
+            ", votes: " << (int)mapTxLockVote.size() <<
+            ", locks: " << (int)mapTxLocks.size() <<
+            ", locked inputs: " << (int)mapLockedInputs.size();
+
+    return info.str();
+}
+
+/*
+    The quorum for a height is ranked the first time a lock or vote needs it, and then reused
+    until the block at that height changes or a masternode joins, leaves or changes its active
+    state, like the rankings GetMasternodeRank checks votes against. Nodes that learn about a
+    missing masternode later thus converge on the same quorum. Ranking
+    only while the masternode list is still syncing would keep an incomplete quorum around,
+    so those results aren't kept.
+*/
+static bool GetInstantXQuorum(int64_t nBlockHeight, CInstantXQuorum& quorum)
+{
+    uint256 hashBlock;
+    if(!GetBlockHash(hashBlock, nBlockHeight)) return false;
+
+    // sampled before ranking, a change racing with it only causes another ranking
+    int64_t nListChanges = mnodeman.GetListChanges();
+
+    LOCK(cs_mapInstantXQuorums);
+
+    std::map<int64_t, CInstantXQuorum>::iterator it = mapInstantXQuorums.find(nBlockHeight);
+    if(it != mapInstantXQuorums.end() && it->second.hashBlock == hashBlock && it->second.nListChanges == nListChanges) {
+        quorum = it->second;
+        return true;
+    }
+
+    quorum.hashBlock = hashBlock;
+    quorum.nListChanges = nListChanges;
+    quorum.mapRanks.clear();
+    for(int nRank = 1; nRank <= INSTANTX_SIGNATURES_TOTAL; nRank++) {
+        CMasternode* pmn = mnodeman.GetMasternodeByRank(nRank, nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
+        if(pmn == NULL) break;
+        quorum.mapRanks[pmn->vin.prevout] = nRank;
+    }
+
+    if(masternodeSync.RequestedMasternodeAssets > MASTERNODE_SYNC_LIST) {
+        mapInstantXQuorums[nBlockHeight] = quorum;
+        // locks use recent heights, drop the oldest quorums first
+        while(mapInstantXQuorums.size() > INSTANTX_QUORUMS_MAX)
+            mapInstantXQuorums.erase(mapInstantXQuorums.begin());
+    }
+
+    return true;
+}
+
+int GetInstantXQuorumRank(const CTxIn& vin, int64_t nBlockHeight)
+{
+    CInstantXQuorum quorum;
+    if(!GetInstantXQuorum(nBlockHeight, quorum)) return -1;
+
+    std::map<COutPoint, int>::const_iterator it = quorum.mapRanks.find(vin.prevout);
+    if(it != quorum.mapRanks.end()) return it->second;
+
+    // not in the quorum, tell unknown masternodes apart so callers can ask for them
+    CMasternode* pmn = mnodeman.Find(vin);
+    if(pmn == NULL || pmn->protocolVersion < MIN_INSTANTX_PROTO_VERSION || !pmn->IsEnabled()) return -1;
+
+    return INSTANTX_SIGNATURES_TOTAL + 1;
+}
+
+void UpdateInstantXQuorums(int nTipHeight)
+{
+    // the newest height a lock can use (inputs need 5 confirmations), older heights were
+    // computed the same way when they were the newest
+    CInstantXQuorum quorum;
+    GetInstantXQuorum(nTipHeight - 1, quorum);
 }
 
 uint256 CConsensusVote::GetHash() const
@@ -523,7 +1069,7 @@ bool CTransactionLock::SignaturesValid()
 
     BOOST_FOREACH(CConsensusVote vote, vecConsensusVotes)
     {
-        int n = mnodeman.GetMasternodeRank(vote.vinMasternode, vote.nBlockHeight, MIN_INSTANTX_PROTO_VERSION);
+        int n = GetInstantXQuorumRank(vote.vinMasternode, vote.nBlockHeight);
 
         if(n == -1)
         {
@@ -568,3 +1114,170 @@ int CTransactionLock::CountSignatures()
     }
     return n;
 }
+
+//
+// CLatencyHistogram
+//
+
+CLatencyHistogram::CLatencyHistogram(const int64_t* pBounds, size_t nBounds) :
+    vBounds(pBounds, pBounds + nBounds), vCounts(nBounds + 1, 0), nCount(0), nSum(0), nMax(0)
+{
+}
+
+void CLatencyHistogram::Add(int64_t nValue)
+{
+    if(nValue < 0) nValue = 0;
+
+    size_t nBucket = std::lower_bound(vBounds.begin(), vBounds.end(), nValue) - vBounds.begin();
+    vCounts[nBucket]++;
+    nCount++;
+    nSum += nValue;
+    if(nValue > nMax) nMax = nValue;
+}
+
+void CLatencyHistogram::Clear()
+{
+    std::fill(vCounts.begin(), vCounts.end(), 0);
+    nCount = 0;
+    nSum = 0;
+    nMax = 0;
+}
+
+int64_t CLatencyHistogram::GetPercentile(int nPercent) const
+{
+    if(nCount == 0) return 0;
+
+    uint64_t nTarget = (nCount * nPercent + 99) / 100;
+    if(nTarget == 0) nTarget = 1;
+
+    uint64_t nSeen = 0;
+    for(size_t i = 0; i < vBounds.size(); i++) {
+        nSeen += vCounts[i];
+        if(nSeen >= nTarget) return std::min(vBounds[i], nMax);
+    }
+    return nMax;
+}
+
+//
+// CInstantXMetrics
+//
+
+static const int64_t INSTANTX_LATENCY_BOUNDS_MS[] = {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000};
+static const int64_t INSTANTX_PROCESSING_BOUNDS_US[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000};
+
+#define LATENCY_BOUNDS(a) a, sizeof(a) / sizeof(a[0])
+
+CInstantXMetrics::CInstantXMetrics() :
+    histLockLatency(LATENCY_BOUNDS(INSTANTX_LATENCY_BOUNDS_MS)),
+    histFirstVoteLatency(LATENCY_BOUNDS(INSTANTX_LATENCY_BOUNDS_MS)),
+    histVoteLatency(LATENCY_BOUNDS(INSTANTX_LATENCY_BOUNDS_MS)),
+    histVoteProcessing(LATENCY_BOUNDS(INSTANTX_PROCESSING_BOUNDS_US)),
+    nRequests(0), nCompleted(0)
+{
+}
+
+void CInstantXMetrics::RequestReceived(const uint256& txHash, int64_t nTimeRequest)
+{
+    LOCK(cs);
+
+    if(mapLockTimings.count(txHash) || mapLockTimings.size() >= INSTANTX_METRICS_LOCKS_MAX) return;
+
+    mapLockTimings[txHash].nTimeRequest = nTimeRequest;
+    nRequests++;
+}
+
+void CInstantXMetrics::VoteReceived(const uint256& txHash, const COutPoint& outpointMasternode)
+{
+    LOCK(cs);
+
+    std::map<uint256, CTransactionLockTiming>::iterator it = mapLockTimings.find(txHash);
+    if(it == mapLockTimings.end()) return;
+
+    CTransactionLockTiming& timing = it->second;
+    int64_t nNow = GetTimeMillis();
+    int64_t nDelay = nNow - timing.nTimeRequest;
+
+    timing.vVoteTimes.push_back(nNow);
+    if(timing.nTimeFirstVote == 0) {
+        timing.nTimeFirstVote = nNow;
+        histFirstVoteLatency.Add(nDelay);
+    }
+    histVoteLatency.Add(nDelay);
+
+    CMasternodeVoteStats& stats = mapVoteStats[outpointMasternode];
+    stats.nVotes++;
+    stats.nTotalDelay += nDelay;
+    stats.nMaxDelay = std::max(stats.nMaxDelay, nDelay);
+    stats.nLastVote = GetTime();
+}
+
+void CInstantXMetrics::LockCompleted(const uint256& txHash)
+{
+    LOCK(cs);
+
+    std::map<uint256, CTransactionLockTiming>::iterator it = mapLockTimings.find(txHash);
+    if(it == mapLockTimings.end() || it->second.nTimeComplete != 0) return;
+
+    it->second.nTimeComplete = GetTimeMillis();
+    histLockLatency.Add(it->second.nTimeComplete - it->second.nTimeRequest);
+    nCompleted++;
+}
+
+void CInstantXMetrics::VoteProcessed(int64_t nMicros)
+{
+    LOCK(cs);
+    histVoteProcessing.Add(nMicros);
+}
+
+void CInstantXMetrics::CheckAndRemove()
+{
+    LOCK(cs);
+
+    int64_t nLockCutoff = GetTimeMillis() - INSTANTX_LOCK_EXPIRY_SECONDS * 1000;
+    std::map<uint256, CTransactionLockTiming>::iterator it = mapLockTimings.begin();
+    while(it != mapLockTimings.end()) {
+        if(it->second.nTimeRequest < nLockCutoff) mapLockTimings.erase(it++);
+        else ++it;
+    }
+
+    int64_t nVoteCutoff = GetTime() - INSTANTX_METRICS_MASTERNODE_SECONDS;
+    std::map<COutPoint, CMasternodeVoteStats>::iterator itStats = mapVoteStats.begin();
+    while(itStats != mapVoteStats.end()) {
+        if(itStats->second.nLastVote < nVoteCutoff) mapVoteStats.erase(itStats++);
+        else ++itStats;
+    }
+}
+
+void CInstantXMetrics::Clear()
+{
+    LOCK(cs);
+    mapLockTimings.clear();
+    mapVoteStats.clear();
+    histLockLatency.Clear();
+    histFirstVoteLatency.Clear();
+    histVoteLatency.Clear();
+    histVoteProcessing.Clear();
+    nRequests = 0;
+    nCompleted = 0;
+}
+
+void CInstantXMetrics::GetCounts(uint64_t& nRequestsRet, uint64_t& nCompletedRet, int& nPendingRet) const
+{
+    LOCK(cs);
+
+    nRequestsRet = nRequests;
+    nCompletedRet = nCompleted;
+    nPendingRet = 0;
+    for(std::map<uint256, CTransactionLockTiming>::const_iterator it = mapLockTimings.begin(); it != mapLockTimings.end(); ++it)
+        if(it->second.nTimeComplete == 0) nPendingRet++;
+}
+
+bool CInstantXMetrics::GetLockTiming(const uint256& txHash, CTransactionLockTiming& timing) const
+{
+    LOCK(cs);
+
+    std::map<uint256, CTransactionLockTiming>::const_iterator it = mapLockTimings.find(txHash);
+    if(it == mapLockTimings.end()) return false;
+    timing = it->second;
+    return true;
+}
@@ -13,6 +13,8 @@
 #include "main.h"
 #include "spork.h"
 
+#include <deque>
+
 /*
     At 15 signatures, 1/2 of the masternode network can be owned by
     one party without comprimising the security of InstantX
@@ -24,6 +26,12 @@
 */
 #define INSTANTX_SIGNATURES_REQUIRED           6
 #define INSTANTX_SIGNATURES_TOTAL              10
+#define INSTANTX_QUORUMS_MAX                   100
+#define INSTANTX_LOCK_EXPIRY_SECONDS           (60*60)
+#define INSTANTX_LOCK_TIMEOUT_SECONDS          (60*5)
+#define INSTANTX_CONFLICT_BLOCKS               15
+#define INSTANTX_METRICS_LOCKS_MAX             10000
+#define INSTANTX_METRICS_MASTERNODE_SECONDS    (24*60*60)
 
 using namespace std;
 using namespace boost;
@@ -34,11 +42,11 @@ class CTransactionLock;
 
 static const int MIN_INSTANTX_PROTO_VERSION = 70103;
 
-extern map<uint256, CTransaction> mapTxLockReq;
-extern map<uint256, CTransaction> mapTxLockReqRejected;
-extern map<uint256, CConsensusVote> mapTxLockVote;
-extern map<uint256, CTransactionLock> mapTxLocks;
-extern std::map<COutPoint, uint256> mapLockedInputs;
+class CTransactionLockManager;
+class CInstantXMetrics;
+
+extern CTransactionLockManager txLockManager;
+extern CInstantXMetrics instantXMetrics;
 extern int nCompleteTXLocks;
 
 
@@ -49,6 +57,9 @@ bool IsIXTXValid(const CTransaction& txCollateral);
 // if two conflicting locks are approved by the network, they will cancel out
 bool CheckForConflictingLocks(CTransaction& tx);
 
+// disconnect the blocks spending the inputs of a complete lock in other transactions, false if there are none
+bool ResolveConflictingBlocks(const CTransaction& tx);
+
 void ProcessMessageInstantX(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
 //check if we need to vote on this transaction
@@ -57,11 +68,26 @@ void DoConsensusVote(CTransaction& tx, int64_t nBlockHeight);
 //process consensus vote message
 bool ProcessConsensusVote(CNode *pnode, CConsensusVote& ctx);
 
-// keep transaction locks in memory for an hour
-void CleanTransactionLocksList();
+void DumpTransactionLocks();
 
 int64_t GetAverageVoteTime();
 
+// rank of a masternode in the InstantX quorum for nBlockHeight, -1 if it's unknown and
+// INSTANTX_SIGNATURES_TOTAL+1 if it's known but outside of the quorum
+int GetInstantXQuorumRank(const CTxIn& vin, int64_t nBlockHeight);
+
+// compute the quorums for the heights new lock requests will use, call on a new tip
+void UpdateInstantXQuorums(int nTipHeight);
+
+/** Top INSTANTX_SIGNATURES_TOTAL masternodes for one block height, kept while the block and the masternode list stay the same */
+class CInstantXQuorum
+{
+public:
+    uint256 hashBlock;
+    int64_t nListChanges;
+    std::map<COutPoint, int> mapRanks;
+};
+
 class CConsensusVote
 {
 public:
@@ -103,7 +129,230 @@ public:
     {
         return txHash;
     }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nBlockHeight);
+        READWRITE(txHash);
+        READWRITE(vecConsensusVotes);
+        READWRITE(nExpiration);
+        READWRITE(nTimeout);
+    }
+};
+
+/** Access to the transaction lock database (instantx.dat)
+ */
+class CTransactionLockDB
+{
+private:
+    boost::filesystem::path pathDB;
+    std::string strMagicMessage;
+public:
+    enum ReadResult {
+        Ok,
+        FileError,
+        HashReadError,
+        IncorrectHash,
+        IncorrectMagicMessage,
+        IncorrectMagicNumber,
+        IncorrectFormat
+    };
+
+    CTransactionLockDB();
+    bool Write(const CTransactionLockManager& objToSave);
+    ReadResult Read(CTransactionLockManager& objToLoad, bool fDryRun = false);
+};
+
+//
+// Transaction Lock Manager
+// Keeps the lock requests, votes, locks and locked inputs, everything about a
+// transaction expires together with its lock
+//
+
+class CTransactionLockManager : public CValidationInterface
+{
+private:
+    // critical section to protect the inner data structures
+    mutable CCriticalSection cs;
+
+    std::map<uint256, CTransaction> mapTxLockReq;
+    std::map<uint256, CTransaction> mapTxLockReqRejected;
+    std::map<uint256, CConsensusVote> mapTxLockVote;
+    std::map<uint256, CTransactionLock> mapTxLocks;
+    // input -> transaction holding the lock on it
+    std::map<COutPoint, uint256> mapLockedInputs;
+
+    // hashes of the votes received for each transaction, accepted or not
+    std::map<uint256, std::set<uint256> > mapVotesByTx;
+    // transactions by the time they were last known to expire at, entries are re-checked when they come up
+    std::set<std::pair<int64_t, uint256> > setExpiry;
+
+    // spends in the last INSTANTX_CONFLICT_BLOCKS connected blocks: input -> (transaction, block)
+    std::map<COutPoint, std::pair<uint256, uint256> > mapRecentSpends;
+    std::deque<std::pair<uint256, std::vector<COutPoint> > > dequeRecentBlocks;
+    // the block SyncTransaction is being called for
+    const CBlock* pblockLast;
+    uint256 hashMerkleRootLast;
+
+    void ScheduleExpiry(const uint256& txHash, int64_t nTime);
+    void Remove(const uint256& txHash);
+    void RebuildIndexes();
+
+protected:
+    // CValidationInterface
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+
+public:
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        LOCK(cs);
+        READWRITE(mapTxLockReq);
+        READWRITE(mapTxLockReqRejected);
+        READWRITE(mapTxLockVote);
+        READWRITE(mapTxLocks);
+        READWRITE(mapLockedInputs);
+        if(ser_action.ForRead())
+            RebuildIndexes();
+    }
+
+    CTransactionLockManager() : pblockLast(NULL) {}
+
+    void Clear();
+
+    /// Lock requests, rejected ones are kept as proof of the conflict
+    void AddTxLockRequest(const CTransaction& tx, bool fRejected = false);
+    bool HasTxLockRequest(const uint256& txHash, bool fIncludeRejected = false);
+    bool IsTxLockRequestRejected(const uint256& txHash);
+    bool GetTxLockRequest(const uint256& txHash, CTransaction& tx, bool fIncludeRejected = false);
+
+    /// Votes, false if the vote was already known
+    bool AddVote(const CConsensusVote& vote);
+    bool HasVote(const uint256& voteHash);
+    bool GetVote(const uint256& voteHash, CConsensusVote& vote);
+
+    /// Create the lock for txHash or move it to nBlockHeight if it exists
+    void CreateLock(const uint256& txHash, int nBlockHeight);
+    /// Count an accepted vote towards its lock (created if needed), returns the signatures counted
+    int AddSignature(const CConsensusVote& vote);
+    /// Signatures for the lock on txHash, -1 if there's no lock or its height isn't known
+    int CountSignatures(const uint256& txHash);
+    bool IsLockTimedOut(const uint256& txHash);
+    /// Let the lock expire with the next CheckAndRemove
+    void ExpireLock(const uint256& txHash);
+
+    /// Lock the inputs of tx that aren't locked yet
+    void LockInputs(const CTransaction& tx);
+    /// Find an input of tx locked by another transaction
+    bool GetConflictingLock(const CTransaction& tx, uint256& txHashLock);
+    /// Recent blocks spending an input of tx in another transaction, they may have been disconnected since.
+    /// False if fewer than INSTANTX_CONFLICT_BLOCKS blocks were connected since startup to look through.
+    bool GetConflictingBlocks(const CTransaction& tx, std::set<uint256>& setBlockHashes);
+
+    /// Remove expired locks and everything that belongs to them
+    void CheckAndRemove();
+
+    std::string ToString() const;
 };
 
+/** Counts of samples in fixed buckets, percentiles are read back as bucket upper bounds
+ */
+class CLatencyHistogram
+{
+private:
+    // upper bounds of the buckets, one more open ended bucket follows
+    std::vector<int64_t> vBounds;
+    std::vector<uint64_t> vCounts;
+    uint64_t nCount;
+    int64_t nSum;
+    int64_t nMax;
+
+public:
+    CLatencyHistogram(const int64_t* pBounds, size_t nBounds);
+
+    void Add(int64_t nValue);
+    void Clear();
+
+    uint64_t GetCount() const { return nCount; }
+    int64_t GetMax() const { return nMax; }
+    int64_t GetAverage() const { return nCount ? nSum / (int64_t)nCount : 0; }
+    /// Upper bound of the bucket holding the nPercent-th percentile, capped at the maximum seen
+    int64_t GetPercentile(int nPercent) const;
+    const std::vector<int64_t>& GetBounds() const { return vBounds; }
+    const std::vector<uint64_t>& GetCounts() const { return vCounts; }
+};
+
+/** When a lock was requested, voted on and completed here, times in milliseconds */
+class CTransactionLockTiming
+{
+public:
+    int64_t nTimeRequest;
+    int64_t nTimeFirstVote;
+    int64_t nTimeComplete;
+    std::vector<int64_t> vVoteTimes;
+
+    CTransactionLockTiming() : nTimeRequest(0), nTimeFirstVote(0), nTimeComplete(0) {}
+};
+
+/** How quickly a masternode's votes arrive after the lock request */
+class CMasternodeVoteStats
+{
+public:
+    int nVotes;
+    int64_t nTotalDelay;
+    int64_t nMaxDelay;
+    int64_t nLastVote;
+
+    CMasternodeVoteStats() : nVotes(0), nTotalDelay(0), nMaxDelay(0), nLastVote(0) {}
+};
+
+//
+// InstantX Metrics
+// Lock latency and quorum responsiveness as seen by this node, votes arriving before
+// their lock request can't be timed and are left out
+//
+
+class CInstantXMetrics
+{
+private:
+    mutable CCriticalSection cs;
+
+    std::map<uint256, CTransactionLockTiming> mapLockTimings;
+    std::map<COutPoint, CMasternodeVoteStats> mapVoteStats;
+
+    // request -> completion, request -> first vote, request -> each vote (ms)
+    CLatencyHistogram histLockLatency;
+    CLatencyHistogram histFirstVoteLatency;
+    CLatencyHistogram histVoteLatency;
+    // time spent in ProcessConsensusVote (us)
+    CLatencyHistogram histVoteProcessing;
+
+    uint64_t nRequests;
+    uint64_t nCompleted;
+
+public:
+    CInstantXMetrics();
+
+    /// A lock request was accepted at nTimeRequest (GetTimeMillis), only accepted requests are timed
+    void RequestReceived(const uint256& txHash, int64_t nTimeRequest);
+    void VoteReceived(const uint256& txHash, const COutPoint& outpointMasternode);
+    void LockCompleted(const uint256& txHash);
+    void VoteProcessed(int64_t nMicros);
+
+    /// Forget timings of expired locks and masternodes that haven't voted for a day
+    void CheckAndRemove();
+    void Clear();
+
+    void GetCounts(uint64_t& nRequestsRet, uint64_t& nCompletedRet, int& nPendingRet) const;
+    CLatencyHistogram GetLockLatency() const { LOCK(cs); return histLockLatency; }
+    CLatencyHistogram GetFirstVoteLatency() const { LOCK(cs); return histFirstVoteLatency; }
+    CLatencyHistogram GetVoteLatency() const { LOCK(cs); return histVoteLatency; }
+    CLatencyHistogram GetVoteProcessing() const { LOCK(cs); return histVoteProcessing; }
+    std::map<COutPoint, CMasternodeVoteStats> GetVoteStats() const { LOCK(cs); return mapVoteStats; }
+    bool GetLockTiming(const uint256& txHash, CTransactionLockTiming& timing) const;
+};
 
 #endif
@@ -881,10 +881,7 @@ int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
     if(nResult < 0) nResult = 0;
 
     if (nResult < 6){
-        std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
-        if (i != mapTxLocks.end()){
-            sigs = (*i).second.CountSignatures();
-        }
+        sigs = txLockManager.CountSignatures(nTXHash);
         if(sigs >= INSTANTX_SIGNATURES_REQUIRED){
             return nInstantXDepth+nResult;
         }
@@ -895,12 +892,7 @@ int GetInputAgeIX(uint256 nTXHash, CTxIn& vin)
 
 int GetIXConfirmations(uint256 nTXHash)
 {    
-    int sigs = 0;
-
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(nTXHash);
-    if (i != mapTxLocks.end()){
-        sigs = (*i).second.CountSignatures();
-    }
+    int sigs = txLockManager.CountSignatures(nTXHash);
     if(sigs >= INSTANTX_SIGNATURES_REQUIRED){
         return nInstantXDepth;
     }
@@ -996,8 +988,38 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+/**
+ * Verify the input scripts of a transaction entering the memory pool. Inputs of
+ * large transactions are spread over the script check threads; the queue is
+ * free to use as every user of it holds cs_main. If the parallel run fails the
+ * checks are repeated serially so that state carries the exact reject reason.
+ */
+static bool CheckInputsForMempool(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, unsigned int flags)
+{
+    AssertLockHeld(cs_main);
+    if (nScriptCheckThreads && tx.vin.size() >= MIN_PARALLEL_SCRIPT_CHECK_INPUTS)
+    {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        std::vector<CScriptCheck> vChecks;
+        if (!CheckInputs(tx, state, view, true, flags, true, &vChecks))
+            return false;
+        control.Add(vChecks);
+        if (control.Wait())
+            return true;
+    }
+    return CheckInputs(tx, state, view, true, flags, true);
+}
+
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectInsaneFee, ignoreFees);
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee, bool ignoreFees)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1025,14 +1047,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
     // ----------- instantX transaction scanning -----------
 
-    BOOST_FOREACH(const CTxIn& in, tx.vin){
-        if(mapLockedInputs.count(in.prevout)){
-            if(mapLockedInputs[in.prevout] != tx.GetHash()){
-                return state.DoS(0,
-                                 error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
-                                 REJECT_INVALID, "tx-lock-conflict");
-            }
-        }
+    uint256 txHashLock;
+    if(txLockManager.GetConflictingLock(tx, txHashLock)){
+        return state.DoS(0,
+                         error("AcceptToMemoryPool : conflicts with existing transaction lock: %s", reason),
+                         REJECT_INVALID, "tx-lock-conflict");
     }
 
     // Check for conflicts with in-memory transactions
@@ -1110,7 +1129,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CAmount nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1161,7 +1180,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true))
+        if (!CheckInputsForMempool(tx, state, view, STANDARD_SCRIPT_VERIFY_FLAGS))
         {
             return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
         }
@@ -1175,7 +1194,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+        if (!CheckInputsForMempool(tx, state, view, MANDATORY_SCRIPT_VERIFY_FLAGS))
         {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
@@ -1219,14 +1238,11 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState &state, const CTransact
 
     // ----------- instantX transaction scanning -----------
 
-    BOOST_FOREACH(const CTxIn& in, tx.vin){
-        if(mapLockedInputs.count(in.prevout)){
-            if(mapLockedInputs[in.prevout] != tx.GetHash()){
-                return state.DoS(0,
-                                 error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
-                                 REJECT_INVALID, "tx-lock-conflict");
-            }
-        }
+    uint256 txHashLock;
+    if(txLockManager.GetConflictingLock(tx, txHashLock)){
+        return state.DoS(0,
+                         error("AcceptableInputs : conflicts with existing transaction lock: %s", reason),
+                         REJECT_INVALID, "tx-lock-conflict");
     }
 
     // Check for conflicts with in-memory transactions
@@ -2010,8 +2026,6 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck() {
     RenameThread("dash-scriptch");
     scriptcheckqueue.Thread();
@@ -2974,15 +2988,12 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         BOOST_FOREACH(const CTransaction& tx, block.vtx){
             if (!tx.IsCoinBase()){
                 //only reject blocks when it's based on complete consensus
-                BOOST_FOREACH(const CTxIn& in, tx.vin){
-                    if(mapLockedInputs.count(in.prevout)){
-                        if(mapLockedInputs[in.prevout] != tx.GetHash()){
-                            mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
-                            LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", mapLockedInputs[in.prevout].ToString(), tx.GetHash().ToString());
-                            return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
-                                             REJECT_INVALID, "conflicting-tx-ix");
-                        }
-                    }
+                uint256 txHashLock;
+                if(txLockManager.GetConflictingLock(tx, txHashLock)){
+                    mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
+                    LogPrintf("CheckBlock() : found conflicting transaction with transaction lock %s %s\n", txHashLock.ToString(), tx.GetHash().ToString());
+                    return state.DoS(0, error("CheckBlock() : found conflicting transaction with transaction lock"),
+                                     REJECT_INVALID, "conflicting-tx-ix");
                 }
             }
         }
@@ -3314,6 +3325,7 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDis
     if(!fLiteMode){
         if (masternodeSync.RequestedMasternodeAssets > MASTERNODE_SYNC_LIST) {
             darkSendPool.NewBlock();
+            UpdateInstantXQuorums(GetHeight());
             masternodePayments.ProcessBlock(GetHeight()+10);
             budget.NewBlock();
         }
@@ -3780,6 +3792,127 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     return nLoaded > 0;
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    std::vector<std::pair<CTransaction, int64_t> > vEntries;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vEntries.reserve(mempool.mapTx.size());
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vEntries.push_back(std::make_pair(it->second.GetTx(), it->second.GetTime()));
+    }
+
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathMempoolNew = GetDataDir() / "mempool.dat.new";
+    FILE *file = fopen(pathMempoolNew.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : Failed to open file %s", __func__, pathMempoolNew.string());
+
+    try {
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << (uint64_t)vEntries.size();
+        for (std::vector<std::pair<CTransaction, int64_t> >::const_iterator it = vEntries.begin(); it != vEntries.end(); ++it)
+            fileout << it->first << it->second;
+        fileout << mapDeltas;
+    }
+    catch (std::exception &e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+
+    if (!RenameOver(pathMempoolNew, pathMempool))
+        return error("%s : Rename-into-place failed", __func__);
+
+    LogPrintf("Dumped mempool: %u transactions, %u deltas in %dms\n", vEntries.size(), mapDeltas.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    // Allowed to fail as this file IS missing on first startup.
+    if (filein.IsNull())
+        return false;
+
+    std::vector<std::pair<CTransaction, int64_t> > vEntries;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    try {
+        uint64_t nVersion, nCount;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("%s : Unknown mempool dump version %d", __func__, nVersion);
+        filein >> nCount;
+        while (nCount--) {
+            CTransaction tx;
+            int64_t nTime;
+            filein >> tx >> nTime;
+            vEntries.push_back(std::make_pair(tx, nTime));
+        }
+        filein >> mapDeltas;
+    }
+    catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    filein.fclose();
+
+    // Restore prioritisation first so the fee checks below see the same
+    // deltas the transactions were accepted with.
+    for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+        mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+    // Re-accept in batches so cs_main is released regularly and the node stays
+    // responsive. Children whose parents have not been re-added yet are retried
+    // until a full pass makes no progress.
+    int nAccepted = 0, nFailed = 0, nAlreadyThere = 0;
+    while (!vEntries.empty()) {
+        std::vector<std::pair<CTransaction, int64_t> > vMissingInputs;
+        for (size_t nPos = 0; nPos < vEntries.size(); nPos += MEMPOOL_LOAD_BATCH_SIZE) {
+            boost::this_thread::interruption_point();
+            if (ShutdownRequested())
+                return false;
+
+            LOCK(cs_main);
+            size_t nEnd = std::min(vEntries.size(), nPos + MEMPOOL_LOAD_BATCH_SIZE);
+            for (size_t i = nPos; i < nEnd; i++) {
+                const CTransaction& tx = vEntries[i].first;
+                if (mempool.exists(tx.GetHash())) {
+                    nAlreadyThere++;
+                    continue;
+                }
+                CValidationState state;
+                bool fMissingInputs = false;
+                if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, &fMissingInputs, vEntries[i].second))
+                    nAccepted++;
+                else if (fMissingInputs)
+                    vMissingInputs.push_back(vEntries[i]);
+                else
+                    nFailed++;
+            }
+        }
+        if (vMissingInputs.size() == vEntries.size()) {
+            nFailed += vMissingInputs.size();
+            break;
+        }
+        vEntries.swap(vMissingInputs);
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i already there in %dms\n",
+              nAccepted, nFailed, nAlreadyThere, GetTimeMillis() - nStart);
+    return true;
+}
+
 void static CheckBlockIndex()
 {
     if (!fCheckBlockIndex) {
@@ -4009,10 +4142,9 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
     case MSG_TXLOCK_REQUEST:
-        return mapTxLockReq.count(inv.hash) ||
-               mapTxLockReqRejected.count(inv.hash);
+        return txLockManager.HasTxLockRequest(inv.hash, true);
     case MSG_TXLOCK_VOTE:
-        return mapTxLockVote.count(inv.hash);
+        return txLockManager.HasVote(inv.hash);
     case MSG_SPORK:
         return mapSporks.count(inv.hash);
     case MSG_MASTERNODE_WINNER:
@@ -4059,6 +4191,26 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/** Serialized copies of the most recently served tip block by send version, shared by every peer fetching it (protected by cs_main) */
+static uint256 hashRecentBlockMessage;
+static std::map<int, CSerializedMessageRef> mapRecentBlockMessages;
+
+/**
+ * Queue the message kept for inv at pfrom's send version, serializing and keeping obj if there is
+ * none yet. obj has to come from the object's own map, the kept messages may outlive it there.
+ */
+template<typename T>
+static void PushRelayMessage(CNode* pfrom, const CInv& inv, const char* pszCommand, const T& obj)
+{
+    int nSendVersion = pfrom->GetSendVersion();
+    CSerializedMessageRef msg;
+    if (!FindRelayMessage(inv, nSendVersion, msg)) {
+        msg = MakeSerializedMessage(pszCommand, obj, nSendVersion);
+        AddRelayMessage(inv, nSendVersion, msg);
+    }
+    pfrom->PushSerializedMessage(msg);
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -4100,10 +4252,24 @@ void static ProcessGetData(CNode* pfrom)
                 {
                     // Send block from disk
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
+                    if (inv.type == MSG_BLOCK && inv.hash == hashRecentBlockMessage && mapRecentBlockMessages.count(pfrom->GetSendVersion()))
+                    {
+                        // Peers ask for a new tip at about the same time, hand them all one serialized copy
+                        pfrom->PushSerializedMessage(mapRecentBlockMessages[pfrom->GetSendVersion()]);
+                    }
+                    else if (!ReadBlockFromDisk(block, (*mi).second))
                         assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    else if (inv.type == MSG_BLOCK)
+                    {
+                        CSerializedMessageRef msg = MakeSerializedMessage("block", block, pfrom->GetSendVersion());
+                        if (mi->second == chainActive.Tip()) {
+                            if (hashRecentBlockMessage != inv.hash)
+                                mapRecentBlockMessages.clear();
+                            hashRecentBlockMessage = inv.hash;
+                            mapRecentBlockMessages[pfrom->GetSendVersion()] = msg;
+                        }
+                        pfrom->PushSerializedMessage(msg);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
@@ -4164,20 +4330,16 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
-                    if(mapTxLockVote.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockVote[inv.hash];
-                        pfrom->PushMessage("txlvote", ss);
+                    CConsensusVote vote;
+                    if(txLockManager.GetVote(inv.hash, vote)){
+                        PushRelayMessage(pfrom, inv, "txlvote", vote);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
-                    if(mapTxLockReq.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockReq[inv.hash];
-                        pfrom->PushMessage("ix", ss);
+                    CTransaction tx;
+                    if(txLockManager.GetTxLockRequest(inv.hash, tx)){
+                        PushRelayMessage(pfrom, inv, "ix", tx);
                         pushed = true;
                     }
                 }
@@ -4240,21 +4402,16 @@ void static ProcessGetData(CNode* pfrom)
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_ANNOUNCE) {
+                    // the seen map decides, the kept message may belong to an entry removed since
                     if(mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodeBroadcast[inv.hash];
-                        pfrom->PushMessage("mnb", ss);
+                        PushRelayMessage(pfrom, inv, "mnb", mnodeman.mapSeenMasternodeBroadcast[inv.hash]);
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_PING) {
                     if(mnodeman.mapSeenMasternodePing.count(inv.hash)){
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodePing[inv.hash];
-                        pfrom->PushMessage("mnp", ss);
+                        PushRelayMessage(pfrom, inv, "mnp", mnodeman.mapSeenMasternodePing[inv.hash]);
                         pushed = true;
                     }
                 }
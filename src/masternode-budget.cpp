@@ -16,6 +16,8 @@
 #include <boost/lexical_cast.hpp>
 
 CBudgetManager budget;
+/** Proposals, finalized budgets and votes accepted since budget.dat was written */
+CCacheJournal budgetJournal("budget.journal");
 CCriticalSection cs_budget;
 
 std::map<uint256, int64_t> askedForSourceProposalOrBudget;
@@ -88,25 +90,125 @@ bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, s
     }
 }
 
-void CBudgetManager::CheckOrphanVotes()
+void CBudgetManager::AddOrphanVote(CBudgetVote& vote)
 {
     LOCK(cs);
 
+    uint256 hash = vote.GetHash();
+    std::map<COutPoint, uint256>& mapByMasternode = mapOrphanBudgetVotesByProposal[vote.nProposalHash];
+    std::map<COutPoint, uint256>::iterator it = mapByMasternode.find(vote.vin.prevout);
+    if(it != mapByMasternode.end()) {
+        std::map<uint256, CBudgetVote>::iterator itVote = mapOrphanMasternodeBudgetVotes.find((*it).second);
+        if(itVote != mapOrphanMasternodeBudgetVotes.end()) {
+            if((*itVote).second.nTime >= vote.nTime) return;
+            mapOrphanMasternodeBudgetVotes.erase(itVote);
+        }
+    } else if(mapOrphanMasternodeBudgetVotes.size() >= MAX_BUDGET_ORPHAN_VOTES) {
+        LogPrint("mnbudget", "CBudgetManager::AddOrphanVote - too many orphan votes, dropping %s\n", hash.ToString());
+        if(mapByMasternode.empty()) mapOrphanBudgetVotesByProposal.erase(vote.nProposalHash);
+        return;
+    }
+
+    mapOrphanMasternodeBudgetVotes[hash] = vote;
+    mapByMasternode[vote.vin.prevout] = hash;
+}
+
+void CBudgetManager::AddOrphanVote(CFinalizedBudgetVote& vote)
+{
+    LOCK(cs);
+
+    uint256 hash = vote.GetHash();
+    std::map<COutPoint, uint256>& mapByMasternode = mapOrphanFinalizedVotesByBudget[vote.nBudgetHash];
+    std::map<COutPoint, uint256>::iterator it = mapByMasternode.find(vote.vin.prevout);
+    if(it != mapByMasternode.end()) {
+        std::map<uint256, CFinalizedBudgetVote>::iterator itVote = mapOrphanFinalizedBudgetVotes.find((*it).second);
+        if(itVote != mapOrphanFinalizedBudgetVotes.end()) {
+            if((*itVote).second.nTime >= vote.nTime) return;
+            mapOrphanFinalizedBudgetVotes.erase(itVote);
+        }
+    } else if(mapOrphanFinalizedBudgetVotes.size() >= MAX_BUDGET_ORPHAN_VOTES) {
+        LogPrint("mnbudget", "CBudgetManager::AddOrphanVote - too many orphan finalized budget votes, dropping %s\n", hash.ToString());
+        if(mapByMasternode.empty()) mapOrphanFinalizedVotesByBudget.erase(vote.nBudgetHash);
+        return;
+    }
+
+    mapOrphanFinalizedBudgetVotes[hash] = vote;
+    mapByMasternode[vote.vin.prevout] = hash;
+}
+
+void CBudgetManager::CheckOrphanVotes(const uint256& nHash)
+{
+    LOCK(cs);
 
     std::string strError = "";
+
+    std::map<uint256, std::map<COutPoint, uint256> >::iterator it1 = mapOrphanBudgetVotesByProposal.find(nHash);
+    if(it1 != mapOrphanBudgetVotesByProposal.end()) {
+        std::map<COutPoint, uint256> mapByMasternode;
+        mapByMasternode.swap((*it1).second);
+        mapOrphanBudgetVotesByProposal.erase(it1);
+
+        BOOST_FOREACH(const PAIRTYPE(COutPoint, uint256)& item, mapByMasternode) {
+            std::map<uint256, CBudgetVote>::iterator itVote = mapOrphanMasternodeBudgetVotes.find(item.second);
+            if(itVote == mapOrphanMasternodeBudgetVotes.end()) continue;
+            CBudgetVote vote = (*itVote).second;
+            mapOrphanMasternodeBudgetVotes.erase(itVote);
+            if(UpdateProposal(vote, NULL, strError))
+                LogPrintf("CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
+            else
+                AddOrphanVote(vote); // kept until it applies or expires
+        }
+    }
+
+    std::map<uint256, std::map<COutPoint, uint256> >::iterator it2 = mapOrphanFinalizedVotesByBudget.find(nHash);
+    if(it2 != mapOrphanFinalizedVotesByBudget.end()) {
+        std::map<COutPoint, uint256> mapByMasternode;
+        mapByMasternode.swap((*it2).second);
+        mapOrphanFinalizedVotesByBudget.erase(it2);
+
+        BOOST_FOREACH(const PAIRTYPE(COutPoint, uint256)& item, mapByMasternode) {
+            std::map<uint256, CFinalizedBudgetVote>::iterator itVote = mapOrphanFinalizedBudgetVotes.find(item.second);
+            if(itVote == mapOrphanFinalizedBudgetVotes.end()) continue;
+            CFinalizedBudgetVote vote = (*itVote).second;
+            mapOrphanFinalizedBudgetVotes.erase(itVote);
+            if(UpdateFinalizedBudget(vote, NULL, strError))
+                LogPrintf("CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
+            else
+                AddOrphanVote(vote); // kept until it applies or expires
+        }
+    }
+}
+
+void CBudgetManager::ExpireOrphanVotes()
+{
+    LOCK(cs);
+
+    int64_t nCutoff = GetTime() - BUDGET_ORPHAN_VOTE_EXPIRY;
+
     std::map<uint256, CBudgetVote>::iterator it1 = mapOrphanMasternodeBudgetVotes.begin();
-    while(it1 != mapOrphanMasternodeBudgetVotes.end()){
-        if(budget.UpdateProposal(((*it1).second), NULL, strError)){
-            LogPrintf("CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
+    while(it1 != mapOrphanMasternodeBudgetVotes.end()) {
+        CBudgetVote& vote = (*it1).second;
+        if(vote.nTime < nCutoff) {
+            std::map<uint256, std::map<COutPoint, uint256> >::iterator itIndex = mapOrphanBudgetVotesByProposal.find(vote.nProposalHash);
+            if(itIndex != mapOrphanBudgetVotesByProposal.end()) {
+                (*itIndex).second.erase(vote.vin.prevout);
+                if((*itIndex).second.empty()) mapOrphanBudgetVotesByProposal.erase(itIndex);
+            }
             mapOrphanMasternodeBudgetVotes.erase(it1++);
         } else {
             ++it1;
         }
     }
+
     std::map<uint256, CFinalizedBudgetVote>::iterator it2 = mapOrphanFinalizedBudgetVotes.begin();
-    while(it2 != mapOrphanFinalizedBudgetVotes.end()){
-        if(budget.UpdateFinalizedBudget(((*it2).second),NULL, strError)){
-            LogPrintf("CBudgetManager::CheckOrphanVotes - Proposal/Budget is known, activating and removing orphan vote\n");
+    while(it2 != mapOrphanFinalizedBudgetVotes.end()) {
+        CFinalizedBudgetVote& vote = (*it2).second;
+        if(vote.nTime < nCutoff) {
+            std::map<uint256, std::map<COutPoint, uint256> >::iterator itIndex = mapOrphanFinalizedVotesByBudget.find(vote.nBudgetHash);
+            if(itIndex != mapOrphanFinalizedVotesByBudget.end()) {
+                (*itIndex).second.erase(vote.vin.prevout);
+                if((*itIndex).second.empty()) mapOrphanFinalizedVotesByBudget.erase(itIndex);
+            }
             mapOrphanFinalizedBudgetVotes.erase(it2++);
         } else {
             ++it2;
@@ -114,6 +216,24 @@ void CBudgetManager::CheckOrphanVotes()
     }
 }
 
+void CBudgetManager::RebuildOrphanIndexes()
+{
+    LOCK(cs);
+
+    // re-add through AddOrphanVote, which also re-keys the maps by vote hash
+    std::map<uint256, CBudgetVote> mapVotes;
+    mapVotes.swap(mapOrphanMasternodeBudgetVotes);
+    mapOrphanBudgetVotesByProposal.clear();
+    for(std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin(); it != mapVotes.end(); ++it)
+        AddOrphanVote((*it).second);
+
+    std::map<uint256, CFinalizedBudgetVote> mapFinalizedVotes;
+    mapFinalizedVotes.swap(mapOrphanFinalizedBudgetVotes);
+    mapOrphanFinalizedVotesByBudget.clear();
+    for(std::map<uint256, CFinalizedBudgetVote>::iterator it = mapFinalizedVotes.begin(); it != mapFinalizedVotes.end(); ++it)
+        AddOrphanVote((*it).second);
+}
+
 void CBudgetManager::SubmitFinalBudget()
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
@@ -216,15 +336,17 @@ bool CBudgetDB::Write(const CBudgetManager& objToSave)
     CDataStream ssObj(SER_DISK, CLIENT_VERSION);
     ssObj << strMagicMessage; // masternode cache file specific magic message
     ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
+    ssObj << CACHE_FILE_VERSION;
     ssObj << objToSave;
     uint256 hash = Hash(ssObj.begin(), ssObj.end());
     ssObj << hash;
 
-    // open output file, and associate with CAutoFile
-    FILE *file = fopen(pathDB.string().c_str(), "wb");
+    // write to a temporary file and move it into place, a crash must not leave a torn snapshot
+    boost::filesystem::path pathTmp(pathDB.string() + ".new");
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
 
     // Write and commit header, data
     try {
@@ -233,7 +355,10 @@ bool CBudgetDB::Write(const CBudgetManager& objToSave)
     catch (std::exception &e) {
         return error("%s : Serialize or I/O error - %s", __func__, e.what());
     }
+    FileCommit(fileout.Get());
     fileout.fclose();
+    if (!RenameOver(pathTmp, pathDB))
+        return error("%s : Failed to rename %s", __func__, pathTmp.string());
 
     LogPrintf("Written info to budget.dat  %dms\n", GetTimeMillis() - nStart);
 
@@ -310,8 +435,8 @@ CBudgetDB::ReadResult CBudgetDB::Read(CBudgetManager& objToLoad, bool fDryRun)
             return IncorrectMagicNumber;
         }
 
-        // de-serialize data into CBudgetManager object
-        ssObj >> objToLoad;
+        // de-serialize data into CBudgetManager object, with or without a file version in front
+        ReadCacheFileData(ssObj, objToLoad, pathDB.filename().string());
     }
     catch (std::exception &e) {
         objToLoad.Clear();
@@ -336,26 +461,13 @@ void DumpBudgets()
     int64_t nStart = GetTimeMillis();
 
     CBudgetDB budgetdb;
-    CBudgetManager tempBudget;
-
-    LogPrintf("Verifying budget.dat format...\n");
-    CBudgetDB::ReadResult readResult = budgetdb.Read(tempBudget, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CBudgetDB::FileError)
-        LogPrintf("Missing budgets file - budget.dat, will try to recreate\n");
-    else if (readResult != CBudgetDB::Ok)
-    {
-        LogPrintf("Error reading budget.dat: ");
-        if(readResult == CBudgetDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-        {
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
+
+    // everything journaled so far is in memory and goes into the snapshot
+    uint64_t nJournalOffset = budgetJournal.GetSize();
     LogPrintf("Writting info to budget.dat...\n");
-    budgetdb.Write(budget);
+    if (!budgetdb.Write(budget))
+        return;
+    budgetJournal.Compact(nJournalOffset);
 
     LogPrintf("Budget dump finished  %dms\n", GetTimeMillis() - nStart);
 }
@@ -370,6 +482,7 @@ bool CBudgetManager::AddFinalizedBudget(CFinalizedBudget& finalizedBudget)
     }
 
     mapFinalizedBudgets.insert(make_pair(finalizedBudget.GetHash(), finalizedBudget));
+    budgetJournal.Append("fbs", CFinalizedBudgetBroadcast(finalizedBudget));
     return true;
 }
 
@@ -387,6 +500,7 @@ bool CBudgetManager::AddProposal(CBudgetProposal& budgetProposal)
     }
 
     mapProposals.insert(make_pair(budgetProposal.GetHash(), budgetProposal));
+    budgetJournal.Append("mprop", CBudgetProposalBroadcast(budgetProposal));
     return true;
 }
 
@@ -575,12 +689,13 @@ bool CBudgetManager::IsTransactionValid(const CTransaction& txNew, int nBlockHei
 
     // check the highest finalized budgets (+/- 10% to assist in consensus)
 
+    int nMinVoteCount = nHighestCount - mnodeman.CountEnabled(MIN_BUDGET_PEER_PROTO_VERSION)/10;
     it = mapFinalizedBudgets.begin();
     while(it != mapFinalizedBudgets.end())
     {
         CFinalizedBudget* pfinalizedBudget = &((*it).second);
 
-        if(pfinalizedBudget->GetVoteCount() > nHighestCount - mnodeman.CountEnabled(MIN_BUDGET_PEER_PROTO_VERSION)/10){
+        if(pfinalizedBudget->GetVoteCount() > nMinVoteCount){
             if(nBlockHeight >= pfinalizedBudget->GetBlockStart() && nBlockHeight <= pfinalizedBudget->GetBlockEnd()){
                 if(pfinalizedBudget->IsTransactionValid(txNew, nBlockHeight)){
                     return true;
@@ -604,8 +719,6 @@ std::vector<CBudgetProposal*> CBudgetManager::GetAllProposals()
     std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
     while(it != mapProposals.end())
     {
-        (*it).second.CleanAndRemove(false);
-
         CBudgetProposal* pbudgetProposal = &((*it).second);
         vBudgetProposalRet.push_back(pbudgetProposal);
 
@@ -636,8 +749,8 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
     std::vector<std::pair<CBudgetProposal*, int> > vBudgetPorposalsSort;
 
     std::map<uint256, CBudgetProposal>::iterator it = mapProposals.begin();
+    // tallies are current, votes of masternodes that went away are dropped by CleanAndRemove in NewBlock
     while(it != mapProposals.end()){
-        (*it).second.CleanAndRemove(false);
         vBudgetPorposalsSort.push_back(make_pair(&((*it).second), (*it).second.GetYeas()-(*it).second.GetNays()));
         ++it;
     }
@@ -655,6 +768,7 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
     int nBlockStart = pindexPrev->nHeight - pindexPrev->nHeight % GetBudgetPaymentCycleBlocks() + GetBudgetPaymentCycleBlocks();
     int nBlockEnd  =  nBlockStart + GetBudgetPaymentCycleBlocks() - 1;
     CAmount nTotalBudget = GetTotalBudget(nBlockStart);
+    int nMinNetVotes = mnodeman.CountEnabled(MIN_BUDGET_PEER_PROTO_VERSION)/10;
 
 
     std::vector<std::pair<CBudgetProposal*, int> >::iterator it2 = vBudgetPorposalsSort.begin();
@@ -665,7 +779,7 @@ std::vector<CBudgetProposal*> CBudgetManager::GetBudget()
         //prop start/end should be inside this period
         if(pbudgetProposal->fValid && pbudgetProposal->nBlockStart <= nBlockStart &&
                 pbudgetProposal->nBlockEnd >= nBlockEnd &&
-                pbudgetProposal->GetYeas() - pbudgetProposal->GetNays() > mnodeman.CountEnabled(MIN_BUDGET_PEER_PROTO_VERSION)/10 && 
+                (*it2).second > nMinNetVotes && 
                 pbudgetProposal->IsEstablished())
         {
             if(pbudgetProposal->GetAmount() + nBudgetAllocated <= nTotalBudget) {
@@ -801,6 +915,20 @@ void CBudgetManager::NewBlock()
      
 
     CheckAndRemove();
+    ExpireOrphanVotes();
+
+    // orphan votes still indexed under a known proposal or budget failed to apply before, retry them
+    std::vector<uint256> vKnownParents;
+    {
+        LOCK(cs);
+        std::map<uint256, std::map<COutPoint, uint256> >::iterator itOrphans;
+        for(itOrphans = mapOrphanBudgetVotesByProposal.begin(); itOrphans != mapOrphanBudgetVotesByProposal.end(); ++itOrphans)
+            if(mapProposals.count((*itOrphans).first)) vKnownParents.push_back((*itOrphans).first);
+        for(itOrphans = mapOrphanFinalizedVotesByBudget.begin(); itOrphans != mapOrphanFinalizedVotesByBudget.end(); ++itOrphans)
+            if(mapFinalizedBudgets.count((*itOrphans).first)) vKnownParents.push_back((*itOrphans).first);
+    }
+    BOOST_FOREACH(const uint256& nHash, vKnownParents)
+        CheckOrphanVotes(nHash);
 
     //remove invalid votes once in a while (we have to check the signatures and validity of every vote, somewhat CPU intensive)
 
@@ -842,7 +970,10 @@ void CBudgetManager::NewBlock()
         }
 
         CBudgetProposal budgetProposal((*it4));
-        if(AddProposal(budgetProposal)) {(*it4).Relay();}
+        if(AddProposal(budgetProposal)) {
+            (*it4).Relay();
+            CheckOrphanVotes(budgetProposal.GetHash());
+        }
 
         LogPrintf("mprop (immature) - new budget - %s\n", (*it4).GetHash().ToString());
         it4 = vecImmatureBudgetProposals.erase(it4); 
@@ -867,7 +998,10 @@ void CBudgetManager::NewBlock()
         LogPrintf("fbs (immature) - new finalized budget - %s\n", (*it5).GetHash().ToString());
 
         CFinalizedBudget finalizedBudget((*it5));
-        if(AddFinalizedBudget(finalizedBudget)) {(*it5).Relay();}
+        if(AddFinalizedBudget(finalizedBudget)) {
+            (*it5).Relay();
+            CheckOrphanVotes(finalizedBudget.GetHash());
+        }
 
         it5 = vecImmatureFinalizedBudgets.erase(it5); 
     }
@@ -932,7 +1066,7 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         LogPrintf("mprop - new budget - %s\n", budgetProposalBroadcast.GetHash().ToString());
 
         //We might have active votes for this proposal that are valid now
-        CheckOrphanVotes();
+        CheckOrphanVotes(budgetProposalBroadcast.GetHash());
     }
 
     if (strCommand == "mvote") { //Masternode Vote
@@ -1003,7 +1137,7 @@ void CBudgetManager::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         masternodeSync.AddedBudgetItem(finalizedBudgetBroadcast.GetHash());
 
         //we might have active votes for this budget that are now valid
-        CheckOrphanVotes();
+        CheckOrphanVotes(finalizedBudgetBroadcast.GetHash());
     }
 
     if (strCommand == "fbvote") { //Finalized Budget Vote
@@ -1212,7 +1346,7 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
             if(!masternodeSync.IsSynced()) return false;
 
             LogPrintf("CBudgetManager::UpdateProposal - Unknown proposal %d, asking for source proposal\n", vote.nProposalHash.ToString());
-            mapOrphanMasternodeBudgetVotes[vote.nProposalHash] = vote;
+            AddOrphanVote(vote);
 
             if(!askedForSourceProposalOrBudget.count(vote.nProposalHash)){
                 pfrom->PushMessage("mnvs", vote.nProposalHash);
@@ -1225,7 +1359,10 @@ bool CBudgetManager::UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string
     }
 
 
-    return mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError);
+    if(!mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError)) return false;
+
+    budgetJournal.Append("mvote", vote);
+    return true;
 }
 
 bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pfrom, std::string& strError)
@@ -1239,7 +1376,7 @@ bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pf
             if(!masternodeSync.IsSynced()) return false;
 
             LogPrintf("CBudgetManager::UpdateFinalizedBudget - Unknown Finalized Proposal %s, asking for source budget\n", vote.nBudgetHash.ToString());
-            mapOrphanFinalizedBudgetVotes[vote.nBudgetHash] = vote;
+            AddOrphanVote(vote);
 
             if(!askedForSourceProposalOrBudget.count(vote.nBudgetHash)){
                 pfrom->PushMessage("mnvs", vote.nBudgetHash);
@@ -1252,7 +1389,46 @@ bool CBudgetManager::UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pf
         return false;
     }
 
-    return mapFinalizedBudgets[vote.nBudgetHash].AddOrUpdateVote(vote, strError);
+    if(!mapFinalizedBudgets[vote.nBudgetHash].AddOrUpdateVote(vote, strError)) return false;
+
+    budgetJournal.Append("fbvote", vote);
+    return true;
+}
+
+void CBudgetManager::ReplayJournalRecord(const std::string& strType, CDataStream& ssRecord)
+{
+    LOCK(cs);
+
+    // applied to the maps directly, going through AddProposal and friends would journal the record again
+    std::string strError = "";
+    if (strType == "mprop") {
+        CBudgetProposalBroadcast budgetProposalBroadcast;
+        ssRecord >> budgetProposalBroadcast;
+        uint256 nHash = budgetProposalBroadcast.GetHash();
+        mapSeenMasternodeBudgetProposals.insert(make_pair(nHash, budgetProposalBroadcast));
+        if(!mapProposals.count(nHash)) mapProposals.insert(make_pair(nHash, CBudgetProposal(budgetProposalBroadcast)));
+    } else if (strType == "fbs") {
+        CFinalizedBudgetBroadcast finalizedBudgetBroadcast;
+        ssRecord >> finalizedBudgetBroadcast;
+        uint256 nHash = finalizedBudgetBroadcast.GetHash();
+        mapSeenFinalizedBudgets.insert(make_pair(nHash, finalizedBudgetBroadcast));
+        if(!mapFinalizedBudgets.count(nHash)) mapFinalizedBudgets.insert(make_pair(nHash, CFinalizedBudget(finalizedBudgetBroadcast)));
+    } else if (strType == "mvote") {
+        CBudgetVote vote;
+        ssRecord >> vote;
+        vote.fValid = true;
+        mapSeenMasternodeBudgetVotes.insert(make_pair(vote.GetHash(), vote));
+        if(mapProposals.count(vote.nProposalHash)) mapProposals[vote.nProposalHash].AddOrUpdateVote(vote, strError);
+    } else if (strType == "fbvote") {
+        CFinalizedBudgetVote vote;
+        ssRecord >> vote;
+        vote.fValid = true;
+        mapSeenFinalizedBudgetVotes.insert(make_pair(vote.GetHash(), vote));
+        if(mapFinalizedBudgets.count(vote.nBudgetHash)) mapFinalizedBudgets[vote.nBudgetHash].AddOrUpdateVote(vote, strError);
+    } else if (strType == "reset") {
+        // SPORK_11_RESET_BUDGET, drop everything replayed before it
+        Clear();
+    }
 }
 
 CBudgetProposal::CBudgetProposal()
@@ -1263,6 +1439,9 @@ CBudgetProposal::CBudgetProposal()
     nAmount = 0;
     nTime = 0;
     fValid = true;
+    nYeas = 0;
+    nNays = 0;
+    nAbstains = 0;
 }
 
 CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strURLIn, int nBlockStartIn, int nBlockEndIn, CScript addressIn, CAmount nAmountIn, uint256 nFeeTXHashIn)
@@ -1275,6 +1454,9 @@ CBudgetProposal::CBudgetProposal(std::string strProposalNameIn, std::string strU
     nAmount = nAmountIn;
     nFeeTXHash = nFeeTXHashIn;
     fValid = true;
+    nYeas = 0;
+    nNays = 0;
+    nAbstains = 0;
 }
 
 CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
@@ -1289,6 +1471,9 @@ CBudgetProposal::CBudgetProposal(const CBudgetProposal& other)
     nFeeTXHash = other.nFeeTXHash;
     mapVotes = other.mapVotes;
     fValid = true;
+    nYeas = other.nYeas;
+    nNays = other.nNays;
+    nAbstains = other.nAbstains;
 }
 
 bool CBudgetProposal::IsValid(std::string& strError, bool fCheckCollateral)
@@ -1383,10 +1568,35 @@ bool CBudgetProposal::AddOrUpdateVote(CBudgetVote& vote, std::string& strError)
         return false;
     }        
 
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.find(hash);
+    if(it != mapVotes.end()) AddToTally((*it).second, -1);
     mapVotes[hash] = vote;
+    AddToTally(vote, 1);
     return true;
 }
 
+void CBudgetProposal::AddToTally(const CBudgetVote& vote, int nDelta)
+{
+    if(!vote.fValid) return;
+
+    if(vote.nVote == VOTE_YES) nYeas += nDelta;
+    else if(vote.nVote == VOTE_NO) nNays += nDelta;
+    else if(vote.nVote == VOTE_ABSTAIN) nAbstains += nDelta;
+}
+
+void CBudgetProposal::RecountVotes()
+{
+    nYeas = 0;
+    nNays = 0;
+    nAbstains = 0;
+
+    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
+    while(it != mapVotes.end()) {
+        AddToTally((*it).second, 1);
+        ++it;
+    }
+}
+
 // If masternode voted for a proposal, but is now invalid -- remove the vote
 void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
 {
@@ -1396,6 +1606,8 @@ void CBudgetProposal::CleanAndRemove(bool fSignatureCheck)
         (*it).second.fValid = (*it).second.SignatureValid(fSignatureCheck);
         ++it;
     }
+
+    RecountVotes();
 }
 
 double CBudgetProposal::GetRatio()
@@ -1418,41 +1630,17 @@ double CBudgetProposal::GetRatio()
 
 int CBudgetProposal::GetYeas()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while(it != mapVotes.end()){
-        if ((*it).second.nVote == VOTE_YES && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    return nYeas;
 }
 
 int CBudgetProposal::GetNays()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while(it != mapVotes.end()){
-        if ((*it).second.nVote == VOTE_NO && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    return nNays;
 }
 
 int CBudgetProposal::GetAbstains()
 {
-    int ret = 0;
-
-    std::map<uint256, CBudgetVote>::iterator it = mapVotes.begin();
-    while(it != mapVotes.end()){
-        if ((*it).second.nVote == VOTE_ABSTAIN && (*it).second.fValid) ret++;
-        ++it;
-    }
-
-    return ret;
+    return nAbstains;
 }
 
 int CBudgetProposal::GetBlockStartCycle()
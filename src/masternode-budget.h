@@ -12,6 +12,7 @@
 #include "util.h"
 #include "base58.h"
 #include "masternode.h"
+#include "cachejournal.h"
 #include <boost/lexical_cast.hpp>
 #include "init.h"
 
@@ -35,11 +36,15 @@ class CTxBudgetPayment;
 static const CAmount BUDGET_FEE_TX = (5*COIN);
 static const int64_t BUDGET_FEE_CONFIRMATIONS = 6;
 static const int64_t BUDGET_VOTE_UPDATE_MIN = 60*60;
+//! orphan votes waiting for their proposal or finalized budget, per kind
+static const unsigned int MAX_BUDGET_ORPHAN_VOTES = 10000;
+static const int64_t BUDGET_ORPHAN_VOTE_EXPIRY = 60*60*24;
 
 extern std::vector<CBudgetProposalBroadcast> vecImmatureBudgetProposals;
 extern std::vector<CFinalizedBudgetBroadcast> vecImmatureFinalizedBudgets;
 
 extern CBudgetManager budget;
+extern CCacheJournal budgetJournal;
 void DumpBudgets();
 
 // Define amount of blocks in budget payment cycle
@@ -82,6 +87,12 @@ private:
     //hold txes until they mature enough to use
     map<uint256, CTransaction> mapCollateral;
 
+    // orphan vote hashes by the proposal / finalized budget they are for, one per masternode
+    std::map<uint256, std::map<COutPoint, uint256> > mapOrphanBudgetVotesByProposal;
+    std::map<uint256, std::map<COutPoint, uint256> > mapOrphanFinalizedVotesByBudget;
+
+    void RebuildOrphanIndexes();
+
 public:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -92,6 +103,7 @@ public:
 
     std::map<uint256, CBudgetProposalBroadcast> mapSeenMasternodeBudgetProposals;
     std::map<uint256, CBudgetVote> mapSeenMasternodeBudgetVotes;
+    // orphan votes by vote hash, use AddOrphanVote to keep the indexes in step
     std::map<uint256, CBudgetVote> mapOrphanMasternodeBudgetVotes;
     std::map<uint256, CFinalizedBudgetBroadcast> mapSeenFinalizedBudgets;
     std::map<uint256, CFinalizedBudgetVote> mapSeenFinalizedBudgetVotes;
@@ -136,12 +148,20 @@ public:
 
     bool UpdateProposal(CBudgetVote& vote, CNode* pfrom, std::string& strError);
     bool UpdateFinalizedBudget(CFinalizedBudgetVote& vote, CNode* pfrom, std::string& strError);
+    /// Apply a record from budget.journal, it was validated before it was journaled
+    void ReplayJournalRecord(const std::string& strType, CDataStream& ssRecord);
     bool PropExists(uint256 nHash);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
     std::string GetRequiredPaymentsString(int nBlockHeight);
     void FillBlockPayee(CMutableTransaction& txNew, CAmount nFees);
 
-    void CheckOrphanVotes();
+    /// Keep a vote until what it votes on arrives, a newer vote replaces the orphan of the same masternode
+    void AddOrphanVote(CBudgetVote& vote);
+    void AddOrphanVote(CFinalizedBudgetVote& vote);
+    /// Apply the orphan votes waiting for proposal or finalized budget nHash
+    void CheckOrphanVotes(const uint256& nHash);
+    /// Drop orphan votes older than BUDGET_ORPHAN_VOTE_EXPIRY
+    void ExpireOrphanVotes();
     void Clear(){
         LOCK(cs);
 
@@ -154,6 +174,8 @@ public:
         mapSeenFinalizedBudgetVotes.clear();
         mapOrphanMasternodeBudgetVotes.clear();
         mapOrphanFinalizedBudgetVotes.clear();
+        mapOrphanBudgetVotesByProposal.clear();
+        mapOrphanFinalizedVotesByBudget.clear();
     }
     void CheckAndRemove();
     std::string ToString() const;
@@ -163,6 +185,7 @@ public:
 
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        LOCK(cs);
         READWRITE(mapSeenMasternodeBudgetProposals);
         READWRITE(mapSeenMasternodeBudgetVotes);
         READWRITE(mapSeenFinalizedBudgets);
@@ -172,6 +195,8 @@ public:
 
         READWRITE(mapProposals);
         READWRITE(mapFinalizedBudgets);
+        if(ser_action.ForRead())
+            RebuildOrphanIndexes();
     }
 };
 
@@ -393,6 +418,12 @@ private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
     CAmount nAlloted;
+    // tallies of the valid votes in mapVotes, kept up to date by AddOrUpdateVote and CleanAndRemove
+    int nYeas;
+    int nNays;
+    int nAbstains;
+
+    void AddToTally(const CBudgetVote& vote, int nDelta);
 
 public:
     bool fValid;
@@ -451,6 +482,8 @@ public:
     CAmount GetAllotted() {return nAlloted;}
 
     void CleanAndRemove(bool fSignatureCheck);
+    /// Recount the tallies from mapVotes
+    void RecountVotes();
 
     uint256 GetHash(){
         CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
@@ -482,6 +515,8 @@ public:
 
         //for saving to the serialized db
         READWRITE(mapVotes);
+        if(ser_action.ForRead())
+            RecountVotes();
     }
 };
 
@@ -16,6 +16,8 @@
 
 /** Object for who's going to get paid on which blocks */
 CMasternodePayments masternodePayments;
+/** Payment votes accepted since mnpayments.dat was written */
+CCacheJournal mnpaymentsJournal("mnpayments.journal");
 
 CCriticalSection cs_vecPayments;
 CCriticalSection cs_mapMasternodeBlocks;
@@ -39,15 +41,17 @@ bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
     CDataStream ssObj(SER_DISK, CLIENT_VERSION);
     ssObj << strMagicMessage; // masternode cache file specific magic message
     ssObj << FLATDATA(Params().MessageStart()); // network specific magic number
+    ssObj << CACHE_FILE_VERSION;
     ssObj << objToSave;
     uint256 hash = Hash(ssObj.begin(), ssObj.end());
     ssObj << hash;
 
-    // open output file, and associate with CAutoFile
-    FILE *file = fopen(pathDB.string().c_str(), "wb");
+    // write to a temporary file and move it into place, a crash must not leave a torn snapshot
+    boost::filesystem::path pathTmp(pathDB.string() + ".new");
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathDB.string());
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
 
     // Write and commit header, data
     try {
@@ -56,7 +60,10 @@ bool CMasternodePaymentDB::Write(const CMasternodePayments& objToSave)
     catch (std::exception &e) {
         return error("%s : Serialize or I/O error - %s", __func__, e.what());
     }
+    FileCommit(fileout.Get());
     fileout.fclose();
+    if (!RenameOver(pathTmp, pathDB))
+        return error("%s : Failed to rename %s", __func__, pathTmp.string());
 
     LogPrintf("Written info to mnpayments.dat  %dms\n", GetTimeMillis() - nStart);
 
@@ -132,8 +139,8 @@ CMasternodePaymentDB::ReadResult CMasternodePaymentDB::Read(CMasternodePayments&
             return IncorrectMagicNumber;
         }
 
-        // de-serialize data into CMasternodePayments object
-        ssObj >> objToLoad;
+        // de-serialize data into CMasternodePayments object, with or without a file version in front
+        ReadCacheFileData(ssObj, objToLoad, pathDB.filename().string());
     }
     catch (std::exception &e) {
         objToLoad.Clear();
@@ -158,26 +165,13 @@ void DumpMasternodePayments()
     int64_t nStart = GetTimeMillis();
 
     CMasternodePaymentDB paymentdb;
-    CMasternodePayments tempPayments;
-
-    LogPrintf("Verifying mnpayments.dat format...\n");
-    CMasternodePaymentDB::ReadResult readResult = paymentdb.Read(tempPayments, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodePaymentDB::FileError)
-        LogPrintf("Missing budgets file - mnpayments.dat, will try to recreate\n");
-    else if (readResult != CMasternodePaymentDB::Ok)
-    {
-        LogPrintf("Error reading mnpayments.dat: ");
-        if(readResult == CMasternodePaymentDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-        {
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
+
+    // everything journaled so far is in memory and goes into the snapshot
+    uint64_t nJournalOffset = mnpaymentsJournal.GetSize();
     LogPrintf("Writting info to mnpayments.dat...\n");
-    paymentdb.Write(masternodePayments);
+    if (!paymentdb.Write(masternodePayments))
+        return;
+    mnpaymentsJournal.Compact(nJournalOffset);
 
     LogPrintf("Budget dump finished  %dms\n", GetTimeMillis() - nStart);
 }
@@ -407,6 +401,7 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
         LogPrint("mnpayments", "mnw - winning vote - Addr %s Height %d bestHeight %d - %s\n", address2.ToString().c_str(), winner.nBlockHeight, chainActive.Tip()->nHeight, winner.vinMasternode.prevout.ToStringShort());
 
         if(masternodePayments.AddWinningMasternode(winner)){
+            mnpaymentsJournal.Append("mnw", winner);
             winner.Relay();
             masternodeSync.AddedMasternodeWinner(winner.GetHash());
         }
@@ -437,8 +432,11 @@ bool CMasternodePaymentWinner::Sign(CKey& keyMasternode, CPubKey& pubKeyMasterno
 
 bool CMasternodePayments::GetBlockPayee(int nBlockHeight, CScript& payee)
 {
-    if(mapMasternodeBlocks.count(nBlockHeight)){
-        return mapMasternodeBlocks[nBlockHeight].GetPayee(payee);
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nBlockHeight);
+    if(it != mapMasternodeBlocks.end()){
+        return (*it).second.GetPayee(payee);
     }
 
     return false;
@@ -457,13 +455,12 @@ bool CMasternodePayments::IsScheduled(CMasternode& mn, int nNotBlockHeight)
     mnpayee = GetScriptForDestination(mn.pubkey.GetID());
 
     CScript payee;
-    for(int64_t h = pindexPrev->nHeight; h <= pindexPrev->nHeight+8; h++){
-        if(h == nNotBlockHeight) continue;
-        if(mapMasternodeBlocks.count(h)){
-            if(mapMasternodeBlocks[h].GetPayee(payee)){
-                if(mnpayee == payee) {
-                    return true;
-                }
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.lower_bound(pindexPrev->nHeight);
+    for(; it != mapMasternodeBlocks.end() && (*it).first <= pindexPrev->nHeight+8; ++it){
+        if((*it).first == nNotBlockHeight) continue;
+        if((*it).second.GetPayee(payee)){
+            if(mnpayee == payee) {
+                return true;
             }
         }
     }
@@ -471,6 +468,23 @@ bool CMasternodePayments::IsScheduled(CMasternode& mn, int nNotBlockHeight)
     return false;
 }
 
+void CMasternodePayments::GetScheduledPayees(int nNotBlockHeight, std::set<CScript>& setPayees)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    setPayees.clear();
+
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    if(pindexPrev == NULL) return;
+
+    CScript payee;
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.lower_bound(pindexPrev->nHeight);
+    for(; it != mapMasternodeBlocks.end() && (*it).first <= pindexPrev->nHeight+8; ++it){
+        if((*it).first == nNotBlockHeight) continue;
+        if((*it).second.GetPayee(payee)) setPayees.insert(payee);
+    }
+}
+
 bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerIn)
 {
     uint256 blockHash = 0;
@@ -495,11 +509,27 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
 
     int n = 1;
     if(IsReferenceNode(winnerIn.vinMasternode)) n = 100;
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, n);
+    {
+        LOCK(cs_mapMasternodeBlocks);
+        CMasternodeBlockPayees& blockPayees = mapMasternodeBlocks[winnerIn.nBlockHeight];
+        blockPayees.AddPayee(winnerIn.payee, n);
+        blockPayees.vecVoteHashes.push_back(winnerIn.GetHash());
+        if(blockPayees.HasPayeeWithVotes(winnerIn.payee, 2))
+            mapPayeeVotedHeights[winnerIn.payee].insert(winnerIn.nBlockHeight);
+    }
 
     return true;
 }
 
+void CMasternodePayments::ReplayJournalRecord(const std::string& strType, CDataStream& ssRecord)
+{
+    if (strType == "mnw") {
+        CMasternodePaymentWinner winner;
+        ssRecord >> winner;
+        AddWinningMasternode(winner);
+    }
+}
+
 bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
 {
     LOCK(cs_vecPayments);
@@ -600,18 +630,68 @@ void CMasternodePayments::CleanPaymentList()
     //keep up to five cycles for historical sake
     int nLimit = std::max(int(mnodeman.size()*1.25), 1000);
 
-    std::map<uint256, CMasternodePaymentWinner>::iterator it = mapMasternodePayeeVotes.begin();
-    while(it != mapMasternodePayeeVotes.end()) {
-        CMasternodePaymentWinner winner = (*it).second;
+    // only the expired heights at the front are visited, each takes its votes along
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
+    while(it != mapMasternodeBlocks.end() && chainActive.Tip()->nHeight - (*it).first > nLimit) {
+        LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payments - block %d\n", (*it).first);
 
-        if(chainActive.Tip()->nHeight - winner.nBlockHeight > nLimit){
-            LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
-            masternodeSync.mapSeenSyncMNW.erase((*it).first);
-            mapMasternodePayeeVotes.erase(it++);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
-        } else {
-            ++it;
+        BOOST_FOREACH(const uint256& hash, (*it).second.vecVoteHashes) {
+            masternodeSync.mapSeenSyncMNW.erase(hash);
+            mapMasternodePayeeVotes.erase(hash);
         }
+
+        BOOST_FOREACH(CMasternodePayee& payee, (*it).second.vecPayments) {
+            std::map<CScript, std::set<int> >::iterator itHeights = mapPayeeVotedHeights.find(payee.scriptPubKey);
+            if(itHeights == mapPayeeVotedHeights.end()) continue;
+            (*itHeights).second.erase((*it).first);
+            if((*itHeights).second.empty()) mapPayeeVotedHeights.erase(itHeights);
+        }
+
+        mapMasternodeBlocks.erase(it++);
+    }
+}
+
+int CMasternodePayments::GetLastPaidHeight(const CScript& payee, int nMaxBlocks)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    if(pindexPrev == NULL) return 0;
+
+    std::map<CScript, std::set<int> >::iterator it = mapPayeeVotedHeights.find(payee);
+    if(it == mapPayeeVotedHeights.end()) return 0;
+
+    // votes for upcoming blocks are already in the set, skip them
+    std::set<int>::iterator itHeight = (*it).second.upper_bound(pindexPrev->nHeight);
+    if(itHeight == (*it).second.begin()) return 0;
+    --itHeight;
+
+    if(*itHeight <= 0 || pindexPrev->nHeight - *itHeight >= nMaxBlocks) return 0;
+
+    return *itHeight;
+}
+
+void CMasternodePayments::RebuildIndexes()
+{
+    LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
+
+    mapPayeeVotedHeights.clear();
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
+    while(it != mapMasternodeBlocks.end()) {
+        (*it).second.vecVoteHashes.clear();
+        BOOST_FOREACH(CMasternodePayee& payee, (*it).second.vecPayments) {
+            if(payee.nVotes >= 2) mapPayeeVotedHeights[payee.scriptPubKey].insert((*it).first);
+        }
+        ++it;
+    }
+
+    std::map<uint256, CMasternodePaymentWinner>::iterator itVote = mapMasternodePayeeVotes.begin();
+    while(itVote != mapMasternodePayeeVotes.end()) {
+        int nHeight = (*itVote).second.nBlockHeight;
+        if(!mapMasternodeBlocks.count(nHeight))
+            mapMasternodeBlocks[nHeight] = CMasternodeBlockPayees(nHeight);
+        mapMasternodeBlocks[nHeight].vecVoteHashes.push_back((*itVote).first);
+        ++itVote;
     }
 }
 
@@ -736,6 +816,7 @@ bool CMasternodePayments::ProcessBlock(int nBlockHeight)
 
         if(AddWinningMasternode(newWinner))
         {
+            mnpaymentsJournal.Append("mnw", newWinner);
             newWinner.Relay();
             nLastBlockHeight = nBlockHeight;
             return true;
@@ -811,17 +892,9 @@ int CMasternodePayments::GetOldestBlock()
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    int nOldestBlock = std::numeric_limits<int>::max();
+    if(mapMasternodeBlocks.empty()) return std::numeric_limits<int>::max();
 
-    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
-    while(it != mapMasternodeBlocks.end()) {
-        if((*it).first < nOldestBlock) {
-            nOldestBlock = (*it).first;
-        }
-        it++;
-    }
-
-    return nOldestBlock;
+    return (*mapMasternodeBlocks.begin()).first;
 }
 
 
@@ -830,15 +903,7 @@ int CMasternodePayments::GetNewestBlock()
 {
     LOCK(cs_mapMasternodeBlocks);
 
-    int nNewestBlock = 0;
-
-    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin();
-    while(it != mapMasternodeBlocks.end()) {
-        if((*it).first > nNewestBlock) {
-            nNewestBlock = (*it).first;
-        }
-        it++;
-    }
+    if(mapMasternodeBlocks.empty()) return 0;
 
-    return nNewestBlock;
+    return (*mapMasternodeBlocks.rbegin()).first;
 }
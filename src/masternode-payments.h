@@ -9,6 +9,7 @@
 #include "key.h"
 #include "main.h"
 #include "masternode.h"
+#include "cachejournal.h"
 #include <boost/lexical_cast.hpp>
 
 using namespace std;
@@ -22,6 +23,7 @@ class CMasternodePaymentWinner;
 class CMasternodeBlockPayees;
 
 extern CMasternodePayments masternodePayments;
+extern CCacheJournal mnpaymentsJournal;
 
 #define MNPAYMENTS_SIGNATURES_REQUIRED           6
 #define MNPAYMENTS_SIGNATURES_TOTAL              10
@@ -89,6 +91,8 @@ class CMasternodeBlockPayees
 public:
     int nBlockHeight;
     std::vector<CMasternodePayee> vecPayments;
+    // hashes of the votes tallied here (not serialized), so the votes leave with the height
+    std::vector<uint256> vecVoteHashes;
 
     CMasternodeBlockPayees(){
         nBlockHeight = 0;
@@ -226,8 +230,11 @@ private:
 
 public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
+    // ordered by height, expired heights are taken off the front together with their votes
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
     std::map<uint256, int> mapMasternodesLastVote; //prevout.hash + prevout.n, nBlockHeight
+    // heights at which each payee has at least 2 votes, kept in step with mapMasternodeBlocks
+    std::map<CScript, std::set<int> > mapPayeeVotedHeights;
 
     CMasternodePayments() {
         nSyncedFromPeer = 0;
@@ -238,18 +245,27 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPayeeVotedHeights.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
+    /// Apply an mnw record from mnpayments.journal, it was validated before it was journaled
+    void ReplayJournalRecord(const std::string& strType, CDataStream& ssRecord);
     bool ProcessBlock(int nBlockHeight);
 
     void Sync(CNode* node, int nCountNeeded);
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
+    /// Most recent height within nMaxBlocks of the tip where payee has at least 2 votes, 0 if none
+    int GetLastPaidHeight(const CScript& payee, int nMaxBlocks);
+    /// Rebuild the indexes derived from the votes after loading them
+    void RebuildIndexes();
 
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
     bool IsScheduled(CMasternode& mn, int nNotBlockHeight);
+    /// Payees leading the vote for the next 8 blocks except nNotBlockHeight, IsScheduled for the whole list at once
+    void GetScheduledPayees(int nNotBlockHeight, std::set<CScript>& setPayees);
 
     bool CanVote(COutPoint outMasternode, int nBlockHeight) {
         LOCK(cs_mapMasternodePayeeVotes);
@@ -277,8 +293,11 @@ public:
 
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        LOCK2(cs_mapMasternodePayeeVotes, cs_mapMasternodeBlocks);
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+        if(ser_action.ForRead())
+            RebuildIndexes();
     }
 };
 
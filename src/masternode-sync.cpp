@@ -187,6 +187,8 @@ void CMasternodeSync::ProcessMessage(CNode* pfrom, std::string& strCommand, CDat
                 if(nItemID != RequestedMasternodeAssets) return;
                 sumMasternodeList += nCount;
                 countMasternodeList++;
+                // a reply to dsegd can be empty when our cached list is current, that still counts as progress
+                if(pfrom->HasFulfilledRequest("dsegd")) lastMasternodeList = GetTime();
                 break;
             case(MASTERNODE_SYNC_MNW):
                 if(nItemID != RequestedMasternodeAssets) return;
@@ -131,16 +131,20 @@ CMasternode::CMasternode(const CMasternodeBroadcast& mnb)
 bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
 {
     if(mnb.sigTime > sigTime) {    
+        CPubKey pubKeyOld = pubkey2;
         pubkey2 = mnb.pubkey2;
+        mnodeman.UpdatePubKeyIndex(this, pubKeyOld);
         sigTime = mnb.sigTime;
         sig = mnb.sig;
+        // rankings filter by protocol version
+        if(protocolVersion != mnb.protocolVersion) mnodeman.MarkListChanged();
         protocolVersion = mnb.protocolVersion;
         addr = mnb.addr;
         lastTimeChecked = 0;
         int nDoS = 0;
         if(mnb.lastPing == CMasternodePing() || (mnb.lastPing != CMasternodePing() && mnb.lastPing.CheckAndUpdate(nDoS, false))) {
             lastPing = mnb.lastPing;
-            mnodeman.mapSeenMasternodePing.insert(make_pair(lastPing.GetHash(), lastPing));
+            mnodeman.AddSeenPing(lastPing);
         }
         return true;
     }
@@ -185,7 +189,14 @@ void CMasternode::Check(bool forceCheck)
     if(!forceCheck && (GetTime() - lastTimeChecked < MASTERNODE_CHECK_SECONDS)) return;
     lastTimeChecked = GetTime();
 
+    int activeStatePrev = activeState;
+    UpdateActiveState();
+    // rankings and quorums of the active masternodes are stale now
+    if(activeState != activeStatePrev) mnodeman.MarkListChanged();
+}
 
+void CMasternode::UpdateActiveState()
+{
     //once spent, stop doing the checks
     if(activeState == MASTERNODE_VIN_SPENT) return;
 
@@ -201,20 +212,31 @@ void CMasternode::Check(bool forceCheck)
     }
 
     if(!unitTest){
-        CValidationState state;
-        CMutableTransaction tx = CMutableTransaction();
-        CTxOut vout = CTxOut(999.99*COIN, darkSendPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
+        // spends of listed collaterals are reported by SyncTransaction, only check the inputs
+        // the first time around (or for masternodes that are not in the list)
+        CMasternodeMan::CollateralState collateralState = mnodeman.GetCollateralState(vin.prevout);
+        if(collateralState == CMasternodeMan::COLLATERAL_SPENT){
+            activeState = MASTERNODE_VIN_SPENT;
+            return;
+        }
 
-        {
-            TRY_LOCK(cs_main, lockMain);
-            if(!lockMain) return;
+        if(collateralState == CMasternodeMan::COLLATERAL_UNKNOWN){
+            CValidationState state;
+            CMutableTransaction tx = CMutableTransaction();
+            CTxOut vout = CTxOut(999.99*COIN, darkSendPool.collateralPubKey);
+            tx.vin.push_back(vin);
+            tx.vout.push_back(vout);
+
+            {
+                TRY_LOCK(cs_main, lockMain);
+                if(!lockMain) return;
 
-            if(!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)){
-                activeState = MASTERNODE_VIN_SPENT;
-                return;
+                if(!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)){
+                    activeState = MASTERNODE_VIN_SPENT;
+                    return;
 
+                }
+                mnodeman.SetCollateralUnspent(vin.prevout);
             }
         }
     }
@@ -222,11 +244,8 @@ void CMasternode::Check(bool forceCheck)
     activeState = MASTERNODE_ENABLED; // OK
 }
 
-int64_t CMasternode::SecondsSincePayment() {
-    CScript pubkeyScript;
-    pubkeyScript = GetScriptForDestination(pubkey.GetID());
-
-    int64_t sec = (GetAdjustedTime() - GetLastPaid());
+int64_t CMasternode::SecondsSincePayment(int nMaxBlocks) {
+    int64_t sec = (GetAdjustedTime() - GetLastPaid(nMaxBlocks));
     int64_t month = 60*60*24*30;
     if(sec < month) return sec; //if it's less than 30 days, give seconds
 
@@ -239,7 +258,7 @@ int64_t CMasternode::SecondsSincePayment() {
     return month + hash.GetCompact(false);
 }
 
-int64_t CMasternode::GetLastPaid() {
+int64_t CMasternode::GetLastPaid(int nMaxBlocks) {
     CBlockIndex* pindexPrev = chainActive.Tip();
     if(pindexPrev == NULL) return false;
 
@@ -254,33 +273,16 @@ int64_t CMasternode::GetLastPaid() {
     // use a deterministic offset to break a tie -- 2.5 minutes
     int64_t nOffset = hash.GetCompact(false) % 150; 
 
-    if (chainActive.Tip() == NULL) return false;
-
-    const CBlockIndex *BlockReading = chainActive.Tip();
-
-    int nMnCount = mnodeman.CountEnabled()*1.25;
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if(n >= nMnCount){
-            return 0;
-        }
-        n++;
+    if(nMaxBlocks < 0) nMaxBlocks = mnodeman.CountEnabled()*1.25;
 
-        if(masternodePayments.mapMasternodeBlocks.count(BlockReading->nHeight)){
-            /*
-                Search for this payee, with at least 2 votes. This will aid in consensus allowing the network 
-                to converge on the same payees quickly, then keep the same schedule.
-            */
-            if(masternodePayments.mapMasternodeBlocks[BlockReading->nHeight].HasPayeeWithVotes(mnpayee, 2)){
-                return BlockReading->nTime + nOffset;
-            }
-        }
-
-        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
-        BlockReading = BlockReading->pprev;
-    }
+    /*
+        Search for this payee, with at least 2 votes. This will aid in consensus allowing the network 
+        to converge on the same payees quickly, then keep the same schedule.
+    */
+    int nPaidHeight = masternodePayments.GetLastPaidHeight(mnpayee, nMaxBlocks);
+    if(nPaidHeight == 0) return 0;
 
-    return 0;
+    return chainActive[nPaidHeight]->nTime + nOffset;
 }
 
 CMasternodeBroadcast::CMasternodeBroadcast()
@@ -443,7 +445,7 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
         TRY_LOCK(cs_main, lockMain);
         if(!lockMain) {
             // not mnb fault, let it to be checked again later
-            mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
+            mnodeman.EraseSeenBroadcast(GetHash());
             masternodeSync.mapSeenSyncMNB.erase(GetHash());
             return false;
         }
@@ -460,7 +462,7 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
     if(GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS){
         LogPrintf("mnb - Input must have at least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
         // maybe we miss few blocks, let this mnb to be checked again later
-        mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
+        mnodeman.EraseSeenBroadcast(GetHash());
         masternodeSync.mapSeenSyncMNB.erase(GetHash());
         return false;
     }
@@ -503,7 +505,7 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
 void CMasternodeBroadcast::Relay()
 {
     CInv inv(MSG_MASTERNODE_ANNOUNCE, GetHash());
-    RelayInv(inv);
+    RelayInv(inv, MakeSerializedMessage("mnb", *this));
 }
 
 bool CMasternodeBroadcast::Sign(CKey& keyCollateralAddress)
@@ -632,6 +634,8 @@ bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled)
             if(mnodeman.mapSeenMasternodeBroadcast.count(hash)) {
                 mnodeman.mapSeenMasternodeBroadcast[hash].lastPing = *this;
             }
+            // the relayed copy still carries the old ping
+            EraseRelayMessage(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
 
             pmn->Check(true);
             if(!pmn->IsEnabled()) return false;
@@ -653,5 +657,5 @@ bool CMasternodePing::CheckAndUpdate(int& nDos, bool fRequireEnabled)
 void CMasternodePing::Relay()
 {
     CInv inv(MSG_MASTERNODE_PING, GetHash());
-    RelayInv(inv);
+    RelayInv(inv, MakeSerializedMessage("mnp", *this));
 }
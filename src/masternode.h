@@ -208,7 +208,8 @@ public:
             READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
+    /// nMaxBlocks is how far back to look for a payment, -1 for CountEnabled()*1.25
+    int64_t SecondsSincePayment(int nMaxBlocks = -1);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -220,6 +221,8 @@ public:
     }
 
     void Check(bool forceCheck = false);
+    /// The checks behind Check, sets activeState
+    void UpdateActiveState();
 
     bool IsBroadcastedWithin(int seconds)
     {
@@ -270,7 +273,7 @@ public:
         return strStatus;
     }
 
-    int64_t GetLastPaid();
+    int64_t GetLastPaid(int nMaxBlocks = -1);
 
 };
 
@@ -14,6 +14,8 @@
 
 /** Masternode manager */
 CMasternodeMan mnodeman;
+/** Broadcasts and pings accepted since mncache.dat was written */
+CCacheJournal mncacheJournal("mncache.journal");
 
 struct CompareLastPaid
 {
@@ -33,14 +35,6 @@ struct CompareScoreTxIn
     }
 };
 
-struct CompareScoreMN
-{
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-                    const pair<int64_t, CMasternode>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
 
 //
 // CMasternodeDB
@@ -60,15 +54,17 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
     CDataStream ssMasternodes(SER_DISK, CLIENT_VERSION);
     ssMasternodes << strMagicMessage; // masternode cache file specific magic message
     ssMasternodes << FLATDATA(Params().MessageStart()); // network specific magic number
+    ssMasternodes << CACHE_FILE_VERSION;
     ssMasternodes << mnodemanToSave;
     uint256 hash = Hash(ssMasternodes.begin(), ssMasternodes.end());
     ssMasternodes << hash;
 
-    // open output file, and associate with CAutoFile
-    FILE *file = fopen(pathMN.string().c_str(), "wb");
+    // write to a temporary file and move it into place, a crash must not leave a torn snapshot
+    boost::filesystem::path pathTmp(pathMN.string() + ".new");
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
     CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
-        return error("%s : Failed to open file %s", __func__, pathMN.string());
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
 
     // Write and commit header, data
     try {
@@ -77,8 +73,10 @@ bool CMasternodeDB::Write(const CMasternodeMan& mnodemanToSave)
     catch (std::exception &e) {
         return error("%s : Serialize or I/O error - %s", __func__, e.what());
     }
-//    FileCommit(fileout);
+    FileCommit(fileout.Get());
     fileout.fclose();
+    if (!RenameOver(pathTmp, pathMN))
+        return error("%s : Failed to rename %s", __func__, pathTmp.string());
 
     LogPrintf("Written info to mncache.dat  %dms\n", GetTimeMillis() - nStart);
     LogPrintf("  %s\n", mnodemanToSave.ToString());
@@ -152,8 +150,9 @@ CMasternodeDB::ReadResult CMasternodeDB::Read(CMasternodeMan& mnodemanToLoad, bo
             error("%s : Invalid network magic number", __func__);
             return IncorrectMagicNumber;
         }
-        // de-serialize data into CMasternodeMan object
-        ssMasternodes >> mnodemanToLoad;
+
+        // de-serialize data into CMasternodeMan object, with or without a file version in front
+        ReadCacheFileData(ssMasternodes, mnodemanToLoad, pathMN.filename().string());
     }
     catch (std::exception &e) {
         mnodemanToLoad.Clear();
@@ -178,32 +177,20 @@ void DumpMasternodes()
     int64_t nStart = GetTimeMillis();
 
     CMasternodeDB mndb;
-    CMasternodeMan tempMnodeman;
-
-    LogPrintf("Verifying mncache.dat format...\n");
-    CMasternodeDB::ReadResult readResult = mndb.Read(tempMnodeman, true);
-    // there was an error and it was not an error on file opening => do not proceed
-    if (readResult == CMasternodeDB::FileError)
-        LogPrintf("Missing masternode cache file - mncache.dat, will try to recreate\n");
-    else if (readResult != CMasternodeDB::Ok)
-    {
-        LogPrintf("Error reading mncache.dat: ");
-        if(readResult == CMasternodeDB::IncorrectFormat)
-            LogPrintf("magic is ok but data has invalid format, will try to recreate\n");
-        else
-        {
-            LogPrintf("file format is unknown or invalid, please fix it manually\n");
-            return;
-        }
-    }
+
+    // everything journaled so far is in memory and goes into the snapshot
+    uint64_t nJournalOffset = mncacheJournal.GetSize();
     LogPrintf("Writting info to mncache.dat...\n");
-    mndb.Write(mnodeman);
+    if (!mndb.Write(mnodeman))
+        return;
+    mncacheJournal.Compact(nJournalOffset);
 
     LogPrintf("Masternode dump finished  %dms\n", GetTimeMillis() - nStart);
 }
 
 CMasternodeMan::CMasternodeMan() {
     nDsqCount = 0;
+    nListChanges = 0;
 }
 
 bool CMasternodeMan::Add(CMasternode &mn)
@@ -217,15 +204,307 @@ bool CMasternodeMan::Add(CMasternode &mn)
     if (pmn == NULL)
     {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.addr.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        AddToIndexes(listMasternodes.insert(listMasternodes.end(), mn));
+        mapRankings.clear();
+        MarkListChanged();
+        // entries from dsee and our own activation have no broadcast record in the journal
+        mncacheJournal.Append("mn", mn);
         return true;
     }
 
     return false;
 }
 
+void CMasternodeMan::AddToIndexes(std::list<CMasternode>::iterator it)
+{
+    CMasternode* pmn = &(*it);
+    mapMasternodesByOutPoint.insert(make_pair(pmn->vin.prevout, it));
+    mapMasternodesByPayee.insert(make_pair(GetScriptForDestination(pmn->pubkey.GetID()), pmn));
+    mapMasternodesByPubKey.insert(make_pair(pmn->pubkey2, pmn));
+
+    LOCK(cs_collaterals);
+    mapCollaterals.insert(make_pair(pmn->vin.prevout, COLLATERAL_UNKNOWN));
+}
+
+void CMasternodeMan::RemoveFromIndexes(CMasternode* pmn)
+{
+    mapMasternodesByOutPoint.erase(pmn->vin.prevout);
+    {
+        LOCK(cs_collaterals);
+        mapCollaterals.erase(pmn->vin.prevout);
+    }
+
+    typedef boost::unordered_multimap<CScript, CMasternode*, MasternodeScriptHasher>::iterator payee_iterator;
+    std::pair<payee_iterator, payee_iterator> rangePayee = mapMasternodesByPayee.equal_range(GetScriptForDestination(pmn->pubkey.GetID()));
+    for (payee_iterator it = rangePayee.first; it != rangePayee.second; ++it) {
+        if (it->second == pmn) {
+            mapMasternodesByPayee.erase(it);
+            break;
+        }
+    }
+
+    typedef boost::unordered_multimap<CPubKey, CMasternode*, MasternodePubKeyHasher>::iterator pubkey_iterator;
+    std::pair<pubkey_iterator, pubkey_iterator> rangePubKey = mapMasternodesByPubKey.equal_range(pmn->pubkey2);
+    for (pubkey_iterator it = rangePubKey.first; it != rangePubKey.second; ++it) {
+        if (it->second == pmn) {
+            mapMasternodesByPubKey.erase(it);
+            break;
+        }
+    }
+}
+
+void CMasternodeMan::RebuildIndexes()
+{
+    {
+        LOCK(cs_collaterals);
+        mapCollaterals.clear();
+    }
+    mapMasternodesByOutPoint.clear();
+    mapMasternodesByPayee.clear();
+    mapMasternodesByPubKey.clear();
+
+    for (std::list<CMasternode>::iterator it = listMasternodes.begin(); it != listMasternodes.end(); ++it)
+        AddToIndexes(it);
+    mapRankings.clear();
+    MarkListChanged();
+}
+
+std::list<CMasternode>::iterator CMasternodeMan::Erase(std::list<CMasternode>::iterator it)
+{
+    mncacheJournal.Append("mnrm", (*it).vin.prevout);
+    RemoveFromIndexes(&(*it));
+    mapRankings.clear();
+    MarkListChanged();
+    return listMasternodes.erase(it);
+}
+
+void CMasternodeMan::UpdatePubKeyIndex(CMasternode* pmn, const CPubKey& pubKeyOld)
+{
+    LOCK(cs);
+
+    if (pmn->pubkey2 == pubKeyOld)
+        return;
+
+    // only entries of our own list are indexed, leave copies alone
+    typedef boost::unordered_multimap<CPubKey, CMasternode*, MasternodePubKeyHasher>::iterator pubkey_iterator;
+    std::pair<pubkey_iterator, pubkey_iterator> range = mapMasternodesByPubKey.equal_range(pubKeyOld);
+    for (pubkey_iterator it = range.first; it != range.second; ++it) {
+        if (it->second == pmn) {
+            mapMasternodesByPubKey.erase(it);
+            mapMasternodesByPubKey.insert(make_pair(pmn->pubkey2, pmn));
+            return;
+        }
+    }
+}
+
+void CMasternodeMan::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    // Called for transactions entering the mempool, connected and disconnected blocks and
+    // mempool conflicts. Only a connected block marks a collateral spent for good. Without a
+    // block the spend may just have been undone by a reorg, so the collateral goes back to
+    // unknown and the next Check verifies it against the mempool and the UTXO set again.
+    LOCK(cs_collaterals);
+
+    if(mapCollaterals.empty()) return;
+
+    CollateralState newState = pblock ? COLLATERAL_SPENT : COLLATERAL_UNKNOWN;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        std::map<COutPoint, CollateralState>::iterator it = mapCollaterals.find(txin.prevout);
+        if(it != mapCollaterals.end() && (*it).second != newState) {
+            LogPrint("masternode", "CMasternodeMan::SyncTransaction - collateral %s %s by %s\n", txin.prevout.ToString(),
+                pblock ? "spent" : "needs checking", tx.GetHash().ToString());
+            (*it).second = newState;
+        }
+    }
+}
+
+CMasternodeMan::CollateralState CMasternodeMan::GetCollateralState(const COutPoint& outpoint)
+{
+    LOCK(cs_collaterals);
+
+    std::map<COutPoint, CollateralState>::iterator it = mapCollaterals.find(outpoint);
+    if(it == mapCollaterals.end()) return COLLATERAL_UNKNOWN;
+    return (*it).second;
+}
+
+void CMasternodeMan::SetCollateralUnspent(const COutPoint& outpoint)
+{
+    LOCK(cs_collaterals);
+
+    std::map<COutPoint, CollateralState>::iterator it = mapCollaterals.find(outpoint);
+    if(it != mapCollaterals.end() && (*it).second == COLLATERAL_UNKNOWN)
+        (*it).second = COLLATERAL_UNSPENT;
+}
+
+void CMasternodeMan::AddSeenBroadcast(CMasternodeBroadcast& mnb)
+{
+    LOCK(cs);
+
+    uint256 hash = mnb.GetHash();
+    if(!mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb)).second) return;
+
+    setSeenBroadcastExpiry.insert(make_pair(mnb.lastPing.sigTime, hash));
+    mapSeenBroadcastsByOutPoint[mnb.vin.prevout].insert(hash);
+
+    if(mapSeenMasternodeBroadcast.size() > MASTERNODES_SEEN_MNB_MAX)
+        ExpireSeenBroadcasts(0, MASTERNODES_SEEN_MNB_MAX);
+}
+
+void CMasternodeMan::EraseSeenBroadcast(const uint256& hash)
+{
+    LOCK(cs);
+
+    // the expiry entry is dropped lazily once it comes up
+    map<uint256, CMasternodeBroadcast>::iterator it = mapSeenMasternodeBroadcast.find(hash);
+    if(it == mapSeenMasternodeBroadcast.end()) return;
+
+    std::map<COutPoint, std::set<uint256> >::iterator it2 = mapSeenBroadcastsByOutPoint.find((*it).second.vin.prevout);
+    if(it2 != mapSeenBroadcastsByOutPoint.end()){
+        (*it2).second.erase(hash);
+        if((*it2).second.empty()) mapSeenBroadcastsByOutPoint.erase(it2);
+    }
+
+    mapSeenMasternodeBroadcast.erase(it);
+}
+
+void CMasternodeMan::AddSeenPing(CMasternodePing& mnp)
+{
+    LOCK(cs);
+
+    uint256 hash = mnp.GetHash();
+    if(!mapSeenMasternodePing.insert(make_pair(hash, mnp)).second) return;
+
+    setSeenPingExpiry.insert(make_pair(mnp.sigTime, hash));
+
+    if(mapSeenMasternodePing.size() > MASTERNODES_SEEN_MNP_MAX)
+        ExpireSeenPings(0, MASTERNODES_SEEN_MNP_MAX);
+}
+
+void CMasternodeMan::EraseSeenBroadcasts(const COutPoint& outpoint)
+{
+    std::map<COutPoint, std::set<uint256> >::iterator it = mapSeenBroadcastsByOutPoint.find(outpoint);
+    if(it == mapSeenBroadcastsByOutPoint.end()) return;
+
+    std::set<uint256> setHashes = (*it).second;
+    BOOST_FOREACH(const uint256& hash, setHashes) {
+        masternodeSync.mapSeenSyncMNB.erase(hash);
+        EraseSeenBroadcast(hash);
+    }
+}
+
+void CMasternodeMan::ReplayJournalRecord(const std::string& strType, CDataStream& ssRecord)
+{
+    LOCK(cs);
+
+    if (strType == "mn") {
+        CMasternode mn;
+        ssRecord >> mn;
+
+        Add(mn);
+    } else if (strType == "mnrm") {
+        COutPoint outpoint;
+        ssRecord >> outpoint;
+
+        boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, MasternodeOutPointHasher>::iterator mi = mapMasternodesByOutPoint.find(outpoint);
+        if (mi != mapMasternodesByOutPoint.end()) {
+            EraseSeenBroadcasts(outpoint);
+            Erase(mi->second);
+        }
+    } else if (strType == "mnb") {
+        CMasternodeBroadcast mnb;
+        ssRecord >> mnb;
+
+        AddSeenBroadcast(mnb);
+        CMasternode* pmn = Find(mnb.vin);
+        if (pmn == NULL) {
+            CMasternode mn(mnb);
+            Add(mn);
+        } else {
+            pmn->UpdateFromNewBroadcast(mnb);
+        }
+    } else if (strType == "mnp") {
+        CMasternodePing mnp;
+        ssRecord >> mnp;
+
+        AddSeenPing(mnp);
+        CMasternode* pmn = Find(mnp.vin);
+        if (pmn != NULL && mnp.sigTime > pmn->lastPing.sigTime)
+            pmn->lastPing = mnp;
+    }
+}
+
+void CMasternodeMan::ExpireSeenBroadcasts(int64_t nCutoff, size_t nMaxSize)
+{
+    // the lastPing of a seen broadcast gets refreshed in place, so an entry that comes up
+    // is put back with its current time unless it really expired or we're over the limit
+    while(!setSeenBroadcastExpiry.empty()){
+        std::set<std::pair<int64_t, uint256> >::iterator it = setSeenBroadcastExpiry.begin();
+        bool fOverLimit = mapSeenMasternodeBroadcast.size() > nMaxSize;
+        if((*it).first >= nCutoff && !fOverLimit) break;
+
+        uint256 hash = (*it).second;
+        setSeenBroadcastExpiry.erase(it);
+
+        map<uint256, CMasternodeBroadcast>::iterator mi = mapSeenMasternodeBroadcast.find(hash);
+        if(mi == mapSeenMasternodeBroadcast.end()) continue;
+
+        int64_t nTime = (*mi).second.lastPing.sigTime;
+        if(nTime < nCutoff || fOverLimit){
+            masternodeSync.mapSeenSyncMNB.erase(hash);
+            EraseSeenBroadcast(hash);
+        } else {
+            setSeenBroadcastExpiry.insert(make_pair(nTime, hash));
+        }
+    }
+}
+
+void CMasternodeMan::ExpireSeenPings(int64_t nCutoff, size_t nMaxSize)
+{
+    while(!setSeenPingExpiry.empty()){
+        std::set<std::pair<int64_t, uint256> >::iterator it = setSeenPingExpiry.begin();
+        if((*it).first >= nCutoff && mapSeenMasternodePing.size() <= nMaxSize) break;
+
+        mapSeenMasternodePing.erase((*it).second);
+        setSeenPingExpiry.erase(it);
+    }
+}
+
+void CMasternodeMan::ExpireAskedForEntries(int64_t nCutoff, size_t nMaxSize)
+{
+    while(!setWeAskedForEntryExpiry.empty()){
+        std::set<std::pair<int64_t, COutPoint> >::iterator it = setWeAskedForEntryExpiry.begin();
+        if((*it).first >= nCutoff && mWeAskedForMasternodeListEntry.size() <= nMaxSize) break;
+
+        // asked again since, or already erased when the masternode was removed
+        std::map<COutPoint, int64_t>::iterator mi = mWeAskedForMasternodeListEntry.find((*it).second);
+        if(mi != mWeAskedForMasternodeListEntry.end() && (*mi).second == (*it).first)
+            mWeAskedForMasternodeListEntry.erase(mi);
+        setWeAskedForEntryExpiry.erase(it);
+    }
+}
+
+void CMasternodeMan::RebuildSeenIndexes()
+{
+    setSeenBroadcastExpiry.clear();
+    mapSeenBroadcastsByOutPoint.clear();
+    for(map<uint256, CMasternodeBroadcast>::iterator it = mapSeenMasternodeBroadcast.begin(); it != mapSeenMasternodeBroadcast.end(); ++it){
+        setSeenBroadcastExpiry.insert(make_pair((*it).second.lastPing.sigTime, (*it).first));
+        mapSeenBroadcastsByOutPoint[(*it).second.vin.prevout].insert((*it).first);
+    }
+
+    setSeenPingExpiry.clear();
+    for(map<uint256, CMasternodePing>::iterator it = mapSeenMasternodePing.begin(); it != mapSeenMasternodePing.end(); ++it)
+        setSeenPingExpiry.insert(make_pair((*it).second.sigTime, (*it).first));
+
+    setWeAskedForEntryExpiry.clear();
+    for(map<COutPoint, int64_t>::iterator it = mWeAskedForMasternodeListEntry.begin(); it != mWeAskedForMasternodeListEntry.end(); ++it)
+        setWeAskedForEntryExpiry.insert(make_pair((*it).second, (*it).first));
+}
+
 void CMasternodeMan::AskForMN(CNode* pnode, CTxIn &vin)
 {
+    LOCK(cs);
+
     std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasternodeListEntry.find(vin.prevout);
     if (i != mWeAskedForMasternodeListEntry.end())
     {
@@ -239,13 +518,18 @@ void CMasternodeMan::AskForMN(CNode* pnode, CTxIn &vin)
     pnode->PushMessage("dseg", vin);
     int64_t askAgain = GetTime() + MASTERNODE_MIN_MNP_SECONDS;
     mWeAskedForMasternodeListEntry[vin.prevout] = askAgain;
+    setWeAskedForEntryExpiry.insert(make_pair(askAgain, vin.prevout));
+
+    // one entry per masternode asked for, bounded like the seen maps
+    if(mWeAskedForMasternodeListEntry.size() > MASTERNODES_ASKED_ENTRIES_MAX)
+        ExpireAskedForEntries(0, MASTERNODES_ASKED_ENTRIES_MAX);
 }
 
 void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH(CMasternode& mn, listMasternodes) {
         mn.Check();
     }
 }
@@ -257,8 +541,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while(it != vMasternodes.end()){
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while(it != listMasternodes.end()){
         if((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
                 (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
                 (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
@@ -268,27 +552,12 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             //erase all of the broadcasts we've seen from this vin
             // -- if we missed a few pings and the node was removed, this will allow is to get it back without them 
             //    sending a brand new mnb
-            map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
-            while(it3 != mapSeenMasternodeBroadcast.end()){
-                if((*it3).second.vin == (*it).vin){
-                    masternodeSync.mapSeenSyncMNB.erase((*it3).first);
-                    mapSeenMasternodeBroadcast.erase(it3++);
-                } else {
-                    ++it3;
-                }
-            }
+            EraseSeenBroadcasts((*it).vin.prevout);
 
             // allow us to ask for this masternode again if we see another ping
-            map<COutPoint, int64_t>::iterator it2 = mWeAskedForMasternodeListEntry.begin();
-            while(it2 != mWeAskedForMasternodeListEntry.end()){
-                if((*it2).first == (*it).vin.prevout){
-                    mWeAskedForMasternodeListEntry.erase(it2++);
-                } else {
-                    ++it2;
-                }
-            }
+            mWeAskedForMasternodeListEntry.erase((*it).vin.prevout);
 
-            it = vMasternodes.erase(it);
+            it = Erase(it);
         } else {
             ++it;
         }
@@ -315,45 +584,31 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     }
 
     // check which Masternodes we've asked for
-    map<COutPoint, int64_t>::iterator it2 = mWeAskedForMasternodeListEntry.begin();
-    while(it2 != mWeAskedForMasternodeListEntry.end()){
-        if((*it2).second < GetTime()){
-            mWeAskedForMasternodeListEntry.erase(it2++);
-        } else {
-            ++it2;
-        }
-    }
+    ExpireAskedForEntries(GetTime(), MASTERNODES_ASKED_ENTRIES_MAX);
 
-    // remove expired mapSeenMasternodeBroadcast       
-    map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();     
-    while(it3 != mapSeenMasternodeBroadcast.end()){        
-        if((*it3).second.lastPing.sigTime < GetTime()-(MASTERNODE_REMOVAL_SECONDS*2)){     
-            mapSeenMasternodeBroadcast.erase(it3++);       
-            masternodeSync.mapSeenSyncMNB.erase((*it3).second.GetHash());      
-        } else {       
-            ++it3;     
-        }      
-    }      
-    
-    // remove expired mapSeenMasternodePing
-    map<uint256, CMasternodePing>::iterator it4 = mapSeenMasternodePing.begin();
-    while(it4 != mapSeenMasternodePing.end()){
-        if((*it4).second.sigTime < GetTime()-(MASTERNODE_REMOVAL_SECONDS*2)){
-            mapSeenMasternodePing.erase(it4++);
-        } else {
-            ++it4;
-        }
-    }
+    // remove expired mapSeenMasternodeBroadcast and mapSeenMasternodePing
+    ExpireSeenBroadcasts(GetTime()-(MASTERNODE_REMOVAL_SECONDS*2), MASTERNODES_SEEN_MNB_MAX);
+    ExpireSeenPings(GetTime()-(MASTERNODE_REMOVAL_SECONDS*2), MASTERNODES_SEEN_MNP_MAX);
 
 }
 
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    listMasternodes.clear();
+    mapMasternodesByOutPoint.clear();
+    mapMasternodesByPayee.clear();
+    mapMasternodesByPubKey.clear();
+    mapRankings.clear();
+    MarkListChanged();
+    {
+        LOCK(cs_collaterals);
+        mapCollaterals.clear();
+    }
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
+    setWeAskedForEntryExpiry.clear();
     nDsqCount = 0;
 }
 
@@ -362,7 +617,7 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH(CMasternode& mn, listMasternodes) {
         mn.Check();
         if(mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -388,35 +643,107 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
         }
     }
     
-    pnode->PushMessage("dseg", CTxIn());
+    if(pnode->nVersion >= MIN_MNLIST_DIGEST_PROTO_VERSION && !listMasternodes.empty()) {
+        // we have a list already (mncache.dat), only ask for what changed since
+        std::vector<uint256> vBucketHashes;
+        GetListDigest(vBucketHashes);
+
+        // pings older than our newest one were most likely seen before we went down,
+        // allow one ping interval for the ones still in flight
+        int64_t nPingsSince = 0;
+        BOOST_FOREACH(CMasternode& mn, listMasternodes)
+            nPingsSince = std::max(nPingsSince, mn.lastPing.sigTime);
+        nPingsSince -= MASTERNODE_PING_SECONDS;
+
+        pnode->PushMessage("dsegd", MASTERNODES_DIGEST_VERSION, vBucketHashes, nPingsSince);
+        pnode->FulfilledRequest("dsegd");
+    } else {
+        pnode->PushMessage("dseg", CTxIn());
+    }
     int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
 }
 
-CMasternode *CMasternodeMan::Find(const CScript &payee)
+int64_t CMasternodeMan::GetListChanges() const
+{
+    LOCK(cs_listChanges);
+    return nListChanges;
+}
+
+void CMasternodeMan::MarkListChanged()
+{
+    LOCK(cs_listChanges);
+    nListChanges++;
+}
+
+static unsigned int GetListDigestBucket(const COutPoint& outpoint)
+{
+    return outpoint.hash.GetLow64() % MASTERNODES_DIGEST_BUCKETS;
+}
+
+void CMasternodeMan::GetListDigest(std::vector<uint256>& vBucketHashes)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
-    {
-        payee2 = GetScriptForDestination(mn.pubkey.GetID());
-        if(payee2 == payee)
-            return &mn;
+    // hashed in outpoint order so both sides agree regardless of list order. Whether an
+    // entry is enabled depends on when each side last checked it, so disabled entries are
+    // hashed as well; their latest pings are compared through nPingsSince instead.
+    std::map<COutPoint, int64_t> mapEntries;
+    BOOST_FOREACH(CMasternode& mn, listMasternodes) {
+        if(mn.addr.IsRFC1918()) continue;
+        mapEntries.insert(make_pair(mn.vin.prevout, mn.sigTime));
     }
-    return NULL;
+
+    std::vector<CHashWriter> vHashers(MASTERNODES_DIGEST_BUCKETS, CHashWriter(SER_GETHASH, PROTOCOL_VERSION));
+    for(std::map<COutPoint, int64_t>::iterator it = mapEntries.begin(); it != mapEntries.end(); ++it)
+        vHashers[GetListDigestBucket((*it).first)] << (*it).first << (*it).second;
+
+    vBucketHashes.clear();
+    vBucketHashes.reserve(MASTERNODES_DIGEST_BUCKETS);
+    BOOST_FOREACH(CHashWriter& hasher, vHashers)
+        vBucketHashes.push_back(hasher.GetHash());
+}
+
+bool CMasternodeMan::CheckListRequest(CNode* pfrom)
+{
+    //local network
+    bool isLocal = (pfrom->addr.IsRFC1918() || pfrom->addr.IsLocal());
+
+    if(!isLocal && Params().NetworkID() == CBaseChainParams::MAIN) {
+        std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
+        if (i != mAskedUsForMasternodeList.end()){
+            int64_t t = (*i).second;
+            if (GetTime() < t) {
+                Misbehaving(pfrom->GetId(), 34);
+                LogPrintf("dseg - peer already asked me for the list\n");
+                return false;
+            }
+        }
+        int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
+        mAskedUsForMasternodeList[pfrom->addr] = askAgain;
+    }
+
+    return true;
+}
+
+CMasternode *CMasternodeMan::Find(const CScript &payee)
+{
+    LOCK(cs);
+
+    boost::unordered_multimap<CScript, CMasternode*, MasternodeScriptHasher>::iterator it = mapMasternodesByPayee.find(payee);
+    if(it == mapMasternodesByPayee.end())
+        return NULL;
+    return it->second;
 }
 
 CMasternode *CMasternodeMan::Find(const CTxIn &vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
-    {
-        if(mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, MasternodeOutPointHasher>::iterator it = mapMasternodesByOutPoint.find(vin.prevout);
+    if(it == mapMasternodesByOutPoint.end())
+        return NULL;
+    return &(*it->second);
 }
 
 
@@ -424,12 +751,10 @@ CMasternode *CMasternodeMan::Find(const CPubKey &pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
-    {
-        if(mn.pubkey2 == pubKeyMasternode)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_multimap<CPubKey, CMasternode*, MasternodePubKeyHasher>::iterator it = mapMasternodesByPubKey.find(pubKeyMasternode);
+    if(it == mapMasternodesByPubKey.end())
+        return NULL;
+    return it->second;
 }
 
 // 
@@ -447,7 +772,9 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH(CMasternode &mn, vMasternodes)
+    std::set<CScript> setScheduledPayees;
+    masternodePayments.GetScheduledPayees(nBlockHeight, setScheduledPayees);
+    BOOST_FOREACH(CMasternode &mn, listMasternodes)
     {
         mn.Check();
         if(!mn.IsEnabled()) continue;
@@ -456,7 +783,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         if(mn.protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) continue;
 
         //it's in the list (up to 8 entries ahead of current block to allow propagation) -- so let's skip it
-        if(masternodePayments.IsScheduled(mn, nBlockHeight)) continue;
+        if(setScheduledPayees.count(GetScriptForDestination(mn.pubkey.GetID()))) continue;
 
         //it's too new, wait for a cycle
         if(fFilterSigTime && mn.sigTime + (nMnCount*2.6*60) > GetAdjustedTime()) continue;
@@ -464,7 +791,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if(mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nMnCount*1.25), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -511,7 +838,7 @@ CMasternode *CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn> &vecToExclude
     LogPrintf("CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH(CMasternode &mn, vMasternodes) {
+    BOOST_FOREACH(CMasternode &mn, listMasternodes) {
         if(mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH(CTxIn &usedVin, vecToExclude) {
@@ -535,7 +862,7 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     CMasternode* winner = NULL;
 
     // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH(CMasternode& mn, listMasternodes) {
         mn.Check();
         if(mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
 
@@ -553,16 +880,36 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     return winner;
 }
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+const CMasternodeRanking* CMasternodeMan::GetRanking(int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
     //make sure we know about this block
     uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return -1;
+    if(!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    int64_t nNow = GetTime();
+
+    // drop rankings that may no longer reflect the enabled set
+    std::map<std::pair<int64_t, std::pair<int, bool> >, CMasternodeRanking>::iterator it = mapRankings.begin();
+    while(it != mapRankings.end()){
+        if(nNow - (*it).second.nTimeCreated >= MASTERNODE_CHECK_SECONDS) {
+            mapRankings.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    // sampled before ranking, a status change found by the checks below only causes another ranking
+    int64_t nListChangesNow = GetListChanges();
+
+    CMasternodeRanking& ranking = mapRankings[make_pair(nBlockHeight, make_pair(minProtocol, fOnlyActive))];
+    if(ranking.nTimeCreated > 0 && ranking.hashBlock == hash && ranking.nListChanges == nListChangesNow) return &ranking;
+
+    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
 
     // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH(CMasternode& mn, listMasternodes) {
         if(mn.protocolVersion < minProtocol) continue;
         if(fOnlyActive) {
             mn.Check();
@@ -576,48 +923,46 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
     sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
 
-    int rank = 0;
+    ranking.hashBlock = hash;
+    ranking.nTimeCreated = nNow;
+    ranking.nListChanges = nListChangesNow;
+    ranking.vecRanked.clear();
+    ranking.mapRanks.clear();
     BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn)& s, vecMasternodeScores){
-        rank++;
-        if(s.second.prevout == vin.prevout) {
-            return rank;
-        }
+        ranking.vecRanked.push_back(s.second);
+        ranking.mapRanks.insert(make_pair(s.second.prevout, (int)ranking.vecRanked.size()));
     }
 
-    return -1;
+    return &ranking;
 }
 
-std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
-    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+    LOCK(cs);
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    const CMasternodeRanking* pranking = GetRanking(nBlockHeight, minProtocol, fOnlyActive);
+    if(!pranking) return -1;
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    boost::unordered_map<COutPoint, int, MasternodeOutPointHasher>::const_iterator it = pranking->mapRanks.find(vin.prevout);
+    if(it == pranking->mapRanks.end()) return -1;
 
-        mn.Check();
-
-        if(mn.protocolVersion < minProtocol) continue;
-        if(!mn.IsEnabled()) {
-            continue;
-        }
+    return it->second;
+}
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+{
+    LOCK(cs);
 
-        vecMasternodeScores.push_back(make_pair(n2, mn));
-    }
+    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
+    const CMasternodeRanking* pranking = GetRanking(nBlockHeight, minProtocol, true);
+    if(!pranking) return vecMasternodeRanks;
 
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode)& s, vecMasternodeScores){
+    BOOST_FOREACH (const CTxIn& vin, pranking->vecRanked){
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        CMasternode* pmn = Find(vin);
+        if(pmn) vecMasternodeRanks.push_back(make_pair(rank, *pmn));
     }
 
     return vecMasternodeRanks;
@@ -625,34 +970,12 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
-
-        if(mn.protocolVersion < minProtocol) continue;
-        if(fOnlyActive) {
-            mn.Check();
-            if(!mn.IsEnabled()) continue;
-        }
-
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    LOCK(cs);
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn)& s, vecMasternodeScores){
-        rank++;
-        if(rank == nRank) {
-            return Find(s.second);
-        }
-    }
+    const CMasternodeRanking* pranking = GetRanking(nBlockHeight, minProtocol, fOnlyActive);
+    if(!pranking || nRank < 1 || nRank > (int)pranking->vecRanked.size()) return NULL;
 
-    return NULL;
+    return Find(pranking->vecRanked[nRank - 1]);
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -686,7 +1009,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             masternodeSync.AddedMasternodeList(mnb.GetHash());
             return;
         }
-        mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
+        AddSeenBroadcast(mnb);
 
         int nDoS = 0;
         if(!mnb.CheckAndUpdate(nDoS)){
@@ -709,6 +1032,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         // make sure it's still unspent
         //  - this is checked later by .check() in many places and by ThreadCheckDarkSendPool()
         if(mnb.CheckInputsAndAdd(nDoS)) {
+            mncacheJournal.Append("mnb", mnb);
             // use this as a peer
             addrman.Add(CAddress(mnb.addr), pfrom->addr, 2*60*60);
             masternodeSync.AddedMasternodeList(mnb.GetHash());
@@ -727,10 +1051,13 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         LogPrint("masternode", "mnp - Masternode ping, vin: %s\n", mnp.vin.ToString());
 
         if(mapSeenMasternodePing.count(mnp.GetHash())) return; //seen
-        mapSeenMasternodePing.insert(make_pair(mnp.GetHash(), mnp));
+        AddSeenPing(mnp);
 
         int nDoS = 0;
-        if(mnp.CheckAndUpdate(nDoS)) return;
+        if(mnp.CheckAndUpdate(nDoS)) {
+            mncacheJournal.Append("mnp", mnp);
+            return;
+        }
 
         if(nDoS > 0) {
             // if anything significant failed, mark that node
@@ -752,28 +1079,13 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         vRecv >> vin;
 
         if(vin == CTxIn()) { //only should ask for this once
-            //local network
-            bool isLocal = (pfrom->addr.IsRFC1918() || pfrom->addr.IsLocal());
-
-            if(!isLocal && Params().NetworkID() == CBaseChainParams::MAIN) {
-                std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
-                if (i != mAskedUsForMasternodeList.end()){
-                    int64_t t = (*i).second;
-                    if (GetTime() < t) {
-                        Misbehaving(pfrom->GetId(), 34);
-                        LogPrintf("dseg - peer already asked me for the list\n");
-                        return;
-                    }
-                }
-                int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
-                mAskedUsForMasternodeList[pfrom->addr] = askAgain;
-            }
+            if(!CheckListRequest(pfrom)) return;
         } //else, asking for a specific node which is ok
 
 
         int nInvCount = 0;
 
-        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH(CMasternode& mn, listMasternodes) {
             if(mn.addr.IsRFC1918()) continue; //local network
 
             if(mn.IsEnabled()) {
@@ -784,7 +1096,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                     pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
                     nInvCount++;
 
-                    if(!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+                    AddSeenBroadcast(mnb);
 
                     if(vin == mn.vin) {
                         LogPrintf("dseg - Sent 1 Masternode entries to %s\n", pfrom->addr.ToString());
@@ -799,6 +1111,49 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             LogPrintf("dseg - Sent %d Masternode entries to %s\n", nInvCount, pfrom->addr.ToString());
         }
     }
+
+    else if (strCommand == "dsegd") { //Get Masternode list entries changed since a digest
+
+        int nDigestVersion;
+        std::vector<uint256> vBucketHashes;
+        int64_t nPingsSince;
+        vRecv >> nDigestVersion >> vBucketHashes >> nPingsSince;
+
+        if(!CheckListRequest(pfrom)) return;
+
+        // a digest we can't compare against gets the full list
+        bool fFull = nDigestVersion != MASTERNODES_DIGEST_VERSION || vBucketHashes.size() != MASTERNODES_DIGEST_BUCKETS;
+        std::vector<uint256> vOurBucketHashes;
+        if(!fFull) GetListDigest(vOurBucketHashes);
+
+        int nInvCount = 0;
+        int nPingCount = 0;
+
+        {
+            // CheckAndRemove and the cache flush touch the list concurrently
+            LOCK(cs);
+            BOOST_FOREACH(CMasternode& mn, listMasternodes) {
+                if(mn.addr.IsRFC1918() || !mn.IsEnabled()) continue;
+
+                unsigned int nBucket = GetListDigestBucket(mn.vin.prevout);
+                if(fFull || vBucketHashes[nBucket] != vOurBucketHashes[nBucket]) {
+                    CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
+                    pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, mnb.GetHash()));
+                    AddSeenBroadcast(mnb);
+                    nInvCount++;
+                } else if(mn.lastPing.sigTime > nPingsSince) {
+                    // the peer has this entry, it might only be missing the latest ping
+                    // (including one that re-enables an entry it considers expired)
+                    AddSeenPing(mn.lastPing);
+                    pfrom->PushInventory(CInv(MSG_MASTERNODE_PING, mn.lastPing.GetHash()));
+                    nPingCount++;
+                }
+            }
+        }
+
+        pfrom->PushMessage("ssc", MASTERNODE_SYNC_LIST, nInvCount);
+        LogPrintf("dsegd - Sent %d Masternode entries and %d pings to %s%s\n", nInvCount, nPingCount, pfrom->addr.ToString(), fFull ? " (full)" : "");
+    }
     /*
      * IT'S SAFE TO REMOVE THIS IN FURTHER VERSIONS
      * AFTER MIGRATION TO V12 IS DONE
@@ -891,9 +1246,12 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                 if(pmn->nLastDsee < sigTime){ //take the newest entry
                     LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
                     if(pmn->protocolVersion < GETHEADERS_VERSION) {
+                        CPubKey pubKeyOld = pmn->pubkey2;
                         pmn->pubkey2 = pubkey2;
+                        UpdatePubKeyIndex(pmn, pubKeyOld);
                         pmn->sigTime = sigTime;
                         pmn->sig = vchSig;
+                        if(pmn->protocolVersion != protocolVersion) MarkListChanged();
                         pmn->protocolVersion = protocolVersion;
                         pmn->addr = addr;
                         //fake ping
@@ -1093,14 +1451,10 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while(it != vMasternodes.end()){
-        if((*it).vin == vin){
-            LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).addr.ToString(), size() - 1);
-            vMasternodes.erase(it);
-            break;
-        }
-        ++it;
+    boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, MasternodeOutPointHasher>::iterator mi = mapMasternodesByOutPoint.find(vin.prevout);
+    if(mi != mapMasternodesByOutPoint.end() && (*mi->second).vin == vin){
+        LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*mi->second).addr.ToString(), size() - 1);
+        Erase(mi->second);
     }
 }
 
@@ -1108,7 +1462,7 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() <<
+    info << "Masternodes: " << (int)listMasternodes.size() <<
             ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() <<
             ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() <<
             ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() <<
@@ -12,15 +12,27 @@
 #include "base58.h"
 #include "main.h"
 #include "masternode.h"
+#include "cachejournal.h"
+
+#include <list>
+
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
 
 #define MASTERNODES_DUMP_SECONDS               (15*60)
 #define MASTERNODES_DSEG_SECONDS               (3*60*60)
+#define MASTERNODES_SEEN_MNB_MAX               50000
+#define MASTERNODES_SEEN_MNP_MAX               250000
+#define MASTERNODES_ASKED_ENTRIES_MAX          50000
+#define MASTERNODES_DIGEST_VERSION             1
+#define MASTERNODES_DIGEST_BUCKETS             64
 
 using namespace std;
 
 class CMasternodeMan;
 
 extern CMasternodeMan mnodeman;
+extern CCacheJournal mncacheJournal;
 void DumpMasternodes();
 
 /** Access to the MN database (mncache.dat)
@@ -46,8 +58,46 @@ public:
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
 };
 
-class CMasternodeMan
+struct MasternodeOutPointHasher
+{
+    size_t operator()(const COutPoint& out) const { return out.hash.GetLow64() ^ out.n; }
+};
+
+struct MasternodeScriptHasher
+{
+    size_t operator()(const CScript& script) const { return boost::hash_range(script.begin(), script.end()); }
+};
+
+struct MasternodePubKeyHasher
+{
+    size_t operator()(const CPubKey& pubkey) const { return boost::hash_range(pubkey.begin(), pubkey.end()); }
+};
+
+/** Masternodes sorted by score for one block height, shared by all rank lookups at that height */
+class CMasternodeRanking
+{
+public:
+    uint256 hashBlock;
+    int64_t nTimeCreated;
+    // CMasternodeMan::GetListChanges before ranking
+    int64_t nListChanges;
+    // the masternode ranked n is at position n-1
+    std::vector<CTxIn> vecRanked;
+    boost::unordered_map<COutPoint, int, MasternodeOutPointHasher> mapRanks;
+
+    CMasternodeRanking() : nTimeCreated(0), nListChanges(0) {}
+};
+
+class CMasternodeMan : public CValidationInterface
 {
+public:
+    /// What transaction notifications told us about a masternode's collateral
+    enum CollateralState {
+        COLLATERAL_UNKNOWN,
+        COLLATERAL_UNSPENT,
+        COLLATERAL_SPENT
+    };
+
 private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
@@ -55,14 +105,58 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // list to hold all MNs, entries keep their address until they are removed
+    std::list<CMasternode> listMasternodes;
+    // indexes into listMasternodes by collateral outpoint, payee script and masternode pubkey
+    boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, MasternodeOutPointHasher> mapMasternodesByOutPoint;
+    boost::unordered_multimap<CScript, CMasternode*, MasternodeScriptHasher> mapMasternodesByPayee;
+    boost::unordered_multimap<CPubKey, CMasternode*, MasternodePubKeyHasher> mapMasternodesByPubKey;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // the above by the time we may ask again, entries no longer matching the map are dropped when they come up
+    std::set<std::pair<int64_t, COutPoint> > setWeAskedForEntryExpiry;
+
+    // rankings by block height, min protocol and fOnlyActive, rebuilt after MASTERNODE_CHECK_SECONDS
+    // or once the list changed
+    std::map<std::pair<int64_t, std::pair<int, bool> >, CMasternodeRanking> mapRankings;
+    // bumped whenever an entry is added, removed or changes its active state, see GetListChanges.
+    // Own lock, as CMasternode::Check bumps it with or without cs held.
+    mutable CCriticalSection cs_listChanges;
+    int64_t nListChanges;
+
+    const CMasternodeRanking* GetRanking(int64_t nBlockHeight, int minProtocol, bool fOnlyActive);
+
+    /// Rate limit full and digest list requests from the same peer, false if it asked too recently
+    bool CheckListRequest(CNode* pfrom);
+
+    // collateral outpoints of listed masternodes, marked spent by connected blocks in SyncTransaction
+    CCriticalSection cs_collaterals;
+    std::map<COutPoint, CollateralState> mapCollaterals;
+
+    // seen hashes by the time they were last known to expire at, entries are re-checked when they come up
+    std::set<std::pair<int64_t, uint256> > setSeenBroadcastExpiry;
+    std::set<std::pair<int64_t, uint256> > setSeenPingExpiry;
+    // seen broadcast hashes by collateral outpoint
+    std::map<COutPoint, std::set<uint256> > mapSeenBroadcastsByOutPoint;
+
+    void RebuildSeenIndexes();
+    void ExpireSeenBroadcasts(int64_t nCutoff, size_t nMaxSize);
+    void ExpireSeenPings(int64_t nCutoff, size_t nMaxSize);
+    void ExpireAskedForEntries(int64_t nCutoff, size_t nMaxSize);
+    void EraseSeenBroadcasts(const COutPoint& outpoint);
+
+    void AddToIndexes(std::list<CMasternode>::iterator it);
+    void RemoveFromIndexes(CMasternode* pmn);
+    void RebuildIndexes();
+    std::list<CMasternode>::iterator Erase(std::list<CMasternode>::iterator it);
+
+protected:
+    // CValidationInterface
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
 
 public:
     // Keep track of all broadcasts I've seen
@@ -78,7 +172,15 @@ public:
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
         LOCK(cs);
+        // written as a vector to keep the mncache.dat format
+        std::vector<CMasternode> vMasternodes;
+        if (!ser_action.ForRead())
+            vMasternodes.assign(listMasternodes.begin(), listMasternodes.end());
         READWRITE(vMasternodes);
+        if (ser_action.ForRead()) {
+            listMasternodes.assign(vMasternodes.begin(), vMasternodes.end());
+            RebuildIndexes();
+        }
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
@@ -86,6 +188,8 @@ public:
 
         READWRITE(mapSeenMasternodeBroadcast);
         READWRITE(mapSeenMasternodePing);
+        if (ser_action.ForRead())
+            RebuildSeenIndexes();
     }
 
     CMasternodeMan();
@@ -110,6 +214,13 @@ public:
 
     void DsegUpdate(CNode* pnode);
 
+    /// Count of entries added to, removed from or enabled/disabled in the list so far, rankings cached elsewhere are stale once it changes
+    int64_t GetListChanges() const;
+    void MarkListChanged();
+
+    /// Hash (outpoint, sigTime) of all listed entries, enabled or not, split into MASTERNODES_DIGEST_BUCKETS by outpoint
+    void GetListDigest(std::vector<uint256>& vBucketHashes);
+
     /// Find an entry
     CMasternode* Find(const CScript &payee);
     CMasternode* Find(const CTxIn& vin);
@@ -124,7 +235,7 @@ public:
     /// Get the current winner for this block
     CMasternode* GetCurrentMasterNode(int mod=1, int64_t nBlockHeight=0, int minProtocol=0);
 
-    std::vector<CMasternode> GetFullMasternodeVector() { Check(); return vMasternodes; }
+    std::vector<CMasternode> GetFullMasternodeVector() { Check(); LOCK(cs); return std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end()); }
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol=0);
     int GetMasternodeRank(const CTxIn &vin, int64_t nBlockHeight, int minProtocol=0, bool fOnlyActive=true);
@@ -135,12 +246,28 @@ public:
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return listMasternodes.size(); }
 
     std::string ToString() const;
 
     void Remove(CTxIn vin);
 
+    /// Keep track of seen broadcasts and pings, use these instead of inserting into the maps directly
+    void AddSeenBroadcast(CMasternodeBroadcast& mnb);
+    void EraseSeenBroadcast(const uint256& hash);
+    void AddSeenPing(CMasternodePing& mnp);
+
+    /// Apply an mnb/mnp record from mncache.journal, it was validated before it was journaled
+    void ReplayJournalRecord(const std::string& strType, CDataStream& ssRecord);
+
+    /// Update the pubkey index after pmn->pubkey2 was changed from pubKeyOld
+    void UpdatePubKeyIndex(CMasternode* pmn, const CPubKey& pubKeyOld);
+
+    /// Collateral state of a listed masternode, COLLATERAL_UNKNOWN until verified once
+    CollateralState GetCollateralState(const COutPoint& outpoint);
+    /// Record that the collateral was found unspent, call with cs_main held
+    void SetCollateralUnspent(const COutPoint& outpoint);
+
 };
 
 #endif
@@ -369,6 +369,139 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Block template builder
+//
+// Keeps a template on top of the current tip ready so that getblocktemplate
+// does not have to run CreateNewBlock (and with it TestBlockValidity and
+// FillBlockPayee) on the RPC thread. A new template is built as soon as the
+// tip changes, and at most every BLOCK_TEMPLATE_REBUILD_INTERVAL seconds
+// while the mempool keeps changing.
+//
+
+static CWaitableCriticalSection csBlockTemplate;
+static CConditionVariable cvBlockTemplate;
+static boost::shared_ptr<const CBlockTemplate> pblocktemplatePrebuilt;
+static unsigned int nPrebuiltTransactionsUpdated = 0;
+static int64_t nPrebuiltTime = 0;
+static bool fBlockTemplateBuilderActive = false; // protected by csBlockTemplate
+
+static boost::shared_ptr<const CBlockTemplate> BuildBlockTemplate(unsigned int& nTransactionsUpdatedRet)
+{
+    boost::shared_ptr<const CBlockTemplate> pblocktemplate;
+
+    // Read the counter first: a change racing with CreateNewBlock only makes
+    // the template look stale and causes one extra rebuild.
+    nTransactionsUpdatedRet = mempool.GetTransactionsUpdated();
+    CScript scriptDummy = CScript() << OP_TRUE;
+    try {
+        pblocktemplate.reset(CreateNewBlock(scriptDummy));
+    } catch (const std::runtime_error& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+        return pblocktemplate;
+    }
+    if (!pblocktemplate)
+        return pblocktemplate;
+
+    {
+        // The tip may have moved on while the block was being assembled; never
+        // replace a template for the new tip with one for its parent.
+        LOCK(cs_main);
+        if (pblocktemplate->block.hashPrevBlock != chainActive.Tip()->GetBlockHash())
+            return pblocktemplate;
+        boost::unique_lock<boost::mutex> lock(csBlockTemplate);
+        pblocktemplatePrebuilt = pblocktemplate;
+        nPrebuiltTransactionsUpdated = nTransactionsUpdatedRet;
+        nPrebuiltTime = GetTime();
+    }
+    cvBlockTemplate.notify_all();
+    return pblocktemplate;
+}
+
+void static ThreadBlockTemplateBuilder()
+{
+    RenameThread("dash-gbt");
+
+    try {
+        while (true) {
+            {
+                // Woken up by UpdateTip as soon as the tip changes
+                boost::unique_lock<boost::mutex> lock(csBestBlock);
+                cvBlockChange.timed_wait(lock, boost::posix_time::milliseconds(500));
+            }
+            boost::this_thread::interruption_point();
+
+            {
+                boost::unique_lock<boost::mutex> lock(csBlockTemplate);
+                if (!fBlockTemplateBuilderActive)
+                    continue;
+            }
+            if (IsInitialBlockDownload())
+                continue;
+
+            uint256 hashTip;
+            {
+                LOCK(cs_main);
+                hashTip = chainActive.Tip()->GetBlockHash();
+            }
+
+            bool fRebuild;
+            {
+                boost::unique_lock<boost::mutex> lock(csBlockTemplate);
+                fRebuild = !pblocktemplatePrebuilt ||
+                           pblocktemplatePrebuilt->block.hashPrevBlock != hashTip ||
+                           (nPrebuiltTransactionsUpdated != mempool.GetTransactionsUpdated() &&
+                            GetTime() - nPrebuiltTime >= BLOCK_TEMPLATE_REBUILD_INTERVAL);
+            }
+            if (fRebuild) {
+                unsigned int nTransactionsUpdated;
+                BuildBlockTemplate(nTransactionsUpdated);
+            }
+        }
+    }
+    catch (boost::thread_interrupted)
+    {
+        // Release longpoll waiters
+        cvBlockTemplate.notify_all();
+        throw;
+    }
+}
+
+void StartBlockTemplateBuilder(boost::thread_group& threadGroup)
+{
+    threadGroup.create_thread(&ThreadBlockTemplateBuilder);
+}
+
+boost::shared_ptr<const CBlockTemplate> GetBlockTemplate(unsigned int& nTransactionsUpdatedRet)
+{
+    AssertLockHeld(cs_main);
+
+    {
+        boost::unique_lock<boost::mutex> lock(csBlockTemplate);
+        fBlockTemplateBuilderActive = true;
+        if (pblocktemplatePrebuilt && pblocktemplatePrebuilt->block.hashPrevBlock == chainActive.Tip()->GetBlockHash()) {
+            nTransactionsUpdatedRet = nPrebuiltTransactionsUpdated;
+            return pblocktemplatePrebuilt;
+        }
+    }
+
+    // The builder has not caught up with the tip yet
+    return BuildBlockTemplate(nTransactionsUpdatedRet);
+}
+
+bool WaitForBlockTemplateChange(const uint256& hashPrevBlock, const boost::system_time& deadline)
+{
+    boost::unique_lock<boost::mutex> lock(csBlockTemplate);
+    // until the builder published a first template there is nothing to change to
+    while (!pblocktemplatePrebuilt || pblocktemplatePrebuilt->block.hashPrevBlock == hashPrevBlock)
+    {
+        if (!cvBlockTemplate.timed_wait(lock, deadline))
+            return false;
+    }
+    return true;
+}
+
 #ifdef ENABLE_WALLET
 //////////////////////////////////////////////////////////////////////////////
 //
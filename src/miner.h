@@ -8,15 +8,26 @@
 
 #include <stdint.h>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread_time.hpp>
+
 class CBlock;
 class CBlockHeader;
 class CBlockIndex;
 class CReserveKey;
 class CScript;
 class CWallet;
+class uint256;
+
+namespace boost {
+    class thread_group;
+} // namespace boost
 
 struct CBlockTemplate;
 
+/** Minimum number of seconds between background template rebuilds for mempool changes */
+static const int64_t BLOCK_TEMPLATE_REBUILD_INTERVAL = 2;
+
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads);
 /** Generate a new block, without valid proof-of-work */
@@ -27,6 +38,20 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
 /** Check mined block */
 void UpdateTime(CBlockHeader* block, const CBlockIndex* pindexPrev);
 
+/** Start the thread that keeps a block template ready for getblocktemplate */
+void StartBlockTemplateBuilder(boost::thread_group& threadGroup);
+/**
+ * Return a block template on top of the current tip. The prebuilt template is
+ * returned if it is current, otherwise one is built synchronously. The first
+ * call activates the background builder. Caller must hold cs_main.
+ */
+boost::shared_ptr<const CBlockTemplate> GetBlockTemplate(unsigned int& nTransactionsUpdatedRet);
+/**
+ * Wait until a template on top of a block other than hashPrevBlock has been
+ * published, or until the deadline passes. Returns false on timeout.
+ */
+bool WaitForBlockTemplateChange(const uint256& hashPrevBlock, const boost::system_time& deadline);
+
 extern double dHashesPerSec;
 extern int64_t nHPSTimerStart;
 
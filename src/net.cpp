@@ -24,6 +24,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -37,6 +41,15 @@
 // Dump addresses to peers.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
 
+// Time the socket handler waits for events before checking timeouts and disconnects
+#define SOCKET_HANDLER_TIMEOUT_MS 50
+
+// Maximum number of readiness events fetched by one epoll_wait call
+#define MAX_EPOLL_EVENTS 256
+
+// Time the epoll handler backs off when pending work was blocked by a busy node lock
+#define SOCKET_HANDLER_CONTENDED_MS 1
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -81,6 +94,11 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+#ifdef HAVE_SYS_EPOLL_H
+int nSocketEventsMode = SOCKETEVENTS_EPOLL;
+#else
+int nSocketEventsMode = SOCKETEVENTS_SELECT;
+#endif
 bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
@@ -88,6 +106,8 @@ CCriticalSection cs_vNodes;
 map<CInv, CDataStream> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
+static map<CInv, map<int, CSerializedMessageRef> > mapRelayMessages; // messages by the send version they were serialized for
+static deque<pair<int64_t, CInv> > vRelayMessagesExpiration;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
@@ -418,7 +438,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool darkSendMaste
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -671,10 +691,10 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializedMessageRef>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
@@ -714,80 +734,390 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
+{
+    //
+    // Disconnect nodes
+    //
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+            {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
+            }
+        }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
+            {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
+                    {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
+                        {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
+                        }
+                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+static void AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    }
+    else if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket))
+    {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr) && !whitelisted)
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else
+    {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+}
+
+// Implement the following logic:
+// * If there is data to send, wait for the socket to become writable. As this only
+//   happens when optimistic write failed, we choose to first drain the
+//   write buffer in this case before receiving more. This avoids
+//   needlessly queueing received data, if the remote peer is not themselves
+//   receiving data. This means properly utilizing TCP flow control signalling.
+// * Otherwise, if there is no (complete) message in the receive buffer,
+//   or there is space left in the buffer, wait for data to receive.
+// * (if neither of the above applies, there is certainly one message
+//   in the receiver buffer ready to be processed).
+// Together, that means that at least one of the following is always possible,
+// so we don't deadlock:
+// * We send some data.
+// * We wait for data to be received (and disconnect after timeout).
+// * We process a message in the buffer (message handler thread).
+static bool NodeWantsSend(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    return lockSend && !pnode->vSendMsg.empty();
+}
+
+static bool NodeWantsRecv(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    return lockRecv && (
+        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+        pnode->GetTotalRecvSize() <= ReceiveFloodSize());
+}
+
+/** Read available data from a peer's socket. Returns false once the socket has been drained. */
+static bool SocketRecvData(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return true;
+
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return true;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+        else if (nErr != WSAEWOULDBLOCK)
+            return true;
+    }
+    return false;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int hEpoll = -1;
+
+/**
+ * Socket handler for the epoll backend. Peer sockets are registered once,
+ * edge-triggered, and the readiness reported by the kernel is remembered in
+ * the CNode until a send or receive hits EWOULDBLOCK. Waiting therefore only
+ * costs time proportional to the number of sockets that actually changed
+ * state, and data queued by PushMessage is picked up on the next EPOLLOUT
+ * edge instead of being polled for.
+ */
+static void ThreadSocketHandlerEpoll()
 {
     unsigned int nPrevNodeCount = 0;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    bool fLockContended = false;
     while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        DisconnectNodes(nPrevNodeCount);
+
+        vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
+            vNodesCopy = vNodes;
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+
+        //
+        // Register new sockets, and only block if there is nothing to do right away
+        //
+        bool fPendingWork = false;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (!pnode->fSocketRegistered)
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                event.data.ptr = pnode;
+                if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0)
                 {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(WSAGetLastError()));
+                    pnode->CloseSocketDisconnect();
+                    continue;
+                }
+                pnode->fSocketRegistered = true;
+            }
+            if (NodeWantsSend(pnode) ? pnode->fSocketWritable : (pnode->fSocketReadable && NodeWantsRecv(pnode)))
+                fPendingWork = true;
+        }
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+        // Pending work that could not be done last time because a message
+        // handler held the node's buffers must not turn into a busy loop
+        int nTimeout = SOCKET_HANDLER_TIMEOUT_MS;
+        if (fPendingWork)
+            nTimeout = fLockContended ? SOCKET_HANDLER_CONTENDED_MS : 0;
+        int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, nTimeout);
+        boost::this_thread::interruption_point();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+        if (nEvents < 0)
+        {
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEINTR)
+            {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+                MilliSleep(SOCKET_HANDLER_TIMEOUT_MS);
+            }
+            nEvents = 0;
+        }
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+        // Events can only refer to nodes in vNodesCopy: sockets are closed
+        // before their node leaves vNodes, which removes them from the set.
+        bool fListenReady = false;
+        for (int i = 0; i < nEvents; i++)
+        {
+            CNode* pnode = (CNode*)events[i].data.ptr;
+            if (pnode == NULL) {
+                fListenReady = true;
+                continue;
             }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                pnode->fSocketReadable = true;
+            if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+                pnode->fSocketWritable = true;
+        }
+
+        //
+        // Accept new connections
+        //
+        if (fListenReady)
+        {
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+                if (hListenSocket.socket != INVALID_SOCKET)
+                    AcceptConnection(hListenSocket);
         }
+
+        //
+        // Service each socket
+        //
+        fLockContended = false;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            boost::this_thread::interruption_point();
+
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (NodeWantsSend(pnode))
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                if (pnode->fSocketWritable)
                 {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
-                        {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
-                        }
-                    }
-                    if (fDelete)
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        SocketSendData(pnode);
+                        // The socket buffer is full, wait for the next EPOLLOUT edge
+                        if (!pnode->vSendMsg.empty())
+                            pnode->fSocketWritable = false;
                     }
+                    else
+                        fLockContended = true;
                 }
             }
+            else if (pnode->fSocketReadable && NodeWantsRecv(pnode))
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv)
+                    pnode->fSocketReadable = SocketRecvData(pnode);
+                else
+                    fLockContended = true;
+            }
+
+            InactivityCheck(pnode);
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
         }
+    }
+}
+#endif // HAVE_SYS_EPOLL_H
+
+void ThreadSocketHandler()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL)
+    {
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
         //
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = SOCKET_HANDLER_TIMEOUT_MS * 1000; // frequency to poll pnode->vSend
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -814,35 +1144,13 @@ void ThreadSocketHandler()
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 have_fds = true;
 
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+                // See NodeWantsSend() for the logic
+                if (NodeWantsSend(pnode)) {
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                    continue;
                 }
+                if (NodeWantsRecv(pnode))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
             }
         }
 
@@ -870,58 +1178,7 @@ void ThreadSocketHandler()
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
             if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET)
-                {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                }
-                else if (!IsSelectableSocket(hSocket))
-                {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-                {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else if (CNode::IsBanned(addr) && !whitelisted)
-                {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else
-                {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+                AcceptConnection(hListenSocket);
         }
 
         //
@@ -944,43 +1201,7 @@ void ThreadSocketHandler()
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+                SocketRecvData(pnode);
 
             //
             // Send
@@ -997,30 +1218,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1654,6 +1852,35 @@ void static Discover(boost::thread_group& threadGroup)
 #endif
 }
 
+bool SetSocketEventsMode(const std::string& strMode)
+{
+    if (strMode == "select") {
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (strMode == "epoll") {
+        nSocketEventsMode = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+void SetupSocketEvents()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL && hEpoll == -1) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1) {
+            LogPrintf("Failed to create epoll instance (%s), falling back to select\n", NetworkErrorString(WSAGetLastError()));
+            nSocketEventsMode = SOCKETEVENTS_SELECT;
+        }
+    }
+#endif
+    LogPrintf("Using %s for socket events\n", nSocketEventsMode == SOCKETEVENTS_EPOLL ? "epoll" : "select");
+}
+
 void StartNode(boost::thread_group& threadGroup)
 {
     uiInterface.InitMessage(_("Loading addresses..."));
@@ -1691,6 +1918,21 @@ void StartNode(boost::thread_group& threadGroup)
     // Map ports with UPnP
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
+#ifdef HAVE_SYS_EPOLL_H
+    // the backend was set up by SetupSocketEvents before the connection limit was computed
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL) {
+        assert(hEpoll != -1);
+        // Listening sockets stay level-triggered, a NULL pointer identifies them
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+                LogPrintf("epoll_ctl failed for listening socket: %s\n", NetworkErrorString(WSAGetLastError()));
+        }
+    }
+#endif
+
     // Send and receive from sockets, accept connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
@@ -1740,6 +1982,12 @@ public:
             if (hListenSocket.socket != INVALID_SOCKET)
                 if (!CloseSocket(hListenSocket.socket))
                     LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll != -1) {
+            close(hEpoll);
+            hEpoll = -1;
+        }
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -1811,7 +2059,7 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
 
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
 {
-    CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
+    CSharedMessage<CTransaction> msg("ix", tx);
 
     //broadcast the new lock
     LOCK(cs_vNodes);
@@ -1820,7 +2068,7 @@ void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
         if(!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("ix", tx);
+        pnode->PushSharedMessage(msg);
     }
 }
 
@@ -1831,6 +2079,61 @@ void RelayInv(CInv &inv, const int minProtoVersion) {
             pnode->PushInventory(inv);
 }
 
+/** The messages kept for inv, created with a new expiration time if there are none */
+static map<int, CSerializedMessageRef>& GetRelayMessages(const CInv& inv)
+{
+    AssertLockHeld(cs_mapRelay);
+
+    // Expire old relay messages
+    while (!vRelayMessagesExpiration.empty() && vRelayMessagesExpiration.front().first < GetTime())
+    {
+        mapRelayMessages.erase(vRelayMessagesExpiration.front().second);
+        vRelayMessagesExpiration.pop_front();
+    }
+
+    pair<map<CInv, map<int, CSerializedMessageRef> >::iterator, bool> ret =
+        mapRelayMessages.insert(std::make_pair(inv, map<int, CSerializedMessageRef>()));
+    if (ret.second)
+        vRelayMessagesExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+    return ret.first->second;
+}
+
+void RelayInv(CInv &inv, const CSerializedMessageRef& msg, const int minProtoVersion) {
+    {
+        LOCK(cs_mapRelay);
+        // Relaying an object again refreshes the message, its hash may not cover every field
+        map<int, CSerializedMessageRef>& mapMessages = GetRelayMessages(inv);
+        mapMessages.clear();
+        mapMessages[PROTOCOL_VERSION] = msg;
+    }
+    RelayInv(inv, minProtoVersion);
+}
+
+bool FindRelayMessage(const CInv& inv, int nVersion, CSerializedMessageRef& msgRet)
+{
+    LOCK(cs_mapRelay);
+    map<CInv, map<int, CSerializedMessageRef> >::iterator mi = mapRelayMessages.find(inv);
+    if (mi == mapRelayMessages.end())
+        return false;
+    map<int, CSerializedMessageRef>::iterator it = mi->second.find(nVersion);
+    if (it == mi->second.end())
+        return false;
+    msgRet = it->second;
+    return true;
+}
+
+void AddRelayMessage(const CInv& inv, int nVersion, const CSerializedMessageRef& msg)
+{
+    LOCK(cs_mapRelay);
+    GetRelayMessages(inv)[nVersion] = msg;
+}
+
+void EraseRelayMessage(const CInv& inv)
+{
+    LOCK(cs_mapRelay);
+    mapRelayMessages.erase(inv);
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
@@ -2011,6 +2314,9 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fSocketRegistered = false;
+    fSocketReadable = false;
+    fSocketWritable = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -2083,6 +2389,46 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+/** Write the payload size and checksum into the CMessageHeader at the start of ssMsg */
+static void SetMessageSizeAndChecksum(CDataStream& ssMsg)
+{
+    // Set the size
+    unsigned int nSize = ssMsg.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ssMsg[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ssMsg.begin() + CMessageHeader::HEADER_SIZE, ssMsg.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ssMsg.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ssMsg[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+CSerializedMessageRef FinalizeSerializedMessage(CDataStream& ssMsg)
+{
+    SetMessageSizeAndChecksum(ssMsg);
+    boost::shared_ptr<CSerializeData> msg(new CSerializeData());
+    ssMsg.GetAndClear(*msg);
+    return msg;
+}
+
+void CNode::PushSerializedMessage(const CSerializedMessageRef& msg)
+{
+    assert(msg->size() >= CMessageHeader::HEADER_SIZE);
+    LOCK(cs_vSend);
+
+    std::string strCommand(&(*msg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE);
+    strCommand.erase(std::find(strCommand.begin(), strCommand.end(), '\0'), strCommand.end());
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n", SanitizeString(strCommand), msg->size() - CMessageHeader::HEADER_SIZE, id);
+
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
@@ -2117,25 +2463,17 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
     if (ssSend.size() == 0)
         return;
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    SetMessageSizeAndChecksum(ssSend);
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    LogPrint("net", "(%d bytes) peer=%d\n", ssSend.size() - CMessageHeader::HEADER_SIZE, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    boost::shared_ptr<CSerializeData> msg(new CSerializeData());
+    ssSend.GetAndClear(*msg);
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
@@ -28,6 +28,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -73,6 +74,10 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
+/** Select the socket events backend by name. Returns false if it is unknown or unavailable. */
+bool SetSocketEventsMode(const std::string& strMode);
+/** Set up the selected backend, falling back to select if it cannot be used */
+void SetupSocketEvents();
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
@@ -127,11 +132,62 @@ extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
 
+/** Backends ThreadSocketHandler can use to wait for socket events */
+enum SocketEventsMode
+{
+    SOCKETEVENTS_SELECT = 0,
+    SOCKETEVENTS_EPOLL = 1,
+};
+extern int nSocketEventsMode;
+
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
 extern std::map<CInv, CDataStream> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
+
+/**
+ * A complete wire message (header and payload) that is never modified once built,
+ * so the same buffer can sit in the send queues of many peers at once.
+ */
+typedef boost::shared_ptr<const CSerializeData> CSerializedMessageRef;
+
+/** Fill in the size and checksum of a message stream starting with a CMessageHeader and take its contents */
+CSerializedMessageRef FinalizeSerializedMessage(CDataStream& ssMsg);
+
+/**
+ * Serialize a message once so it can be queued with CNode::PushSerializedMessage on any number
+ * of peers whose send version is nVersion
+ */
+template<typename T>
+CSerializedMessageRef MakeSerializedMessage(const char* pszCommand, const T& obj, int nVersion = PROTOCOL_VERSION)
+{
+    CDataStream ssMsg(SER_NETWORK, nVersion);
+    ssMsg.reserve(1000);
+    ssMsg << CMessageHeader(pszCommand, 0) << obj;
+    return FinalizeSerializedMessage(ssMsg);
+}
+
+/** The message for obj, serialized at most once per send version of the peers it is queued on */
+template<typename T>
+class CSharedMessage
+{
+private:
+    const char* pszCommand;
+    const T& obj;
+    std::map<int, CSerializedMessageRef> mapMessages;
+
+public:
+    CSharedMessage(const char* pszCommandIn, const T& objIn) : pszCommand(pszCommandIn), obj(objIn) {}
+
+    const CSerializedMessageRef& Get(int nVersion)
+    {
+        CSerializedMessageRef& msg = mapMessages[nVersion];
+        if (!msg)
+            msg = MakeSerializedMessage(pszCommand, obj, nVersion);
+        return msg;
+    }
+};
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
@@ -225,7 +281,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedMessageRef> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -253,6 +309,10 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Socket readiness as last reported by the edge-triggered epoll backend
+    bool fSocketRegistered;
+    bool fSocketReadable;
+    bool fSocketWritable;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in their version message that we should not relay tx invs
@@ -404,6 +464,22 @@ public:
 
     void AskFor(const CInv& inv);
 
+    /** Queue a message built by MakeSerializedMessage without copying its buffer */
+    void PushSerializedMessage(const CSerializedMessageRef& msg);
+
+    /** The version ssSend serializes with, as negotiated in the version handshake */
+    int GetSendVersion() const
+    {
+        return std::min(nVersion, PROTOCOL_VERSION);
+    }
+
+    /** Queue the message of msg serialized for this peer's send version */
+    template<typename T>
+    void PushSharedMessage(CSharedMessage<T>& msg)
+    {
+        PushSerializedMessage(msg.Get(GetSendVersion()));
+    }
+
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
     void BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend);
 
@@ -695,6 +771,14 @@ void RelayTransaction(const CTransaction& tx);
 void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll=false);    
 void RelayInv(CInv &inv, const int minProtoVersion = MIN_PEER_PROTO_VERSION);
+/** Announce inv and keep msg around so getdata requests for it are answered without serializing again */
+void RelayInv(CInv &inv, const CSerializedMessageRef& msg, const int minProtoVersion = MIN_PEER_PROTO_VERSION);
+/** Look up a message kept for inv by RelayInv or AddRelayMessage, serialized for send version nVersion */
+bool FindRelayMessage(const CInv& inv, int nVersion, CSerializedMessageRef& msgRet);
+/** Keep msg, serialized for send version nVersion, next to the messages kept for inv */
+void AddRelayMessage(const CInv& inv, int nVersion, const CSerializedMessageRef& msg);
+/** Forget the messages kept for inv, when the object behind it changed without changing its hash */
+void EraseRelayMessage(const CInv& inv);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
@@ -2,10 +2,12 @@
 #include "ui_darksendconfig.h"
 
 #include "bitcoinunits.h"
+#include "darksend.h"
 #include "guiconstants.h"
 #include "optionsmodel.h"
 #include "walletmodel.h"
 #include "init.h"
+#include "wallet.h"
 
 #include <QMessageBox>
 #include <QPushButton>
@@ -88,4 +90,8 @@ void DarksendConfig::configure(bool enabled, int coins, int rounds) {
 
     nDarksendRounds = rounds;
     nAnonymizeDarkcoinAmount = coins;
+
+    // the cached anonymized balances depend on the rounds
+    darkSendPool.cachedNumBlocks = std::numeric_limits<int>::max();
+    pwalletMain->MarkDirty();
 }
@@ -15,6 +15,7 @@
 #include "util.h"
 #include "spork.h"
 #include "masternode-sync.h"
+#include "instantx.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
 #include "walletdb.h"
@@ -151,6 +152,101 @@ Value mnsync(const Array& params, bool fHelp)
     return "failure";
 }
 
+static Object HistogramToJSON(const CLatencyHistogram& hist)
+{
+    Object obj;
+    obj.push_back(Pair("count", (uint64_t)hist.GetCount()));
+    obj.push_back(Pair("avg", hist.GetAverage()));
+    obj.push_back(Pair("p50", hist.GetPercentile(50)));
+    obj.push_back(Pair("p90", hist.GetPercentile(90)));
+    obj.push_back(Pair("p99", hist.GetPercentile(99)));
+    obj.push_back(Pair("max", hist.GetMax()));
+
+    // bucket upper bound -> samples, the last bucket holds everything above
+    Object buckets;
+    const std::vector<int64_t>& vBounds = hist.GetBounds();
+    const std::vector<uint64_t>& vCounts = hist.GetCounts();
+    for(size_t i = 0; i < vCounts.size(); i++) {
+        std::string strBucket = i < vBounds.size() ? strprintf("<=%d", vBounds[i]) : strprintf(">%d", vBounds.back());
+        buckets.push_back(Pair(strBucket, (uint64_t)vCounts[i]));
+    }
+    obj.push_back(Pair("histogram", buckets));
+    return obj;
+}
+
+Value instantx(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "instantx [stats|lock \"txid\"|reset]\n"
+            "Returns InstantX lock latency and masternode vote responsiveness as seen by this node,\n"
+            "the timings of one lock, or resets the statistics.\n"
+            "Latencies are in milliseconds from the lock request, vote processing is in microseconds.\n"
+        );
+
+    std::string strMode = params[0].get_str();
+
+    if(strMode == "stats") {
+        Object obj;
+
+        uint64_t nRequests, nCompleted;
+        int nPending;
+        instantXMetrics.GetCounts(nRequests, nCompleted, nPending);
+        obj.push_back(Pair("requests", (uint64_t)nRequests));
+        obj.push_back(Pair("completed", (uint64_t)nCompleted));
+        obj.push_back(Pair("pending", nPending));
+
+        obj.push_back(Pair("lockLatency", HistogramToJSON(instantXMetrics.GetLockLatency())));
+        obj.push_back(Pair("firstVoteLatency", HistogramToJSON(instantXMetrics.GetFirstVoteLatency())));
+        obj.push_back(Pair("voteLatency", HistogramToJSON(instantXMetrics.GetVoteLatency())));
+        obj.push_back(Pair("voteProcessing", HistogramToJSON(instantXMetrics.GetVoteProcessing())));
+
+        Object masternodes;
+        std::map<COutPoint, CMasternodeVoteStats> mapVoteStats = instantXMetrics.GetVoteStats();
+        for(std::map<COutPoint, CMasternodeVoteStats>::iterator it = mapVoteStats.begin(); it != mapVoteStats.end(); ++it) {
+            const CMasternodeVoteStats& stats = it->second;
+            Object mn;
+            mn.push_back(Pair("votes", stats.nVotes));
+            mn.push_back(Pair("avgDelay", stats.nVotes ? stats.nTotalDelay / stats.nVotes : 0));
+            mn.push_back(Pair("maxDelay", stats.nMaxDelay));
+            mn.push_back(Pair("lastVote", stats.nLastVote));
+            masternodes.push_back(Pair(it->first.ToStringShort(), mn));
+        }
+        obj.push_back(Pair("masternodes", masternodes));
+
+        return obj;
+    }
+
+    if(strMode == "lock")
+    {
+        if (params.size() != 2)
+            throw runtime_error("Correct usage is 'instantx lock \"txid\"'");
+
+        uint256 txHash = ParseHashV(params[1], "txid");
+        CTransactionLockTiming timing;
+        if(!instantXMetrics.GetLockTiming(txHash, timing))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "No lock request seen for this transaction");
+
+        Object obj;
+        obj.push_back(Pair("requested", timing.nTimeRequest));
+        obj.push_back(Pair("firstVote", timing.nTimeFirstVote));
+        obj.push_back(Pair("completed", timing.nTimeComplete));
+        obj.push_back(Pair("signatures", txLockManager.CountSignatures(txHash)));
+        Array votes;
+        BOOST_FOREACH(int64_t nTime, timing.vVoteTimes)
+            votes.push_back(nTime);
+        obj.push_back(Pair("votes", votes));
+        return obj;
+    }
+
+    if(strMode == "reset")
+    {
+        instantXMetrics.Clear();
+        return "success";
+    }
+    return "failure";
+}
+
 #ifdef ENABLE_WALLET
 class DescribeAddressVisitor : public boost::static_visitor<Object>
 {
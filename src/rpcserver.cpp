@@ -315,6 +315,7 @@ static const CRPCCommand vRPCCommands[] =
     { "dash",               "mnbudgetvoteraw",        &mnbudgetvoteraw,        true,      true,       false },
     { "dash",               "mnfinalbudget",          &mnfinalbudget,          true,      true,       false },
     { "dash",               "mnsync",                 &mnsync,                 true,      true,       false },
+    { "dash",               "instantx",               &instantx,               true,      true,       false },
     { "dash",               "spork",                  &spork,                  true,      true,       false },
 #ifdef ENABLE_WALLET
     { "dash",               "darksend",               &darksend,               false,     false,      true  }, /* not threadSafe because of SendMoney */
@@ -336,9 +337,9 @@ static const CRPCCommand vRPCCommands[] =
     { "wallet",             "gettransaction",         &gettransaction,         false,     false,      true },
     { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false,     false,      true },
     { "wallet",             "getwalletinfo",          &getwalletinfo,          false,     false,      true },
-    { "wallet",             "importprivkey",          &importprivkey,          true,      false,      true },
-    { "wallet",             "importwallet",           &importwallet,           true,      false,      true },
-    { "wallet",             "importaddress",          &importaddress,          true,      false,      true },
+    { "wallet",             "importprivkey",          &importprivkey,          true,      true,       true },
+    { "wallet",             "importwallet",           &importwallet,           true,      true,       true },
+    { "wallet",             "importaddress",          &importaddress,          true,      true,       true },
     { "wallet",             "keypoolrefill",          &keypoolrefill,          true,      false,      true },
     { "wallet",             "keepass",                &keepass,                false,     false,      true },
     { "wallet",             "listaccounts",           &listaccounts,           false,     false,      true },
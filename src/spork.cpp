@@ -129,6 +129,7 @@ void ExecuteSpork(int nSporkID, int nValue)
 {
     if(nSporkID == SPORK_11_RESET_BUDGET && nValue == 1){
         budget.Clear();
+        budgetJournal.Append("reset", nValue);
     }
 
     //correct fork via spork technology
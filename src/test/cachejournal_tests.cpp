@@ -0,0 +1,121 @@
+// Copyright (c) 2014-2015 The Dash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cachejournal.h"
+#include "util.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static void CollectRecord(vector<pair<string, int> >* pvRecords, const string& strType, CDataStream& ssRecord)
+{
+    int n;
+    ssRecord >> n;
+    pvRecords->push_back(make_pair(strType, n));
+}
+
+static vector<pair<string, int> > ReopenAndReplay(CCacheJournal& journal)
+{
+    vector<pair<string, int> > vRecords;
+    journal.Close();
+    BOOST_CHECK(journal.Open());
+    journal.Replay(boost::bind(&CollectRecord, &vRecords, _1, _2));
+    return vRecords;
+}
+
+BOOST_AUTO_TEST_SUITE(cachejournal_tests)
+
+BOOST_AUTO_TEST_CASE(cachejournal_append_replay)
+{
+    CCacheJournal journal("test_append.journal");
+    BOOST_CHECK(journal.Open());
+
+    // nothing from a previous run
+    vector<pair<string, int> > vRecords;
+    BOOST_CHECK_EQUAL(journal.Replay(boost::bind(&CollectRecord, &vRecords, _1, _2)), 0);
+
+    journal.Append("mnb", 1);
+    journal.Append("mnp", 2);
+    journal.Append("mnb", 3);
+    uint64_t nSize = journal.GetSize();
+    BOOST_CHECK(nSize > 0);
+
+    vRecords = ReopenAndReplay(journal);
+    BOOST_CHECK_EQUAL(journal.GetSize(), nSize);
+    BOOST_REQUIRE_EQUAL(vRecords.size(), 3);
+    BOOST_CHECK(vRecords[0] == make_pair(string("mnb"), 1));
+    BOOST_CHECK(vRecords[1] == make_pair(string("mnp"), 2));
+    BOOST_CHECK(vRecords[2] == make_pair(string("mnb"), 3));
+
+    // records appended after reopening are not part of the replay
+    journal.Append("mnp", 4);
+    vRecords.clear();
+    BOOST_CHECK_EQUAL(journal.Replay(boost::bind(&CollectRecord, &vRecords, _1, _2)), 3);
+    journal.Close();
+}
+
+BOOST_AUTO_TEST_CASE(cachejournal_truncated_tail)
+{
+    CCacheJournal journal("test_torn.journal");
+    BOOST_CHECK(journal.Open());
+    journal.Append("mnb", 1);
+    uint64_t nFirst = journal.GetSize();
+    journal.Append("mnb", 2);
+    journal.Close();
+
+    // a crash in the middle of the second record
+    boost::filesystem::path path = GetDataDir() / "test_torn.journal";
+    boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 3);
+
+    vector<pair<string, int> > vRecords = ReopenAndReplay(journal);
+    BOOST_REQUIRE_EQUAL(vRecords.size(), 1);
+    BOOST_CHECK_EQUAL(vRecords[0].second, 1);
+    BOOST_CHECK_EQUAL(journal.GetSize(), nFirst);
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nFirst);
+
+    // appending continues right after the last complete record
+    journal.Append("mnb", 3);
+    vRecords = ReopenAndReplay(journal);
+    BOOST_REQUIRE_EQUAL(vRecords.size(), 2);
+    BOOST_CHECK_EQUAL(vRecords[1].second, 3);
+    journal.Close();
+}
+
+BOOST_AUTO_TEST_CASE(cachejournal_compact)
+{
+    CCacheJournal journal("test_compact.journal");
+    BOOST_CHECK(journal.Open());
+    journal.Append("mnb", 1);
+    journal.Append("mnb", 2);
+
+    // a snapshot is taken here, then more records arrive while it is written
+    uint64_t nOffset = journal.GetSize();
+    journal.Append("mnp", 3);
+    uint64_t nTail = journal.GetSize() - nOffset;
+
+    BOOST_CHECK(journal.Compact(nOffset));
+    BOOST_CHECK_EQUAL(journal.GetSize(), nTail);
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(GetDataDir() / "test_compact.journal"), nTail);
+
+    journal.Append("mnp", 4);
+    vector<pair<string, int> > vRecords = ReopenAndReplay(journal);
+    BOOST_REQUIRE_EQUAL(vRecords.size(), 2);
+    BOOST_CHECK(vRecords[0] == make_pair(string("mnp"), 3));
+    BOOST_CHECK(vRecords[1] == make_pair(string("mnp"), 4));
+
+    // records of the previous run have not been snapshotted yet
+    BOOST_CHECK(!journal.Compact(nTail / 2));
+    BOOST_CHECK(journal.Compact(journal.GetSize()));
+    BOOST_CHECK_EQUAL(journal.GetSize(), 0);
+    journal.Close();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,10 +2,13 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "main.h"
+#include "streams.h"
 #include "txmempool.h"
 #include "util.h"
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 #include <list>
 
@@ -99,4 +102,75 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolDumpLoadTest)
+{
+    // DumpMempool writes the pool and its prioritisation deltas to
+    // mempool.dat, LoadMempool reads them back and re-validates
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 11000LL;
+    uint256 hashParent = txParent.GetHash();
+    uint256 hashChild = txChild.GetHash();
+
+    mempool.addUnchecked(hashParent, CTxMemPoolEntry(txParent, 0, 1000, 0.0, 1));
+    mempool.addUnchecked(hashChild, CTxMemPoolEntry(txChild, 0, 2000, 0.0, 1));
+    mempool.PrioritiseTransaction(hashChild, hashChild.ToString(), 1e6, 500);
+
+    BOOST_CHECK(DumpMempool());
+
+    // The file holds both entries with their receive times, and the delta
+    {
+        FILE *file = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+        CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!filein.IsNull());
+        uint64_t nVersion, nCount;
+        filein >> nVersion >> nCount;
+        BOOST_CHECK_EQUAL(nVersion, 1);
+        BOOST_REQUIRE_EQUAL(nCount, 2);
+        std::map<uint256, int64_t> mapTimes;
+        while (nCount--) {
+            CTransaction tx;
+            int64_t nTime;
+            filein >> tx >> nTime;
+            mapTimes[tx.GetHash()] = nTime;
+        }
+        BOOST_CHECK_EQUAL(mapTimes[hashParent], 1000);
+        BOOST_CHECK_EQUAL(mapTimes[hashChild], 2000);
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        filein >> mapDeltas;
+        BOOST_REQUIRE_EQUAL(mapDeltas.size(), 1);
+        BOOST_CHECK(mapDeltas[hashChild] == std::make_pair(1e6, (CAmount)500));
+    }
+
+    mempool.clear();
+    mempool.ClearPrioritisation(hashChild);
+
+    // Neither transaction has spendable inputs here so both fail
+    // re-validation, but the prioritisation is restored regardless
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    mempool.ApplyDeltas(hashChild, dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(dPriorityDelta, 1e6);
+    BOOST_CHECK_EQUAL(nFeeDelta, 500);
+    mempool.ClearPrioritisation(hashChild);
+
+    // A missing file is not an error worth reporting, just nothing to load
+    boost::filesystem::remove(GetDataDir() / "mempool.dat");
+    BOOST_CHECK(!LoadMempool());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,10 @@
 
 #include "wallet.h"
 
+#include "main.h"
+#include "txmempool.h"
+
+#include <list>
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -21,6 +25,8 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_AUTO_TEST_SUITE(wallet_tests)
@@ -305,4 +311,380 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+
+static void add_to_mempool(const CTransaction& tx)
+{
+    mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, GetTime(), 0.0, chainActive.Height()));
+}
+
+// adds a mempool transaction paying nValues to scriptPubKey to pwalletMain
+static uint256 add_wallet_tx(const CScript& scriptPubKey, const vector<CAmount>& nValues, const COutPoint& prevout)
+{
+    CMutableTransaction tx;
+    tx.vin.push_back(CTxIn(prevout));
+    BOOST_FOREACH(const CAmount& nValue, nValues)
+        tx.vout.push_back(CTxOut(nValue, scriptPubKey));
+    CWalletTx wtx(pwalletMain, tx);
+    // outside the chain and the mempool it would count as conflicted
+    add_to_mempool(wtx);
+    BOOST_CHECK(pwalletMain->AddToWallet(wtx));
+    return wtx.GetHash();
+}
+
+static void erase_wallet_tx(const uint256& hash)
+{
+    CTransaction tx;
+    if (mempool.lookup(hash, tx))
+    {
+        list<CTransaction> removed;
+        mempool.remove(tx, removed, true);
+    }
+    pwalletMain->EraseFromWallet(hash);
+}
+
+/**
+ * Receives a payment, spends part of it, gets both into a block and has that block disconnected
+ * again, the way ConnectTip and DisconnectTip tell the wallet. The spend doesn't make it back
+ * into the mempool, as if a double spend of it got in first, and is left conflicted.
+ */
+class WalletScenario
+{
+public:
+    CScript scriptMine;
+    uint256 hashReceived;
+    uint256 hashOther;
+    uint256 hashSpent;
+
+    WalletScenario()
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+        scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+        CKey keyOther;
+        keyOther.MakeNewKey(true);
+        scriptOther = GetScriptForDestination(keyOther.GetPubKey().GetID());
+        pindexBlock = NULL;
+    }
+
+    void Receive()
+    {
+        vector<CAmount> nValues;
+        nValues.push_back(5 * COIN);
+        nValues.push_back(1000 * COIN);
+        hashReceived = add_wallet_tx(scriptMine, nValues, COutPoint(GetRandHash(), 0));
+        hashOther = add_wallet_tx(scriptOther, nValues, COutPoint(GetRandHash(), 0));
+    }
+
+    void Spend()
+    {
+        vector<CAmount> nValues(1, 4 * COIN);
+        hashSpent = add_wallet_tx(scriptMine, nValues, COutPoint(hashReceived, 0));
+    }
+
+    void ConnectBlock()
+    {
+        block = CBlock();
+        block.vtx.push_back(*pwalletMain->GetWalletTx(hashReceived));
+        block.vtx.push_back(*pwalletMain->GetWalletTx(hashSpent));
+        block.hashPrevBlock = chainActive.Tip()->GetBlockHash();
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        block.nTime = chainActive.Tip()->nTime + 1;
+
+        pindexBlock = new CBlockIndex(block);
+        pindexBlock->pprev = chainActive.Tip();
+        pindexBlock->nHeight = chainActive.Height() + 1;
+        BlockMap::iterator mi = mapBlockIndex.insert(make_pair(block.GetHash(), pindexBlock)).first;
+        pindexBlock->phashBlock = &((*mi).first);
+
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            list<CTransaction> removed;
+            mempool.remove(tx, removed, false);
+        }
+        chainActive.SetTip(pindexBlock);
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            SyncWithWallets(tx, &block);
+    }
+
+    void DisconnectBlock()
+    {
+        add_to_mempool(block.vtx[0]);
+        chainActive.SetTip(pindexBlock->pprev);
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            SyncWithWallets(tx, NULL);
+    }
+
+    void Erase()
+    {
+        erase_wallet_tx(hashSpent);
+        erase_wallet_tx(hashReceived);
+        erase_wallet_tx(hashOther);
+        if (pindexBlock)
+        {
+            mapBlockIndex.erase(block.GetHash());
+            delete pindexBlock;
+            pindexBlock = NULL;
+        }
+    }
+
+private:
+    CScript scriptOther;
+    CBlock block;
+    CBlockIndex* pindexBlock;
+};
+
+static set<COutPoint> available_outpoints()
+{
+    vector<COutput> vAvailable;
+    pwalletMain->AvailableCoins(vAvailable, false);
+    set<COutPoint> setOutpoints;
+    BOOST_FOREACH(const COutput& out, vAvailable)
+        setOutpoints.insert(COutPoint(out.tx->GetHash(), out.i));
+    return setOutpoints;
+}
+
+// the incrementally kept unspent index has to give what a full re-index gives
+static set<COutPoint> check_unspent_index()
+{
+    set<COutPoint> setIndexed = available_outpoints();
+    pwalletMain->MarkDirty();
+    set<COutPoint> setRecounted = available_outpoints();
+    BOOST_CHECK(setIndexed == setRecounted);
+    return setIndexed;
+}
+
+BOOST_AUTO_TEST_CASE(unspent_index_tests)
+{
+    WalletScenario scenario;
+
+    // build the index first so the changes below have to update it
+    set<COutPoint> setBefore = check_unspent_index();
+
+    scenario.Receive();
+    set<COutPoint> setReceived = check_unspent_index();
+    BOOST_CHECK_EQUAL(setReceived.size(), setBefore.size() + 2);
+    BOOST_CHECK(setReceived.count(COutPoint(scenario.hashReceived, 0)));
+    BOOST_CHECK(setReceived.count(COutPoint(scenario.hashReceived, 1)));
+
+    // spending an output takes it out, the change goes in
+    scenario.Spend();
+    set<COutPoint> setSpent = check_unspent_index();
+    BOOST_CHECK(!setSpent.count(COutPoint(scenario.hashReceived, 0)));
+    BOOST_CHECK(setSpent.count(COutPoint(scenario.hashSpent, 0)));
+
+    // spent in the main chain, the output is dropped from the index while listing
+    scenario.ConnectBlock();
+    BOOST_CHECK(check_unspent_index() == setSpent);
+
+    // the spend is conflicted now, the output has to be back in the index
+    scenario.DisconnectBlock();
+    set<COutPoint> setDisconnected = check_unspent_index();
+    BOOST_CHECK(setDisconnected.count(COutPoint(scenario.hashReceived, 0)));
+    BOOST_CHECK(setDisconnected.count(COutPoint(scenario.hashReceived, 1)));
+
+    scenario.Erase();
+    BOOST_CHECK(check_unspent_index() == setBefore);
+}
+
+static vector<CAmount> wallet_balances()
+{
+    vector<CAmount> vBalances;
+    vBalances.push_back(pwalletMain->GetBalance());
+    vBalances.push_back(pwalletMain->GetUnconfirmedBalance());
+    vBalances.push_back(pwalletMain->GetImmatureBalance());
+    vBalances.push_back(pwalletMain->GetAnonymizableBalance());
+    vBalances.push_back(pwalletMain->GetAnonymizedBalance());
+    vBalances.push_back(pwalletMain->GetNormalizedAnonymizedBalance());
+    vBalances.push_back(pwalletMain->GetDenominatedBalance());
+    vBalances.push_back(pwalletMain->GetDenominatedBalance(true));
+    vBalances.push_back(pwalletMain->GetWatchOnlyBalance());
+    vBalances.push_back(pwalletMain->GetUnconfirmedWatchOnlyBalance());
+    vBalances.push_back(pwalletMain->GetImmatureWatchOnlyBalance());
+    return vBalances;
+}
+
+// the running balances have to give what a full recount gives
+static vector<CAmount> check_running_balances()
+{
+    vector<CAmount> vRunning = wallet_balances();
+    pwalletMain->MarkDirty();
+    vector<CAmount> vRecounted = wallet_balances();
+    BOOST_CHECK(vRunning == vRecounted);
+    return vRunning;
+}
+
+BOOST_AUTO_TEST_CASE(running_balance_tests)
+{
+    WalletScenario scenario;
+
+    // count the balances first so the changes below have to update them
+    vector<CAmount> vBefore = check_running_balances();
+
+    scenario.Receive();
+    vector<CAmount> vReceived = check_running_balances();
+    BOOST_CHECK_EQUAL(vReceived[1], vBefore[1] + 1005 * COIN);
+
+    // the spend is from us, so its change is trusted right away
+    scenario.Spend();
+    vector<CAmount> vSpent = check_running_balances();
+    BOOST_CHECK_EQUAL(vSpent[0], vBefore[0] + 4 * COIN);
+    BOOST_CHECK_EQUAL(vSpent[1], vBefore[1] + 1000 * COIN);
+
+    // confirmed, what's left of the payment is trusted too
+    scenario.ConnectBlock();
+    vector<CAmount> vConfirmed = check_running_balances();
+    BOOST_CHECK_EQUAL(vConfirmed[0], vBefore[0] + 1004 * COIN);
+    BOOST_CHECK_EQUAL(vConfirmed[1], vBefore[1]);
+
+    // with the spend conflicted the whole payment is unconfirmed again
+    scenario.DisconnectBlock();
+    BOOST_CHECK(check_running_balances() == vReceived);
+
+    scenario.Erase();
+    BOOST_CHECK(check_running_balances() == vBefore);
+}
+
+static int wallet_rounds(const uint256& hash, unsigned int n)
+{
+    LOCK(pwalletMain->cs_wallet);
+    return pwalletMain->GetRealInputDarksendRounds(CTxIn(hash, n));
+}
+
+// the rounds as they come back from the wallet file
+static vector<int> stored_rounds(const uint256& hash)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << *pwalletMain->GetWalletTx(hash);
+    CWalletTx wtxRead;
+    ss >> wtxRead;
+    return wtxRead.vDarksendRounds;
+}
+
+BOOST_AUTO_TEST_CASE(darksend_rounds_tests)
+{
+    vector<int64_t> vDenominationsSaved = darkSendDenominations;
+    darkSendDenominations.clear();
+    darkSendDenominations.push_back((10 * COIN) + 10000);
+    darkSendDenominations.push_back((1 * COIN) + 1000);
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    CScript scriptOther = GetScriptForDestination(keyOther.GetPubKey().GetID());
+
+    // denominated outputs start at 0, a fully denominated spend adds a round
+    vector<CAmount> nValues;
+    nValues.push_back((10 * COIN) + 10000);
+    nValues.push_back(5 * COIN);
+    uint256 hashMixed = add_wallet_tx(scriptMine, nValues, COutPoint(GetRandHash(), 0));
+    BOOST_CHECK_EQUAL(wallet_rounds(hashMixed, 0), 0);
+    BOOST_CHECK_EQUAL(wallet_rounds(hashMixed, 1), -2);
+
+    nValues.assign(2, (1 * COIN) + 1000);
+    uint256 hashRound1 = add_wallet_tx(scriptMine, nValues, COutPoint(hashMixed, 0));
+    BOOST_CHECK_EQUAL(wallet_rounds(hashRound1, 0), 1);
+
+    // an output of someone else doesn't pass its rounds on
+    uint256 hashOther = add_wallet_tx(scriptOther, nValues, COutPoint(hashRound1, 0));
+    BOOST_CHECK_EQUAL(wallet_rounds(hashOther, 0), 2);
+    uint256 hashSpendOther = add_wallet_tx(scriptMine, nValues, COutPoint(hashOther, 0));
+    BOOST_CHECK_EQUAL(wallet_rounds(hashSpendOther, 0), 0);
+
+    BOOST_CHECK(stored_rounds(hashMixed) == pwalletMain->GetWalletTx(hashMixed)->vDarksendRounds);
+    BOOST_CHECK(stored_rounds(hashRound1) == pwalletMain->GetWalletTx(hashRound1)->vDarksendRounds);
+    BOOST_CHECK(stored_rounds(hashSpendOther) == pwalletMain->GetWalletTx(hashSpendOther)->vDarksendRounds);
+
+    // recomputing the spenders of our outputs gives the same
+    pwalletMain->MarkDirty();
+    BOOST_CHECK_EQUAL(wallet_rounds(hashSpendOther, 0), 0);
+
+    // once the output is ours its spender is recomputed and stored again
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_CHECK(pwalletMain->AddKeyPubKey(keyOther, keyOther.GetPubKey()));
+    }
+    pwalletMain->MarkDirty();
+    BOOST_CHECK_EQUAL(wallet_rounds(hashSpendOther, 0), 3);
+    BOOST_CHECK_EQUAL(wallet_rounds(hashSpendOther, 1), 3);
+    BOOST_CHECK(stored_rounds(hashSpendOther) == pwalletMain->GetWalletTx(hashSpendOther)->vDarksendRounds);
+    BOOST_CHECK_EQUAL(wallet_rounds(hashRound1, 0), 1);
+
+    erase_wallet_tx(hashSpendOther);
+    erase_wallet_tx(hashOther);
+    erase_wallet_tx(hashRound1);
+    erase_wallet_tx(hashMixed);
+    darkSendDenominations = vDenominationsSaved;
+}
+
+// the wallet rules outputs out by script before Solver runs, it has to agree with ::IsMine
+static void check_is_mine(const CWallet& keystore, const CScript& scriptPubKey, isminetype mineExpected)
+{
+    isminetype mine = ::IsMine(keystore, scriptPubKey);
+    BOOST_CHECK_EQUAL(mine, mineExpected);
+    BOOST_CHECK_EQUAL(keystore.IsMine(CTxOut(1, scriptPubKey)), mine);
+}
+
+BOOST_AUTO_TEST_CASE(may_be_mine_tests)
+{
+    CWallet keystore;
+    LOCK(keystore.cs_wallet);
+
+    CKey key[4];
+    key[0].MakeNewKey(true);
+    key[1].MakeNewKey(false);
+    key[2].MakeNewKey(true);
+    key[3].MakeNewKey(true);
+
+    CScript scriptP2PKH = GetScriptForDestination(key[0].GetPubKey().GetID());
+    CScript scriptP2PK = CScript() << ToByteVector(key[0].GetPubKey()) << OP_CHECKSIG;
+    CScript scriptP2PKHUncompressed = GetScriptForDestination(key[1].GetPubKey().GetID());
+    CScript scriptP2PKUncompressed = CScript() << ToByteVector(key[1].GetPubKey()) << OP_CHECKSIG;
+    vector<CPubKey> vKeys;
+    vKeys.push_back(key[0].GetPubKey());
+    vKeys.push_back(key[2].GetPubKey());
+    CScript scriptMultisig = GetScriptForMultisig(1, vKeys);
+    CScript scriptP2SH = GetScriptForDestination(CScriptID(scriptMultisig));
+    CScript scriptWatched = GetScriptForDestination(key[3].GetPubKey().GetID());
+    CScript scriptWatchedNonstandard = CScript() << OP_1;
+
+    check_is_mine(keystore, scriptP2PKH, ISMINE_NO);
+    check_is_mine(keystore, scriptP2PK, ISMINE_NO);
+    check_is_mine(keystore, scriptP2PKHUncompressed, ISMINE_NO);
+    check_is_mine(keystore, scriptP2PKUncompressed, ISMINE_NO);
+    check_is_mine(keystore, scriptMultisig, ISMINE_NO);
+    check_is_mine(keystore, scriptP2SH, ISMINE_NO);
+    check_is_mine(keystore, scriptWatched, ISMINE_NO);
+    check_is_mine(keystore, scriptWatchedNonstandard, ISMINE_NO);
+
+    BOOST_CHECK(keystore.AddKeyPubKey(key[0], key[0].GetPubKey()));
+    BOOST_CHECK(keystore.AddKeyPubKey(key[1], key[1].GetPubKey()));
+    check_is_mine(keystore, scriptP2PKH, ISMINE_SPENDABLE);
+    check_is_mine(keystore, scriptP2PK, ISMINE_SPENDABLE);
+    check_is_mine(keystore, scriptP2PKHUncompressed, ISMINE_SPENDABLE);
+    check_is_mine(keystore, scriptP2PKUncompressed, ISMINE_SPENDABLE);
+    // bare multisig needs all the keys, P2SH the redeem script too
+    check_is_mine(keystore, scriptMultisig, ISMINE_NO);
+    check_is_mine(keystore, scriptP2SH, ISMINE_NO);
+
+    BOOST_CHECK(keystore.AddKeyPubKey(key[2], key[2].GetPubKey()));
+    check_is_mine(keystore, scriptMultisig, ISMINE_SPENDABLE);
+    check_is_mine(keystore, scriptP2SH, ISMINE_NO);
+
+    BOOST_CHECK(keystore.AddCScript(scriptMultisig));
+    check_is_mine(keystore, scriptP2SH, ISMINE_SPENDABLE);
+
+    BOOST_CHECK(keystore.AddWatchOnly(scriptWatched));
+    BOOST_CHECK(keystore.AddWatchOnly(scriptWatchedNonstandard));
+    check_is_mine(keystore, scriptWatched, ISMINE_WATCH_ONLY);
+    check_is_mine(keystore, scriptWatchedNonstandard, ISMINE_WATCH_ONLY);
+
+    // a key for a watched script makes it spendable
+    BOOST_CHECK(keystore.AddKeyPubKey(key[3], key[3].GetPubKey()));
+    check_is_mine(keystore, scriptWatched, ISMINE_SPENDABLE);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
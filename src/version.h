@@ -10,7 +10,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70103;
+static const int PROTOCOL_VERSION = 70104;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -30,6 +30,9 @@ static const int MIN_BUDGET_PEER_PROTO_VERSION = 70103;
 //! minimum peer version for masternode winner broadcasts
 static const int MIN_MNW_PEER_PROTO_VERSION = 70103;
 
+//! "dsegd" masternode list sync against a digest starts with this version
+static const int MIN_MNLIST_DIGEST_PROTO_VERSION = 70104;
+
 //! minimum peer version that can receive masternode payments
 // V1 - Last protocol version before update
 // V2 - Newest protocol version
@@ -98,6 +98,13 @@ CPubKey CWallet::GenerateNewKey()
 
     if (!AddKeyPubKey(secret, pubkey))
         throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
+
+    // nothing can have paid a fresh key yet
+    {
+        LOCK(cs_KeyStore);
+        setWalletScriptsAdded.erase(GetScriptForDestination(pubkey.GetID()));
+        setWalletScriptsAdded.erase(CScript() << ToByteVector(pubkey) << OP_CHECKSIG);
+    }
     return pubkey;
 }
 
@@ -106,6 +113,7 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    AddWalletScripts(pubkey);
 
     // check if we need to remove from watch-only
     CScript script;
@@ -128,6 +136,7 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    AddWalletScripts(vchPubKey);
     if (!fFileBacked)
         return true;
     {
@@ -154,15 +163,27 @@ bool CWallet::LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &meta)
     return true;
 }
 
+bool CWallet::LoadKey(const CKey& key, const CPubKey &pubkey)
+{
+    if (!CCryptoKeyStore::AddKeyPubKey(key, pubkey))
+        return false;
+    AddWalletScripts(pubkey);
+    return true;
+}
+
 bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
-    return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    AddWalletScripts(vchPubKey);
+    return true;
 }
 
 bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    AddWalletScript(GetScriptForDestination(CScriptID(redeemScript)));
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -181,13 +202,17 @@ bool CWallet::LoadCScript(const CScript& redeemScript)
         return true;
     }
 
-    return CCryptoKeyStore::AddCScript(redeemScript);
+    if (!CCryptoKeyStore::AddCScript(redeemScript))
+        return false;
+    AddWalletScript(GetScriptForDestination(CScriptID(redeemScript)));
+    return true;
 }
 
 bool CWallet::AddWatchOnly(const CScript &dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    AddWalletScript(dest);
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
@@ -211,7 +236,43 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
 
 bool CWallet::LoadWatchOnly(const CScript &dest)
 {
-    return CCryptoKeyStore::AddWatchOnly(dest);
+    if (!CCryptoKeyStore::AddWatchOnly(dest))
+        return false;
+    AddWalletScript(dest);
+    return true;
+}
+
+void CWallet::AddWalletScript(const CScript& script)
+{
+    LOCK(cs_KeyStore);
+    if (setWalletScripts.insert(script).second)
+        setWalletScriptsAdded.insert(script);
+}
+
+void CWallet::AddWalletScripts(const CPubKey& pubkey)
+{
+    // pay-to-pubkey-hash and pay-to-pubkey, the forms IsMine knows for a key
+    AddWalletScript(GetScriptForDestination(pubkey.GetID()));
+    AddWalletScript(CScript() << ToByteVector(pubkey) << OP_CHECKSIG);
+}
+
+/** Forms that can only be ours through setWalletScripts, multisig and nonstandard scripts take the full check */
+static bool IsWalletScriptForm(const CScript& scriptPubKey)
+{
+    return scriptPubKey.IsPayToScriptHash() ||
+        (scriptPubKey.size() == 25 && scriptPubKey[0] == OP_DUP && scriptPubKey[1] == OP_HASH160 &&
+         scriptPubKey[2] == 20 && scriptPubKey[23] == OP_EQUALVERIFY && scriptPubKey[24] == OP_CHECKSIG) ||
+        (scriptPubKey.size() == 35 && scriptPubKey[0] == 33 && scriptPubKey[34] == OP_CHECKSIG) ||
+        (scriptPubKey.size() == 67 && scriptPubKey[0] == 65 && scriptPubKey[66] == OP_CHECKSIG);
+}
+
+bool CWallet::MayBeMine(const CScript& scriptPubKey) const
+{
+    if (!IsWalletScriptForm(scriptPubKey))
+        return true;
+
+    LOCK(cs_KeyStore);
+    return setWalletScripts.count(scriptPubKey) > 0;
 }
 
 bool CWallet::Unlock(const SecureString& strWalletPassphrase, bool anonymizeOnly)
@@ -622,6 +683,34 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        // keys or scripts were imported, outputs may have become ours
+        fUnspentCoinsIndexed = false;
+        fBalancesCounted = false;
+
+        // rounds follow the inputs that are ours, only the spenders of outputs paying the
+        // scripts added since the last call can have changed
+        std::set<CScript> setScripts;
+        {
+            LOCK(cs_KeyStore);
+            setScripts.swap(setWalletScriptsAdded);
+        }
+        if (setScripts.empty())
+            return;
+
+        std::vector<uint256> vAffected;
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        {
+            BOOST_FOREACH(const CTxOut& txout, item.second.vout)
+            {
+                if (setScripts.count(txout.scriptPubKey) || !IsWalletScriptForm(txout.scriptPubKey))
+                {
+                    vAffected.push_back(item.first);
+                    break;
+                }
+            }
+        }
+        BOOST_FOREACH(const uint256& hash, vAffected)
+            UpdateDarksendRoundsOfSpenders(hash, mapWallet[hash].vout.size());
     }
 }
 
@@ -694,6 +783,18 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                              wtxIn.hashBlock.ToString());
             }
             AddToSpends(hash);
+
+            // computed once here, parents are normally in the wallet already. Parents
+            // stored before their rounds were kept get theirs written now, wtx is below.
+            UpdateDarksendRoundsOfSpenders(hash, wtx.vout.size());
+            std::vector<const CWalletTx*> vComputed;
+            UpdateDarksendRounds(wtx, &vComputed);
+            if (fFileBacked)
+            {
+                BOOST_FOREACH(const CWalletTx* pwtx, vComputed)
+                    if (pwtx != &wtx)
+                        CWalletDB(strWalletFile).WriteTx(pwtx->GetHash(), *pwtx);
+            }
         }
 
         bool fUpdated = false;
@@ -726,6 +827,15 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             if (!wtx.WriteToDisk())
                 return false;
 
+        if (fUnspentCoinsIndexed)
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+                IndexUnspentCoin(COutPoint(hash, i));
+
+        // count it and what it spends again
+        MarkBalancesDirty(hash);
+        BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            MarkBalancesDirty(txin.prevout.hash);
+
         // Break debit/credit balance caches:
         wtx.MarkDirty();
 
@@ -780,7 +890,13 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
         if (mapWallet.count(txin.prevout.hash))
+        {
             mapWallet[txin.prevout.hash].MarkDirty();
+            MarkBalancesDirty(txin.prevout.hash);
+        }
+        // disconnected or conflicted, what it spent may be available again
+        if (!pblock && fUnspentCoinsIndexed)
+            IndexUnspentCoin(txin.prevout);
     }
 }
 
@@ -790,8 +906,29 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            unsigned int nOutputs = mi->second.vout.size();
+            std::vector<CTxIn> vin = mi->second.vin;
+            for (unsigned int i = 0; i < nOutputs; i++)
+                setUnspentCoins[GetCoinClass(mi->second.vout[i].nValue)].erase(COutPoint(hash, i));
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+            UpdateDarksendRoundsOfSpenders(hash, nOutputs);
+            if (fUnspentCoinsIndexed)
+            {
+                BOOST_FOREACH(const CTxIn& txin, vin)
+                    IndexUnspentCoin(txin.prevout);
+            }
+            MarkBalancesDirty(hash);
+            BOOST_FOREACH(const CTxIn& txin, vin)
+            {
+                if (mapWallet.count(txin.prevout.hash))
+                    mapWallet[txin.prevout.hash].MarkDirty();
+                MarkBalancesDirty(txin.prevout.hash);
+            }
+        }
     }
     return;
 }
@@ -829,98 +966,189 @@ CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter& filter) const
 }
 
 // Recursively determine the rounds of a given input (How deep is the Darksend chain for a given input)
-int CWallet::GetRealInputDarksendRounds(CTxIn in, int rounds) const
+void CWallet::UpdateDarksendRounds(const CWalletTx& wtxIn, std::vector<const CWalletTx*>* pvComputed) const
 {
-    static std::map<uint256, CMutableTransaction> mDenomWtxes;
-
-    if(rounds >= 16) return 15; // 16 rounds max
-
-    uint256 hash = in.prevout.hash;
-    unsigned int nout = in.prevout.n;
+    AssertLockHeld(cs_wallet);
 
-    const CWalletTx* wtx = GetWalletTx(hash);
-    if(wtx != NULL)
+    // parents before children, without recursing down long mixing chains
+    std::vector<const CWalletTx*> vStack(1, &wtxIn);
+    while(!vStack.empty())
     {
-        std::map<uint256, CMutableTransaction>::const_iterator mdwi = mDenomWtxes.find(hash);
-        // not known yet, let's add it
-        if(mdwi == mDenomWtxes.end())
-        {
-            LogPrint("darksend", "GetInputDarksendRounds INSERTING %s\n", hash.ToString());
-            mDenomWtxes[hash] = CMutableTransaction(*wtx);
-        }
-        // found and it's not an initial value, just return it
-        else if(mDenomWtxes[hash].vout[nout].nRounds != -10)
+        const CWalletTx* pwtx = vStack.back();
+        if(!pwtx->vDarksendRounds.empty())
         {
-            return mDenomWtxes[hash].vout[nout].nRounds;
+            vStack.pop_back();
+            continue;
         }
 
+        bool fAllDenoms = true;
+        BOOST_FOREACH(const CTxOut& out, pwtx->vout)
+            fAllDenoms = fAllDenoms && IsDenominatedAmount(out.nValue);
 
-        // bounds check
-        if(nout >= wtx->vout.size())
+        // only fully denominated transactions carry the rounds of their inputs over
+        int nTxRounds = 0;
+        if(fAllDenoms)
         {
-            // should never actually hit this
-            LogPrint("darksend", "GetInputDarksendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, -4);
-            return -4;
-        }
+            bool fParentsReady = true;
+            int nShortest = -10; // an initial value, should be no way to get this by calculations
+            bool fDenomFound = false;
+            BOOST_FOREACH(const CTxIn& txin, pwtx->vin)
+            {
+                if(!IsMine(txin)) continue;
 
-        if(pwalletMain->IsCollateralAmount(wtx->vout[nout].nValue))
-        {
-            mDenomWtxes[hash].vout[nout].nRounds = -3;
-            LogPrint("darksend", "GetInputDarksendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
+                const CWalletTx* pprev = GetWalletTx(txin.prevout.hash);
+                if(pprev->vDarksendRounds.empty())
+                {
+                    vStack.push_back(pprev);
+                    fParentsReady = false;
+                    continue;
+                }
+
+                int n = txin.prevout.n < pprev->vDarksendRounds.size() ? pprev->vDarksendRounds[txin.prevout.n] : -4;
+                // denom found, find the shortest chain or initially assign nShortest with the first found value
+                if(n >= 0 && (n < nShortest || nShortest == -10))
+                {
+                    nShortest = n;
+                    fDenomFound = true;
+                }
+            }
+            if(!fParentsReady) continue;
+
+            nTxRounds = fDenomFound
+                    ? (nShortest >= 15 ? 16 : nShortest + 1) // good, we a +1 to the shortest one but only 16 rounds max allowed
+                    : 0;            // too bad, we are the fist one in that chain
         }
 
-        //make sure the final output is non-denominate
-        if(/*rounds == 0 && */!IsDenominatedAmount(wtx->vout[nout].nValue)) //NOT DENOM
+        std::vector<int> vRounds;
+        BOOST_FOREACH(const CTxOut& out, pwtx->vout)
         {
-            mDenomWtxes[hash].vout[nout].nRounds = -2;
-            LogPrint("darksend", "GetInputDarksendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
+            if(IsCollateralAmount(out.nValue))
+                vRounds.push_back(-3);
+            else if(!IsDenominatedAmount(out.nValue)) //NOT DENOM
+                vRounds.push_back(-2);
+            else // denominated, 0 if there is another non-denominated output in the same tx
+                vRounds.push_back(nTxRounds);
         }
+        pwtx->vDarksendRounds = vRounds;
+        if(pvComputed) pvComputed->push_back(pwtx);
+        LogPrint("darksend", "UpdateDarksendRounds %s %3d\n", pwtx->GetHash().ToString(), nTxRounds);
 
-        bool fAllDenoms = true;
-        BOOST_FOREACH(CTxOut out, wtx->vout)
+        vStack.pop_back();
+    }
+}
+
+void CWallet::UpdateMissingDarksendRounds()
+{
+    LOCK(cs_wallet);
+
+    // records written before rounds were kept, or damaged ones
+    std::vector<CWalletTx*> vMissing;
+    for (std::map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        CWalletTx& wtx = (*it).second;
+        if (wtx.vDarksendRounds.size() != wtx.vout.size())
         {
-            fAllDenoms = fAllDenoms && IsDenominatedAmount(out.nValue);
+            wtx.vDarksendRounds.clear();
+            vMissing.push_back(&wtx);
         }
-        // this one is denominated but there is another non-denominated output found in the same tx
-        if(!fAllDenoms)
+    }
+    if (vMissing.empty())
+        return;
+
+    BOOST_FOREACH(CWalletTx* pwtx, vMissing)
+        UpdateDarksendRounds(*pwtx);
+    if (fFileBacked)
+    {
+        CWalletDB walletdb(strWalletFile);
+        BOOST_FOREACH(CWalletTx* pwtx, vMissing)
+            walletdb.WriteTx(pwtx->GetHash(), *pwtx);
+    }
+    LogPrintf("Computed the Darksend rounds of %u wallet transactions\n", vMissing.size());
+}
+
+void CWallet::UpdateDarksendRoundsOfSpenders(const uint256& hash, unsigned int nOutputs)
+{
+    AssertLockHeld(cs_wallet);
+
+    // spenders that were computed without this transaction, usually there are none
+    std::vector<uint256> vToVisit(1, hash);
+    std::vector<uint256> vSpenders;
+    std::set<uint256> setSeen;
+    while(!vToVisit.empty())
+    {
+        uint256 hashVisit = vToVisit.back();
+        vToVisit.pop_back();
+
+        unsigned int nVisitOutputs = nOutputs;
+        if(hashVisit != hash)
         {
-            mDenomWtxes[hash].vout[nout].nRounds = 0;
-            LogPrint("darksend", "GetInputDarksendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
+            const CWalletTx* pwtx = GetWalletTx(hashVisit);
+            if(pwtx == NULL) continue;
+            nVisitOutputs = pwtx->vout.size();
         }
 
-        int nShortest = -10; // an initial value, should be no way to get this by calculations
-        bool fDenomFound = false;
-        // only denoms here so let's look up
-        BOOST_FOREACH(CTxIn in2, wtx->vin)
+        for(unsigned int i = 0; i < nVisitOutputs; i++)
         {
-            if(IsMine(in2))
+            std::pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(hashVisit, i));
+            for(TxSpends::const_iterator it = range.first; it != range.second; ++it)
             {
-                int n = GetRealInputDarksendRounds(in2, rounds+1);
-                // denom found, find the shortest chain or initially assign nShortest with the first found value
-                if(n >= 0 && (n < nShortest || nShortest == -10))
-                {
-                    nShortest = n;
-                    fDenomFound = true;
-                }
+                if(!setSeen.insert(it->second).second) continue;
+                vToVisit.push_back(it->second);
+                vSpenders.push_back(it->second);
             }
         }
-        mDenomWtxes[hash].vout[nout].nRounds = fDenomFound
-                ? (nShortest >= 15 ? 16 : nShortest + 1) // good, we a +1 to the shortest one but only 16 rounds max allowed
-                : 0;            // too bad, we are the fist one in that chain
-        LogPrint("darksend", "GetInputDarksendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-        return mDenomWtxes[hash].vout[nout].nRounds;
     }
 
-    return rounds-1;
+    std::map<uint256, std::vector<int> > mapOldRounds;
+    BOOST_FOREACH(const uint256& hashSpender, vSpenders)
+    {
+        std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(hashSpender);
+        if(mi == mapWallet.end()) continue;
+        mapOldRounds[hashSpender].swap(mi->second.vDarksendRounds);
+    }
+
+    for(std::map<uint256, std::vector<int> >::iterator it = mapOldRounds.begin(); it != mapOldRounds.end(); ++it)
+    {
+        CWalletTx& wtx = mapWallet[it->first];
+        UpdateDarksendRounds(wtx);
+        if(wtx.vDarksendRounds != it->second)
+        {
+            wtx.WriteToDisk();
+            wtx.MarkDirty();
+            MarkBalancesDirty(it->first);
+        }
+    }
+}
+
+int CWallet::GetRealInputDarksendRounds(CTxIn in) const
+{
+    AssertLockHeld(cs_wallet);
+
+    const CWalletTx* wtx = GetWalletTx(in.prevout.hash);
+    if(wtx == NULL) return -1;
+
+    // bounds check
+    if(in.prevout.n >= wtx->vout.size())
+    {
+        // should never actually hit this
+        LogPrint("darksend", "GetInputDarksendRounds %s %3d out of bounds\n", in.prevout.hash.ToString(), in.prevout.n);
+        return -4;
+    }
+
+    // computed when the transaction is added or updated, and when the wallet is loaded
+    if(wtx->vDarksendRounds.size() != wtx->vout.size())
+    {
+        LogPrint("darksend", "GetInputDarksendRounds %s rounds missing\n", in.prevout.hash.ToString());
+        return -1;
+    }
+
+    return wtx->vDarksendRounds[in.prevout.n];
 }
 
 // respect current settings
 int CWallet::GetInputDarksendRounds(CTxIn in) const {
     LOCK(cs_wallet);
-    int realDarksendRounds = GetRealInputDarksendRounds(in, 0);
+    int realDarksendRounds = GetRealInputDarksendRounds(in);
     return realDarksendRounds > nDarksendRounds ? nDarksendRounds : realDarksendRounds;
 }
 
@@ -1125,10 +1353,180 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+/** Blocks of a rescan, read and matched against the wallet's scripts by several threads */
+class CWalletScanBatch
+{
+public:
+    std::vector<CBlockIndex*> vIndex;
+    std::vector<CBlock> vBlocks;
+    std::vector<char> vfRead;
+    // per block and transaction, whether any output is ours
+    std::vector<std::vector<char> > vfMine;
+
+    void swap(CWalletScanBatch& other)
+    {
+        vIndex.swap(other.vIndex);
+        vBlocks.swap(other.vBlocks);
+        vfRead.swap(other.vfRead);
+        vfMine.swap(other.vfMine);
+    }
+
+    void Resize()
+    {
+        vBlocks.resize(vIndex.size());
+        vfRead.assign(vIndex.size(), false);
+        vfMine.resize(vIndex.size());
+    }
+};
+
+static void ReadScanBatch(CWalletScanBatch* pbatch, const CWallet* pwallet, int nThread, int nThreads)
+{
+    for (unsigned int n = nThread; n < pbatch->vIndex.size(); n += nThreads)
+    {
+        CBlock& block = pbatch->vBlocks[n];
+        if (!ReadBlockFromDisk(block, pbatch->vIndex[n]))
+            continue;
+
+        std::vector<char>& vfMine = pbatch->vfMine[n];
+        vfMine.assign(block.vtx.size(), false);
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+            BOOST_FOREACH(const CTxOut& txout, block.vtx[i].vout)
+                if (pwallet->IsMine(txout) != ISMINE_NO) {
+                    vfMine[i] = true;
+                    break;
+                }
+        pbatch->vfRead[n] = true;
+    }
+}
+
+/**
+ * Threads reading one rescan batch after another, started once per rescan.
+ * Start hands them a batch, Wait blocks until all of them are done with it.
+ */
+class CWalletScanReaders
+{
+private:
+    //! Mutex to protect the inner state
+    boost::mutex mutex;
+
+    //! Reader threads block on this until there is a new batch
+    boost::condition_variable condWorker;
+
+    //! The scanning thread blocks on this until the batch is read
+    boost::condition_variable condMaster;
+
+    boost::thread_group threads;
+    const CWallet* pwallet;
+    int nThreads;
+
+    //! The batch being read
+    CWalletScanBatch* pbatch;
+
+    //! Incremented for every batch handed out
+    unsigned int nBatches;
+
+    //! The number of readers still reading the current batch
+    int nBusy;
+
+    //! Whether the rescan is over
+    bool fQuit;
+
+    void Loop(int nThread)
+    {
+        RenameThread("dash-rescan");
+
+        unsigned int nRead = 0;
+        while (true) {
+            CWalletScanBatch* pbatchRead;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && nBatches == nRead)
+                    condWorker.wait(lock);
+                if (fQuit)
+                    return;
+                nRead = nBatches;
+                pbatchRead = pbatch;
+            }
+            ReadScanBatch(pbatchRead, pwallet, nThread, nThreads);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (--nBusy == 0)
+                    condMaster.notify_one();
+            }
+        }
+    }
+
+public:
+    CWalletScanReaders(const CWallet* pwalletIn, int nThreadsIn) : pwallet(pwalletIn), nThreads(nThreadsIn), pbatch(NULL), nBatches(0), nBusy(0), fQuit(false)
+    {
+        for (int n = 0; n < nThreads; n++)
+            threads.create_thread(boost::bind(&CWalletScanReaders::Loop, this, n));
+    }
+
+    ~CWalletScanReaders()
+    {
+        boost::this_thread::disable_interruption di;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (nBusy > 0)
+                condMaster.wait(lock);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+        threads.join_all();
+    }
+
+    //! Have the readers read pbatchIn, the previous batch has to be waited for
+    void Start(CWalletScanBatch* pbatchIn)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            pbatch = pbatchIn;
+            nBusy = nThreads;
+            nBatches++;
+        }
+        condWorker.notify_all();
+    }
+
+    void Wait()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (nBusy > 0)
+            condMaster.wait(lock);
+    }
+};
+
+/**
+ * The blocks following pindex on the active chain, from the fork point if a
+ * reorganization took pindex off it. Empty at the tip.
+ */
+static void GetScanBatchBlocks(CBlockIndex* pindex, bool fIncluding, std::vector<CBlockIndex*>& vIndex)
+{
+    vIndex.clear();
+    if (!pindex)
+        return;
+
+    LOCK(cs_main);
+    if (!chainActive.Contains(pindex)) {
+        pindex = chainActive[chainActive.FindFork(pindex)->nHeight];
+        fIncluding = false;
+    }
+    if (!fIncluding)
+        pindex = chainActive.Next(pindex);
+    while (pindex && vIndex.size() < WALLET_RESCAN_BATCH_BLOCKS) {
+        vIndex.push_back(pindex);
+        pindex = chainActive.Next(pindex);
+    }
+}
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ *
+ * Blocks are read and their outputs matched by a few threads, one batch ahead
+ * of the transactions being added, without holding cs_main or cs_wallet. Only
+ * transactions paying us, spending from or already in the wallet take the locks.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
@@ -1136,6 +1534,10 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
     int64_t nNow = GetTime();
 
     CBlockIndex* pindex = pindexStart;
+    double dProgressStart;
+    double dProgressTip;
+    // wallet transactions, anything spending from one is a candidate
+    std::set<uint256> setWalletTxids;
     {
         LOCK2(cs_main, cs_wallet);
 
@@ -1145,28 +1547,70 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
             pindex = chainActive.Next(pindex);
 
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setWalletTxids.insert(it->first);
+    }
+
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_WALLET_RESCAN_THREADS));
+
+    // the batches outlive the readers, which finish reading before they quit
+    CWalletScanBatch batch;
+    CWalletScanBatch batchNext;
+    CWalletScanReaders readers(this, nThreads);
+    GetScanBatchBlocks(pindex, true, batchNext.vIndex);
+    batchNext.Resize();
+    readers.Start(&batchNext);
+
+    while (!batchNext.vIndex.empty())
+    {
+        readers.Wait();
+        batch.swap(batchNext);
+
+        // read the next blocks while this batch is added
+        GetScanBatchBlocks(batch.vIndex.back(), false, batchNext.vIndex);
+        batchNext.Resize();
+        readers.Start(&batchNext);
+
+        for (unsigned int n = 0; n < batch.vIndex.size(); n++)
         {
+            pindex = batch.vIndex[n];
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            if (!batch.vfRead[n]) {
+                LogPrintf("ScanForWalletTransactions() : failed to read block %s\n", pindex->GetBlockHash().ToString());
+                continue;
+            }
+
+            const CBlock& block = batch.vBlocks[n];
+            for (unsigned int i = 0; i < block.vtx.size(); i++)
             {
+                const CTransaction& tx = block.vtx[i];
+                bool fCandidate = batch.vfMine[n][i] || setWalletTxids.count(tx.GetHash());
+                for (unsigned int j = 0; j < tx.vin.size() && !fCandidate; j++)
+                    fCandidate = setWalletTxids.count(tx.vin[j].prevout.hash) > 0;
+                if (!fCandidate)
+                    continue;
+
+                LOCK2(cs_main, cs_wallet);
                 if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
                     ret++;
+                if (mapWallet.count(tx.GetHash()))
+                    setWalletTxids.insert(tx.GetHash());
             }
-            pindex = chainActive.Next(pindex);
+
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
                 LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
+    readers.Wait();
+
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     return ret;
 }
 
@@ -1199,8 +1643,10 @@ void CWalletTx::RelayWalletTransaction(std::string strCommand)
             LogPrintf("Relaying wtx %s\n", hash.ToString());
 
             if(strCommand == "ix"){
-                mapTxLockReq.insert(make_pair(hash, (CTransaction)*this));
-                CreateNewLock(((CTransaction)*this));
+                txLockManager.AddTxLockRequest((CTransaction)*this);
+                int64_t nTimeRequest = GetTimeMillis();
+                if(CreateNewLock(((CTransaction)*this)) != 0)
+                    instantXMetrics.RequestReceived(hash, nTimeRequest);
                 RelayTransactionLockReq((CTransaction)*this, true);
             } else {
                 RelayTransaction((CTransaction)*this);
@@ -1270,217 +1716,266 @@ void CWallet::ResendWalletTransactions()
  */
 
 
-CAmount CWallet::GetBalance() const
+void CWallet::MarkBalancesDirty(const uint256& hash)
+{
+    AssertLockHeld(cs_wallet);
+    if (fBalancesCounted)
+        setBalancesDirty.insert(hash);
+}
+
+void CWallet::CountBalances(const uint256& hash) const
 {
-    CAmount nTotal = 0;
+    std::map<uint256, CWalletBalances>::iterator mi = mapBalancesCounted.find(hash);
+    if (mi != mapBalancesCounted.end())
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+        balancesTotal -= mi->second;
+        mapBalancesCounted.erase(mi);
     }
+    setBalancesUnsettled.erase(hash);
 
-    return nTotal;
-}
+    std::map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+    if (it == mapWallet.end())
+        return;
+    const CWalletTx* pcoin = &(*it).second;
 
-CAmount CWallet::GetAnonymizableBalance() const
-{
-    if(fLiteMode) return 0;
+    CWalletBalances balances;
+    bool fTrusted = pcoin->IsTrusted();
+    int nDepth = pcoin->GetDepthInMainChain();
+    if (fTrusted)
+    {
+        balances.nBalance = pcoin->GetAvailableCredit();
+        balances.nWatchOnly = pcoin->GetAvailableWatchOnlyCredit();
+    }
+    if (!IsFinalTx(*pcoin) || (!fTrusted && nDepth == 0))
+    {
+        balances.nUnconfirmed = pcoin->GetAvailableCredit();
+        balances.nUnconfirmedWatchOnly = pcoin->GetAvailableWatchOnlyCredit();
+    }
+    balances.nImmature = pcoin->GetImmatureCredit();
+    balances.nImmatureWatchOnly = pcoin->GetImmatureWatchOnlyCredit();
 
-    CAmount nTotal = 0;
+    if (!fLiteMode)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (fTrusted)
         {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (pcoin->IsTrusted())
-               nTotal += pcoin->GetAnonymizableCredit();
+            balances.nAnonymizable = pcoin->GetAnonymizableCredit();
+            balances.nAnonymized = pcoin->GetAnonymizedCredit();
         }
-    }
+        balances.nDenominatedConfirmed = pcoin->GetDenominatedCredit(false);
+        balances.nDenominatedUnconfirmed = pcoin->GetDenominatedCredit(true);
 
-    return nTotal;
-}
+        // Note: calculated including unconfirmed,
+        // that's ok as long as we use it for informational purposes only
+        for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
 
-CAmount CWallet::GetAnonymizedBalance() const
-{
-    if(fLiteMode) return 0;
+            CTxIn vin = CTxIn(hash, i);
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
+            if(IsSpent(hash, i) || IsMine(pcoin->vout[i]) != ISMINE_SPENDABLE || !IsDenominated(vin)) continue;
 
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAnonymizedCredit();
+            int rounds = GetInputDarksendRounds(vin);
+            balances.nDenominatedRounds += rounds;
+            balances.nDenominatedOutputs++;
+            if (nDepth >= 0)
+                balances.nNormalizedAnonymized += pcoin->vout[i].nValue * rounds / nDarksendRounds;
         }
     }
 
-    return nTotal;
+    if (!balances.IsNull())
+    {
+        balancesTotal += balances;
+        mapBalancesCounted[hash] = balances;
+    }
+
+    // below 6 confirmations InstantX locks add to the depth. Conflicted transactions only
+    // change with the mempool, a block or a lock, and the wallet is told about each of them
+    if (nDepth >= 0 && (pcoin->GetDepthInMainChain(false) < 6 || pcoin->GetBlocksToMaturity() > 0))
+        setBalancesUnsettled.insert(hash);
 }
 
-// Note: calculated including unconfirmed,
-// that's ok as long as we use it for informational purposes only
-double CWallet::GetAverageAnonymizedRounds() const
+const CWalletBalances& CWallet::GetBalances() const
 {
-    if(fLiteMode) return 0;
-
-    double fTotal = 0;
-    double fCount = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
 
+    if (!fBalancesCounted)
     {
-        LOCK2(cs_main, cs_wallet);
+        balancesTotal.SetNull();
+        mapBalancesCounted.clear();
+        setBalancesDirty.clear();
+        setBalancesUnsettled.clear();
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
+            CountBalances((*it).first);
+        fBalancesCounted = true;
+        return balancesTotal;
+    }
 
-            uint256 hash = (*it).first;
+    std::set<uint256> setCount;
+    setCount.swap(setBalancesDirty);
+    setCount.insert(setBalancesUnsettled.begin(), setBalancesUnsettled.end());
+    BOOST_FOREACH(const uint256& hash, setCount)
+        CountBalances(hash);
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
+    return balancesTotal;
+}
 
-                CTxIn vin = CTxIn(hash, i);
+CAmount CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nBalance;
+}
 
-                if(IsSpent(hash, i) || IsMine(pcoin->vout[i]) != ISMINE_SPENDABLE || !IsDenominated(vin)) continue;
+CAmount CWallet::GetAnonymizableBalance() const
+{
+    if(fLiteMode) return 0;
 
-                int rounds = GetInputDarksendRounds(vin);
-                fTotal += (float)rounds;
-                fCount += 1;
-            }
-        }
-    }
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nAnonymizable;
+}
 
-    if(fCount == 0) return 0;
+CAmount CWallet::GetAnonymizedBalance() const
+{
+    if(fLiteMode) return 0;
 
-    return fTotal/fCount;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nAnonymized;
 }
 
 // Note: calculated including unconfirmed,
 // that's ok as long as we use it for informational purposes only
-CAmount CWallet::GetNormalizedAnonymizedBalance() const
+double CWallet::GetAverageAnonymizedRounds() const
 {
     if(fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            uint256 hash = (*it).first;
-
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-
-                CTxIn vin = CTxIn(hash, i);
+    LOCK2(cs_main, cs_wallet);
+    const CWalletBalances& balances = GetBalances();
+    if(balances.nDenominatedOutputs == 0) return 0;
 
-                if(IsSpent(hash, i) || IsMine(pcoin->vout[i]) != ISMINE_SPENDABLE || !IsDenominated(vin)) continue;
-                if (pcoin->GetDepthInMainChain() < 0) continue;
+    return (double)balances.nDenominatedRounds/balances.nDenominatedOutputs;
+}
 
-                int rounds = GetInputDarksendRounds(vin);
-                nTotal += pcoin->vout[i].nValue * rounds / nDarksendRounds;
-            }
-        }
-    }
+// Note: calculated including unconfirmed,
+// that's ok as long as we use it for informational purposes only
+CAmount CWallet::GetNormalizedAnonymizedBalance() const
+{
+    if(fLiteMode) return 0;
 
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nNormalizedAnonymized;
 }
 
 CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 {
     if(fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            nTotal += pcoin->GetDenominatedCredit(unconfirmed);
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    const CWalletBalances& balances = GetBalances();
+    return unconfirmed ? balances.nDenominatedUnconfirmed : balances.nDenominatedConfirmed;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnly;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUnconfirmedWatchOnly;
+}
+
+CAmount CWallet::GetImmatureWatchOnlyBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmatureWatchOnly;
+}
+
+CWallet::CoinClass CWallet::GetCoinClass(CAmount nValue) const
+{
+    if (IsCollateralAmount(nValue))
+        return COINS_COLLATERAL;
+    if (IsDenominatedAmount(nValue))
+        return COINS_DENOMINATED;
+    if (nValue == 1000*COIN)
+        return COINS_MASTERNODE;
+    return COINS_OTHER;
+}
+
+bool CWallet::IsCoinClassAvailable(CoinClass nClass, AvailableCoinsType coin_type) const
+{
+    switch (coin_type)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
+    case ONLY_DENOMINATED:
+        return nClass == COINS_DENOMINATED;
+    case ONLY_NOT1000IFMN:
+        return !(fMasterNode && nClass == COINS_MASTERNODE);
+    case ONLY_NONDENOMINATED_NOT1000IFMN:
+        // do not use collateral amounts or Hot MN funds
+        return nClass == COINS_OTHER || (!fMasterNode && nClass == COINS_MASTERNODE);
+    default:
+        return true;
     }
-    return nTotal;
 }
 
-CAmount CWallet::GetImmatureWatchOnlyBalance() const
+/**
+ * Outpoint is spent by a wallet transaction in the main chain,
+ * it stays that way until that block is disconnected.
+ */
+bool CWallet::IsSpentInMainChain(const COutPoint& outpoint) const
 {
-    CAmount nTotal = 0;
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+    range = mapTxSpends.equal_range(outpoint);
+
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain(false) > 0)
+            return true;
     }
-    return nTotal;
+    return false;
+}
+
+void CWallet::IndexUnspentCoin(const COutPoint& outpoint) const
+{
+    AssertLockHeld(cs_wallet);
+
+    std::map<uint256, CWalletTx>::const_iterator it = mapWallet.find(outpoint.hash);
+    if (it == mapWallet.end() || outpoint.n >= it->second.vout.size())
+        return;
+
+    const CTxOut& txout = it->second.vout[outpoint.n];
+    if (txout.nValue > 0 && IsMine(txout) != ISMINE_NO)
+        setUnspentCoins[GetCoinClass(txout.nValue)].insert(outpoint);
+}
+
+/**
+ * Index every output of the wallet, the spent ones are dropped
+ * by the first AvailableCoins call that comes across them.
+ */
+void CWallet::IndexUnspentCoins() const
+{
+    AssertLockHeld(cs_wallet);
+
+    for (int nClass = 0; nClass < COINS_CLASSES; nClass++)
+        setUnspentCoins[nClass].clear();
+
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (unsigned int i = 0; i < it->second.vout.size(); i++)
+            IndexUnspentCoin(COutPoint(it->first, i));
+
+    fUnspentCoinsIndexed = true;
 }
 
 /**
@@ -1492,46 +1987,50 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!IsFinalTx(*pcoin))
-                continue;
-
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
-
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+        if (!fUnspentCoinsIndexed)
+            IndexUnspentCoins();
+
+        // in the order of mapWallet, like walking it would give
+        std::vector<COutPoint> vOutpoints;
+        for (int nClass = 0; nClass < COINS_CLASSES; nClass++)
+            if (IsCoinClassAvailable((CoinClass)nClass, coin_type))
+                vOutpoints.insert(vOutpoints.end(), setUnspentCoins[nClass].begin(), setUnspentCoins[nClass].end());
+        sort(vOutpoints.begin(), vOutpoints.end());
+
+        const CWalletTx* pcoin = NULL;
+        bool fAvailable = false;
+        int nDepth = 0;
+        BOOST_FOREACH(const COutPoint& outpoint, vOutpoints)
+        {
+            const uint256& wtxid = outpoint.hash;
+            unsigned int i = outpoint.n;
+
+            // transaction checks, once for all its outputs
+            if (pcoin == NULL || pcoin->GetHash() != wtxid)
+            {
+                pcoin = &mapWallet.find(wtxid)->second;
+                nDepth = pcoin->GetDepthInMainChain(false);
+
+                fAvailable = IsFinalTx(*pcoin) &&
+                    !(fOnlyConfirmed && !pcoin->IsTrusted()) &&
+                    !(pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0) &&
+                    // do not use IX for inputs that have less then 6 blockchain confirmations
+                    !(useIX && nDepth < 6);
+            }
+            if (!fAvailable)
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain(false);
-            // do not use IX for inputs that have less then 6 blockchain confirmations
-            if (useIX && nDepth < 6)
+            if (IsSpentInMainChain(outpoint))
+            {
+                setUnspentCoins[GetCoinClass(pcoin->vout[i].nValue)].erase(outpoint);
                 continue;
-
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                bool found = false;
-                if(coin_type == ONLY_DENOMINATED) {
-                    found = IsDenominatedAmount(pcoin->vout[i].nValue);
-                } else if(coin_type == ONLY_NOT1000IFMN) {
-                    found = !(fMasterNode && pcoin->vout[i].nValue == 1000*COIN);
-                } else if(coin_type == ONLY_NONDENOMINATED_NOT1000IFMN) {
-                    if (IsCollateralAmount(pcoin->vout[i].nValue)) continue; // do not use collateral amounts
-                    found = !IsDenominatedAmount(pcoin->vout[i].nValue);
-                    if(found && fMasterNode) found = pcoin->vout[i].nValue != 1000*COIN; // do not use Hot MN funds
-                } else {
-                    found = true;
-                }
-                if(!found) continue;
-
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                        vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
             }
+
+            isminetype mine = IsMine(pcoin->vout[i]);
+            if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
+                !IsLockedCoin(wtxid, i) &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i)))
+                    vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
         }
     }
 }
@@ -1940,23 +2439,20 @@ int CWallet::CountInputsWithAmount(int64_t nInputAmount)
     int64_t nTotal = 0;
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted()){
-                int nDepth = pcoin->GetDepthInMainChain(false);
+        if (!fUnspentCoinsIndexed)
+            IndexUnspentCoins();
 
-                for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                    COutput out = COutput(pcoin, i, nDepth, true);
-                    CTxIn vin = CTxIn(out.tx->GetHash(), out.i);
+        BOOST_FOREACH(const COutPoint& outpoint, setUnspentCoins[COINS_DENOMINATED])
+        {
+            const CWalletTx* pcoin = &mapWallet[outpoint.hash];
+            unsigned int i = outpoint.n;
+            if (pcoin->vout[i].nValue != nInputAmount) continue;
+            if (!pcoin->IsTrusted()) continue;
 
-                    if(out.tx->vout[out.i].nValue != nInputAmount) continue;
-                    if(!IsDenominatedAmount(pcoin->vout[i].nValue)) continue;
-                    if(IsSpent(out.tx->GetHash(), i) || IsMine(pcoin->vout[i]) != ISMINE_SPENDABLE || !IsDenominated(vin)) continue;
+            CTxIn vin = CTxIn(outpoint.hash, i);
+            if(IsSpent(outpoint.hash, i) || IsMine(pcoin->vout[i]) != ISMINE_SPENDABLE || !IsDenominated(vin)) continue;
 
-                    nTotal++;
-                }
-            }
+            nTotal++;
         }
     }
 
@@ -2536,6 +3032,13 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    // the scripts loaded aren't new to the transactions loaded with them
+    {
+        LOCK(cs_KeyStore);
+        setWalletScriptsAdded.clear();
+    }
+    UpdateMissingDarksendRounds();
+
     uiInterface.LoadWallet(this);
 
     return DB_LOAD_OK;
@@ -2969,6 +3472,8 @@ bool CWallet::UpdatedTransaction(const uint256 &hashTx)
         // Only notify UI if this transaction is in this wallet
         map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
         if (mi != mapWallet.end()){
+            // a lock makes a conflicted transaction count again
+            MarkBalancesDirty(hashTx);
             NotifyTransactionChanged(this, hashTx, CT_UPDATED);
             return true;
         }
@@ -2980,20 +3485,35 @@ void CWallet::LockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.insert(output);
+    MarkLockedCoinDirty(output);
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
     setLockedCoins.erase(output);
+    MarkLockedCoinDirty(output);
 }
 
 void CWallet::UnlockAllCoins()
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
+    BOOST_FOREACH(const COutPoint& output, setLockedCoins)
+        MarkLockedCoinDirty(output);
     setLockedCoins.clear();
 }
 
+// the anonymizable balance leaves locked coins out
+void CWallet::MarkLockedCoinDirty(const COutPoint& output)
+{
+    std::map<uint256, CWalletTx>::iterator it = mapWallet.find(output.hash);
+    if (it != mapWallet.end())
+    {
+        it->second.MarkDirty();
+        MarkBalancesDirty(output.hash);
+    }
+}
+
 bool CWallet::IsLockedCoin(uint256 hash, unsigned int n) const
 {
     AssertLockHeld(cs_wallet); // setLockedCoins
@@ -3257,23 +3777,12 @@ int CMerkleTx::GetTransactionLockSignatures() const
     if(!fEnableInstantX) return -1;
 
     //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
-    if (i != mapTxLocks.end()){
-        return (*i).second.CountSignatures();
-    }
-
-    return -1;
+    return txLockManager.CountSignatures(GetHash());
 }
 
 bool CMerkleTx::IsTransactionLockTimedOut() const
 {
     if(!fEnableInstantX) return 0;
 
-    //compile consessus vote
-    std::map<uint256, CTransactionLock>::iterator i = mapTxLocks.find(GetHash());
-    if (i != mapTxLocks.end()){
-        return GetTime() > (*i).second.nTimeout;
-    }
-
-    return false;
+    return txLockManager.IsLockTimedOut(GetHash());
 }
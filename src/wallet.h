@@ -28,6 +28,9 @@
 #include <utility>
 #include <vector>
 
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_set.hpp>
+
 /**
  * Settings
  */
@@ -48,6 +51,10 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 0.1 * COIN;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
+//! Blocks read ahead together while rescanning
+static const unsigned int WALLET_RESCAN_BATCH_BLOCKS = 64;
+//! Most threads reading blocks for a rescan
+static const int MAX_WALLET_RESCAN_THREADS = 8;
 
 class CAccountingEntry;
 class CCoinControl;
@@ -75,6 +82,89 @@ enum AvailableCoinsType
     ONLY_NONDENOMINATED_NOT1000IFMN = 4
 };
 
+/** Wallet balances, or what one wallet transaction adds to each of them */
+struct CWalletBalances
+{
+    CAmount nBalance;
+    CAmount nUnconfirmed;
+    CAmount nImmature;
+    CAmount nWatchOnly;
+    CAmount nUnconfirmedWatchOnly;
+    CAmount nImmatureWatchOnly;
+    CAmount nAnonymizable;
+    CAmount nAnonymized;
+    CAmount nNormalizedAnonymized;
+    CAmount nDenominatedConfirmed;
+    CAmount nDenominatedUnconfirmed;
+    // rounds of the unspent denominated outputs, for the average
+    int64_t nDenominatedRounds;
+    int64_t nDenominatedOutputs;
+
+    CWalletBalances()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nBalance = nUnconfirmed = nImmature = 0;
+        nWatchOnly = nUnconfirmedWatchOnly = nImmatureWatchOnly = 0;
+        nAnonymizable = nAnonymized = nNormalizedAnonymized = 0;
+        nDenominatedConfirmed = nDenominatedUnconfirmed = 0;
+        nDenominatedRounds = nDenominatedOutputs = 0;
+    }
+
+    bool IsNull() const
+    {
+        return nBalance == 0 && nUnconfirmed == 0 && nImmature == 0 &&
+            nWatchOnly == 0 && nUnconfirmedWatchOnly == 0 && nImmatureWatchOnly == 0 &&
+            nAnonymizable == 0 && nAnonymized == 0 && nNormalizedAnonymized == 0 &&
+            nDenominatedConfirmed == 0 && nDenominatedUnconfirmed == 0 &&
+            nDenominatedRounds == 0 && nDenominatedOutputs == 0;
+    }
+
+    CWalletBalances& operator+=(const CWalletBalances& b)
+    {
+        nBalance += b.nBalance;
+        nUnconfirmed += b.nUnconfirmed;
+        nImmature += b.nImmature;
+        nWatchOnly += b.nWatchOnly;
+        nUnconfirmedWatchOnly += b.nUnconfirmedWatchOnly;
+        nImmatureWatchOnly += b.nImmatureWatchOnly;
+        nAnonymizable += b.nAnonymizable;
+        nAnonymized += b.nAnonymized;
+        nNormalizedAnonymized += b.nNormalizedAnonymized;
+        nDenominatedConfirmed += b.nDenominatedConfirmed;
+        nDenominatedUnconfirmed += b.nDenominatedUnconfirmed;
+        nDenominatedRounds += b.nDenominatedRounds;
+        nDenominatedOutputs += b.nDenominatedOutputs;
+        return *this;
+    }
+
+    CWalletBalances& operator-=(const CWalletBalances& b)
+    {
+        nBalance -= b.nBalance;
+        nUnconfirmed -= b.nUnconfirmed;
+        nImmature -= b.nImmature;
+        nWatchOnly -= b.nWatchOnly;
+        nUnconfirmedWatchOnly -= b.nUnconfirmedWatchOnly;
+        nImmatureWatchOnly -= b.nImmatureWatchOnly;
+        nAnonymizable -= b.nAnonymizable;
+        nAnonymized -= b.nAnonymized;
+        nNormalizedAnonymized -= b.nNormalizedAnonymized;
+        nDenominatedConfirmed -= b.nDenominatedConfirmed;
+        nDenominatedUnconfirmed -= b.nDenominatedUnconfirmed;
+        nDenominatedRounds -= b.nDenominatedRounds;
+        nDenominatedOutputs -= b.nDenominatedOutputs;
+        return *this;
+    }
+};
+
+
+struct WalletScriptHasher
+{
+    size_t operator()(const CScript& script) const { return boost::hash_range(script.begin(), script.end()); }
+};
 
 /** A key pool entry */
 class CKeyPool
@@ -146,6 +236,69 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /// Fill in the Darksend rounds of wtx and of the wallet ancestors they're derived from,
+    /// the transactions that got their rounds filled in are added to pvComputed
+    void UpdateDarksendRounds(const CWalletTx& wtx, std::vector<const CWalletTx*>* pvComputed = NULL) const;
+    /// Recompute and store the rounds of the wallet transactions descending from outputs of hash
+    void UpdateDarksendRoundsOfSpenders(const uint256& hash, unsigned int nOutputs);
+    /// Compute and store the rounds of loaded transactions that have none
+    void UpdateMissingDarksendRounds();
+
+    /** Kinds of amounts the unspent coin index is split by, see AvailableCoinsType */
+    enum CoinClass
+    {
+        COINS_DENOMINATED,
+        COINS_COLLATERAL,
+        COINS_MASTERNODE,
+        COINS_OTHER,
+        COINS_CLASSES
+    };
+
+    /**
+     * Wallet outputs that may still be unspent, by kind of amount. An output is dropped once a
+     * transaction in the main chain spends it and put back if that transaction is disconnected,
+     * anything else that can change (depth, trust, locks, conflicts) is checked when queried.
+     */
+    mutable std::set<COutPoint> setUnspentCoins[COINS_CLASSES];
+    mutable bool fUnspentCoinsIndexed;
+
+    CoinClass GetCoinClass(CAmount nValue) const;
+    bool IsCoinClassAvailable(CoinClass nClass, AvailableCoinsType coin_type) const;
+    bool IsSpentInMainChain(const COutPoint& outpoint) const;
+    void IndexUnspentCoin(const COutPoint& outpoint) const;
+    void IndexUnspentCoins() const;
+
+    /**
+     * Running totals of the balances and what each transaction was counted with, only
+     * transactions that add something are kept. Changed transactions are counted again,
+     * and so are the unsettled ones (in the mempool, shallow or immature) on every query,
+     * as their part moves with blocks, the mempool and InstantX locks.
+     */
+    mutable CWalletBalances balancesTotal;
+    mutable std::map<uint256, CWalletBalances> mapBalancesCounted;
+    mutable std::set<uint256> setBalancesDirty;
+    mutable std::set<uint256> setBalancesUnsettled;
+    mutable bool fBalancesCounted;
+
+    /**
+     * scriptPubKeys paying our keys and redeem scripts, and the watch-only scripts, protected
+     * by cs_KeyStore. Removed watch-only scripts stay, the set only has to rule outputs out.
+     */
+    boost::unordered_set<CScript, WalletScriptHasher> setWalletScripts;
+    /// Scripts added to setWalletScripts since the last MarkDirty(), also protected by cs_KeyStore
+    std::set<CScript> setWalletScriptsAdded;
+
+    void AddWalletScript(const CScript& script);
+    void AddWalletScripts(const CPubKey& pubkey);
+    /// False if scriptPubKey has a standard form that can only be ours through setWalletScripts and isn't in it
+    bool MayBeMine(const CScript& scriptPubKey) const;
+
+    void MarkBalancesDirty(const uint256& hash);
+    void MarkLockedCoinDirty(const COutPoint& output);
+    void CountBalances(const uint256& hash) const;
+    /// Up to date totals, call with cs_main and cs_wallet held
+    const CWalletBalances& GetBalances() const;
+
 public:
 //    bool SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = true) const;
     bool SelectCoinsDark(int64_t nValueMin, int64_t nValueMax, std::vector<CTxIn>& setCoinsRet, int64_t& nValueRet, int nDarksendRoundsMin, int nDarksendRoundsMax) const;
@@ -207,6 +360,8 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fWalletUnlockAnonymizeOnly = false;
+        fUnspentCoinsIndexed = false;
+        fBalancesCounted = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -247,7 +402,7 @@ public:
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    bool LoadKey(const CKey& key, const CPubKey &pubkey);
     //! Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
 
@@ -347,7 +502,7 @@ public:
     bool GetBudgetSystemCollateralTX(CWalletTx& tx, uint256 hash, bool useIX);
 
     // get the Darksend chain depth for a given input
-    int GetRealInputDarksendRounds(CTxIn in, int rounds) const;
+    int GetRealInputDarksendRounds(CTxIn in) const;
     // respect current settings
     int GetInputDarksendRounds(CTxIn in) const;
 
@@ -360,6 +515,9 @@ public:
     CAmount GetDebit(const CTxIn& txin, const isminefilter& filter) const;
     isminetype IsMine(const CTxOut& txout) const
     {
+        // most outputs seen on the network are ruled out without running Solver
+        if (!MayBeMine(txout.scriptPubKey))
+            return ISMINE_NO;
         return ::IsMine(*this, txout.scriptPubKey);
     }
     CAmount GetCredit(const CTxOut& txout, const isminefilter& filter) const
@@ -530,6 +688,32 @@ static void WriteOrderPos(const int64_t& nOrderPos, mapValue_t& mapValue)
     mapValue["n"] = i64tostr(nOrderPos);
 }
 
+static void ReadDarksendRounds(std::vector<int>& vRounds, mapValue_t& mapValue)
+{
+    vRounds.clear();
+    if (!mapValue.count("dsrounds"))
+        return;
+    const std::string& str = mapValue["dsrounds"];
+    for (size_t nPos = 0; nPos <= str.size(); )
+    {
+        size_t nEnd = str.find(',', nPos);
+        if (nEnd == std::string::npos)
+            nEnd = str.size();
+        vRounds.push_back(atoi(str.substr(nPos, nEnd - nPos)));
+        nPos = nEnd + 1;
+    }
+}
+
+static void WriteDarksendRounds(const std::vector<int>& vRounds, mapValue_t& mapValue)
+{
+    if (vRounds.empty())
+        return;
+    std::string str;
+    BOOST_FOREACH(int nRounds, vRounds)
+        str += (str.empty() ? "" : ",") + itostr(nRounds);
+    mapValue["dsrounds"] = str;
+}
+
 struct COutputEntry
 {
     CTxDestination destination;
@@ -616,6 +800,8 @@ public:
     char fFromMe;
     std::string strFromAccount;
     int64_t nOrderPos; //! position in ordered transaction list
+    //! Darksend rounds of each output, empty until CWallet computes them
+    mutable std::vector<int> vDarksendRounds;
 
     // memory only
     mutable bool fDebitCached;
@@ -702,6 +888,7 @@ public:
         nImmatureWatchCreditCached = 0;
         nChangeCached = 0;
         nOrderPos = -1;
+        vDarksendRounds.clear();
     }
 
     ADD_SERIALIZE_METHODS;
@@ -720,6 +907,8 @@ public:
 
             if (nTimeSmart)
                 mapValue["timesmart"] = strprintf("%u", nTimeSmart);
+
+            WriteDarksendRounds(vDarksendRounds, mapValue);
         }
 
         READWRITE(*(CMerkleTx*)this);
@@ -739,6 +928,8 @@ public:
             ReadOrderPos(nOrderPos, mapValue);
 
             nTimeSmart = mapValue.count("timesmart") ? (unsigned int)atoi64(mapValue["timesmart"]) : 0;
+
+            ReadDarksendRounds(vDarksendRounds, mapValue);
         }
 
         mapValue.erase("fromaccount");
@@ -746,6 +937,7 @@ public:
         mapValue.erase("spent");
         mapValue.erase("n");
         mapValue.erase("timesmart");
+        mapValue.erase("dsrounds");
     }
 
     //! make sure balances are recalculated